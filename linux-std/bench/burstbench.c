@@ -0,0 +1,424 @@
+/*
+    burstbench.c -- 接続が一度に集中したときのaccept queueの溢れを測るツール
+
+    $ gcc -O2 -o burstbench burstbench.c
+    $ ./burstbench [--host=127.0.0.1] [--port=80] [--burst=n] [--rounds=n]
+                   [--interval=msec] [--json] [--label=name] [path]
+
+    1ラウンドごとにburst本の接続をノンブロッキングのconnectで同時に始め、
+    それぞれでConnection: closeのGETを1回送って、閉じられるまでの時間を測る。
+    accept queue(listenのbacklog)から溢れたSYNはサーバに捨てられ、クライアントは
+    再送(最初は1秒後)するので、1秒以上かかった接続の数がそのまま溢れの影響になる。
+    あわせて/proc/net/netstatのTcpExt: ListenOverflows/ListenDropsの増分を出す
+    (ホスト全体のカウンタなので、ほかにTCPのサーバが忙しくしていないときに測る)。
+
+    変更前(backlog 5)と変更後(somaxconn)を比べる:
+    $ ../syakyou/httpd2 --debug --port=8080 --engine=epoll --backlog=5 /tmp/www &
+    $ ./burstbench --port=8080 --burst=1000 --label=backlog5 /index.html
+    $ ../syakyou/httpd2 --debug --port=8081 --engine=epoll /tmp/www &
+    $ ./burstbench --port=8081 --burst=1000 --label=somaxconn /index.html
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <getopt.h>
+
+/****** Constants ********************************************************/
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "80" // httpd2と同じ
+#define DEFAULT_BURST 1000
+#define DEFAULT_ROUNDS 5
+#define DEFAULT_INTERVAL 500 // ラウンドの間隔(ミリ秒)
+#define ROUND_TIMEOUT 15000 // これを過ぎても終わらない接続は失敗にする(ミリ秒)
+#define SLOW_THRESHOLD 1000000000L // SYNの再送を待ったとみなす時間(ナノ秒)
+#define MAX_EVENTS 256
+#define NETSTAT_PATH "/proc/net/netstat"
+
+/****** Data Type Definitions ********************************************/
+
+enum ConnState {
+    CONN_CONNECTING,
+    CONN_SENDING,
+    CONN_RECEIVING,
+    CONN_DONE
+};
+
+struct Conn {
+    int fd;
+    enum ConnState state;
+    size_t sent; // リクエストのうち送信済みのバイト数
+    long received; // 受信したバイト数
+};
+
+// 1回の測定の結果
+struct Result {
+    long connections;
+    long completed; // レスポンスを最後まで受け取った接続数
+    long errors; // 接続や送受信に失敗した, またはタイムアウトした接続数
+    long slow; // SLOW_THRESHOLD以上かかった接続数
+    long overflows; // TcpExt: ListenOverflowsの増分
+    long drops; // TcpExt: ListenDropsの増分
+    long *latency; // 完了した接続ごとの時間(ナノ秒)
+};
+
+/****** Function Prototypes **********************************************/
+
+static void run_round(struct Result *r);
+static int conn_send(struct Conn *c);
+static int conn_recv(struct Conn *c);
+static void read_listen_stats(long *overflows, long *drops);
+static int compare_long(const void *a, const void *b);
+static long percentile(struct Result *r, double p);
+static void report_text(struct Result *r);
+static void report_json(struct Result *r);
+static void raise_fd_limit(int need);
+static long now_nsec(void);
+static void* xmalloc(size_t sz);
+static void die(const char *fmt, ...);
+
+/****** Functions ********************************************************/
+
+static char *host = DEFAULT_HOST;
+static char *port = DEFAULT_PORT;
+static int burst = DEFAULT_BURST;
+static int rounds = DEFAULT_ROUNDS;
+static int interval = DEFAULT_INTERVAL;
+static int json_mode = 0;
+static char *label = "";
+static char request[1024];
+static size_t request_len;
+static struct sockaddr_storage server_addr;
+static socklen_t server_addrlen;
+
+#define USAGE "Usage: %s [--host=addr] [--port=n] [--burst=n] [--rounds=n]\n"\
+    "    [--interval=msec] [--json] [--label=name] [path]\n"
+
+static struct option longopts[] = {
+    {"host",     required_argument, NULL, 'H'},
+    {"port",     required_argument, NULL, 'p'},
+    {"burst",    required_argument, NULL, 'b'},
+    {"rounds",   required_argument, NULL, 'r'},
+    {"interval", required_argument, NULL, 'i'},
+    {"json",     no_argument,       NULL, 'j'},
+    {"label",    required_argument, NULL, 'l'},
+    {"help",     no_argument,       NULL, 'h'},
+    {0, 0, 0, 0}
+};
+
+int main(int argc, char *argv[])
+{
+    struct addrinfo hints, *res;
+    struct Result result;
+    struct timespec pause;
+    char *path = "/";
+    long overflows, drops;
+    int opt, err, i;
+
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'b':
+            burst = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'j':
+            json_mode = 1;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        case 'h':
+            fprintf(stdout, USAGE, argv[0]);
+            exit(0);
+        case '?':
+            fprintf(stderr, USAGE, argv[0]);
+            exit(1);
+        }
+    }
+    if (burst < 1) die("--burst must be positive");
+    if (rounds < 1) die("--rounds must be positive");
+    if (interval < 0) die("--interval must not be negative");
+    if (optind < argc) path = argv[optind];
+    request_len = snprintf(request, sizeof request,
+                           "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", path, host);
+    if (request_len >= sizeof request) die("path too long");
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(host, port, &hints, &res)) != 0)
+        die("getaddrinfo(3): %s", gai_strerror(err));
+    memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
+    server_addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit(burst + 16);
+
+    memset(&result, 0, sizeof result);
+    result.latency = xmalloc(sizeof(long) * burst * rounds);
+    read_listen_stats(&overflows, &drops);
+    pause.tv_sec = interval / 1000;
+    pause.tv_nsec = (interval % 1000) * 1000000L;
+    for (i = 0; i < rounds; i++) {
+        if (i > 0) nanosleep(&pause, NULL);
+        run_round(&result);
+    }
+    read_listen_stats(&result.overflows, &result.drops);
+    result.overflows -= overflows;
+    result.drops -= drops;
+    qsort(result.latency, result.completed, sizeof(long), compare_long);
+    if (json_mode)
+        report_json(&result);
+    else
+        report_text(&result);
+    exit(0);
+}
+
+// burst本の接続を同時に始め、すべて終わるまで待つ
+static void run_round(struct Result *r)
+{
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct Conn *conns;
+    long start, deadline;
+    int epfd, active = 0, i, n;
+
+    conns = xmalloc(sizeof(struct Conn) * burst);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) die("epoll_create1(2): %s", strerror(errno));
+    start = now_nsec();
+    deadline = start + ROUND_TIMEOUT * 1000000L;
+    for (i = 0; i < burst; i++) {
+        struct Conn *c = &conns[i];
+
+        c->sent = 0;
+        c->received = 0;
+        c->state = CONN_DONE;
+        r->connections++;
+        c->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (c->fd < 0) die("socket(2): %s", strerror(errno));
+        if (connect(c->fd, (struct sockaddr *)&server_addr, server_addrlen) < 0 && errno != EINPROGRESS) {
+            close(c->fd);
+            r->errors++;
+            continue;
+        }
+        c->state = CONN_CONNECTING;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) die("epoll_ctl(2): %s", strerror(errno));
+        active++;
+    }
+    while (active > 0) {
+        long now = now_nsec();
+
+        if (now >= deadline) break;
+        n = epoll_wait(epfd, events, MAX_EVENTS, (int)((deadline - now) / 1000000) + 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            die("epoll_wait(2): %s", strerror(errno));
+        }
+        for (i = 0; i < n; i++) {
+            struct Conn *c = events[i].data.ptr;
+            int ok = 1;
+
+            if (c->state == CONN_CONNECTING) {
+                int soerr = 0;
+                socklen_t len = sizeof soerr;
+
+                if (!(events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) continue;
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &soerr, &len);
+                if (soerr != 0) ok = 0;
+                else c->state = CONN_SENDING;
+            }
+            if (ok && c->state == CONN_SENDING) ok = conn_send(c);
+            if (ok && c->state == CONN_RECEIVING) ok = conn_recv(c);
+            if (!ok) {
+                r->errors++;
+            } else if (c->state == CONN_DONE) {
+                long t = now_nsec() - start;
+
+                r->latency[r->completed++] = t;
+                if (t >= SLOW_THRESHOLD) r->slow++;
+            } else {
+                continue;
+            }
+            close(c->fd);
+            c->state = CONN_DONE;
+            active--;
+        }
+    }
+    // タイムアウトした接続
+    for (i = 0; i < burst; i++) {
+        if (conns[i].state != CONN_DONE) {
+            close(conns[i].fd);
+            r->errors++;
+        }
+    }
+    close(epfd);
+    free(conns);
+}
+
+// 送れるだけ送る。失敗したら0を返す
+static int conn_send(struct Conn *c)
+{
+    while (c->sent < request_len) {
+        ssize_t n = send(c->fd, request + c->sent, request_len - c->sent, MSG_NOSIGNAL);
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        c->sent += n;
+    }
+    c->state = CONN_RECEIVING;
+    return 1;
+}
+
+// サーバが閉じるまで読み捨てる。失敗したら0を返す
+static int conn_recv(struct Conn *c)
+{
+    char buf[16 * 1024];
+
+    for (;;) {
+        ssize_t n = recv(c->fd, buf, sizeof buf, 0);
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        if (n == 0) {
+            if (c->received == 0) return 0; // 何も返さずに閉じられた
+            c->state = CONN_DONE;
+            return 1;
+        }
+        c->received += n;
+    }
+}
+
+// /proc/net/netstatは"TcpExt: 名前..."の行と"TcpExt: 値..."の行が対になっている
+static void read_listen_stats(long *overflows, long *drops)
+{
+    char names[8192], values[8192];
+    char *np, *vp, *nsave, *vsave;
+    FILE *f;
+
+    *overflows = *drops = 0;
+    f = fopen(NETSTAT_PATH, "r");
+    if (!f) return;
+    while (fgets(names, sizeof names, f) && fgets(values, sizeof values, f)) {
+        if (strncmp(names, "TcpExt:", 7) != 0) continue;
+        np = strtok_r(names, " \n", &nsave);
+        vp = strtok_r(values, " \n", &vsave);
+        while ((np = strtok_r(NULL, " \n", &nsave)) && (vp = strtok_r(NULL, " \n", &vsave))) {
+            if (strcmp(np, "ListenOverflows") == 0) *overflows = atol(vp);
+            else if (strcmp(np, "ListenDrops") == 0) *drops = atol(vp);
+        }
+        break;
+    }
+    fclose(f);
+}
+
+static int compare_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// 完了した接続の時間のp分位(ミリ秒)
+static long percentile(struct Result *r, double p)
+{
+    long idx;
+
+    if (r->completed == 0) return 0;
+    idx = (long)(r->completed * p);
+    if (idx >= r->completed) idx = r->completed - 1;
+    return r->latency[idx] / 1000000;
+}
+
+static void report_text(struct Result *r)
+{
+    printf("%s%s%d rounds x %d connections to %s:%s\n", label, label[0] ? ": " : "",
+           rounds, burst, host, port);
+    printf("  completed: %ld, errors: %ld, slow (>=1s, SYN retransmitted): %ld\n",
+           r->completed, r->errors, r->slow);
+    printf("  latency(ms): p50 %ld, p90 %ld, p99 %ld, max %ld\n",
+           percentile(r, 0.5), percentile(r, 0.9), percentile(r, 0.99), percentile(r, 1.0));
+    printf("  TcpExt: ListenOverflows +%ld, ListenDrops +%ld\n", r->overflows, r->drops);
+}
+
+static void report_json(struct Result *r)
+{
+    printf("{\"label\":\"%s\",\"rounds\":%d,\"burst\":%d,\"connections\":%ld,\"completed\":%ld,"
+           "\"errors\":%ld,\"slow\":%ld,\"p50_ms\":%ld,\"p90_ms\":%ld,\"p99_ms\":%ld,\"max_ms\":%ld,"
+           "\"listen_overflows\":%ld,\"listen_drops\":%ld}\n",
+           label, rounds, burst, r->connections, r->completed, r->errors, r->slow,
+           percentile(r, 0.5), percentile(r, 0.9), percentile(r, 0.99), percentile(r, 1.0),
+           r->overflows, r->drops);
+}
+
+// 同時に開く接続の数だけfdを使えるようにする
+static void raise_fd_limit(int need)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) return;
+    if (rl.rlim_cur >= (rlim_t)need) return;
+    rl.rlim_cur = rl.rlim_max < (rlim_t)need ? rl.rlim_max : (rlim_t)need;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < (rlim_t)need) die("--burst too large for RLIMIT_NOFILE %ld", (long)rl.rlim_cur);
+}
+
+static long now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void* xmalloc(size_t sz)
+{
+    void *p;
+
+    p = malloc(sz);
+    if (!p) die("failed to allocate memory");
+    return p;
+}
+
+static void die(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    fprintf(stderr, "burstbench: ");
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(1);
+}
@@ -0,0 +1,286 @@
+/*
+    fuzzconn.c -- httpd2の接続処理に、壊したリクエストを流し続けるファジングドライバ
+
+    $ gcc -O1 -g -fsanitize=address,undefined -fno-sanitize-recover=undefined \
+          -Wno-unused-function -o fuzzconn fuzzconn.c -lz
+    $ ./fuzzconn [iterations] [seed]
+
+    httpd2.cをそのままincludeして、ループバックのTCP接続1本ごとに
+    正しいリクエストの種を突然変異させたバイト列を、ばらばらの大きさに切って送る。
+    サーバ側はepoll版と同じノンブロッキングのrun_connection()で動かすので、
+    connection_read()/connection_parse()からボディ(feed_chunked()を含む)、レスポンスの送信まで通る。
+    種と変異は固定のseedの擬似乱数で決まるので、同じ引数なら同じ入力を繰り返せる。
+
+    AddressSanitizer/UndefinedBehaviorSanitizerでビルドすれば、範囲外アクセスや未定義動作で止まり、
+    終了時のLeakSanitizerがリクエストごとの解放漏れを報告して、終了コードが0でなくなる。
+    fdの閉じ忘れと、接続が閉じずに止まってしまうことはこのドライバ自身が調べる。
+*/
+
+#define HTTPD2_NO_MAIN
+#include "../syakyou/httpd2.c"
+
+#define FUZZ_MAX_INPUT (3 * REQUEST_BUF_SIZE) // 変異させた入力の上限
+#define FUZZ_MAX_STEPS 10000 // これだけ回しても接続が閉じなければ止まったとみなす
+#define FUZZ_BIG_FILE_SIZE (200 * 1024) // sendfileとRangeを通すためのファイル
+
+// 変異させる元のリクエスト
+static char *seeds[] = {
+    "GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n",
+    "GET / HTTP/1.0\r\n\r\n",
+    "HEAD /big.bin HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n",
+    "GET /big.bin HTTP/1.1\r\nRange: bytes=0-99,1000-1999,-50\r\n\r\n",
+    "GET /index.html HTTP/1.1\r\nIf-None-Match: \"x\", *\r\nIf-Modified-Since: Tue, 16 Jan 2024 09:12:44 GMT\r\n\r\n",
+    "GET /dir/ HTTP/1.1\r\nAccept-Encoding: gzip, br;q=0\r\n\r\n",
+    "GET /dir HTTP/1.1\r\n\r\nGET /a%20b.txt HTTP/1.1\r\n\r\nGET /index.html HTTP/1.1\r\n\r\n",
+    "POST /index.html HTTP/1.1\r\nContent-Length: 11\r\n\r\nhello world",
+    "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+    "5\r\nhello\r\n6;ext=1\r\n world\r\n0\r\nTrailer: x\r\n\r\n"
+    "GET /index.html HTTP/1.1\r\n\r\n",
+    "PUT /x HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\nA\r\n0123456789\r\n0\r\n\r\n",
+    "POST / HTTP/1.1\r\nContent-Length: 1048577\r\n\r\n",
+    "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nFFFFFFFFFF\r\n",
+    "GET /aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+    "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa HTTP/1.1\r\n"
+    "X-A: 1\r\nX-B: 2\r\nX-C: 3\r\nX-D: 4\r\nX-E: 5\r\nX-F: 6\r\nX-G: 7\r\nX-H: 8\r\n\r\n",
+    "OPTIONS * HTTP/1.1\r\n\r\n",
+    "GET /__stats HTTP/1.1\r\n\r\n",
+};
+
+#define NSEEDS (sizeof seeds / sizeof seeds[0])
+
+// 区切りや数字など、パーサが特別に扱うバイト
+static char interesting[] = ":\r\n %/.;,=-*0123456789aAfFxX\t\"\x00\x7f\x80\xff";
+
+static unsigned long long random_state;
+
+// xorshift64*: libcのrand()と違い、どこで動かしても同じ列になる
+static unsigned long next_random(void)
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (random_state * 2685821657736338717ULL) >> 32;
+}
+
+static size_t random_below(size_t n)
+{
+    return n ? next_random() % n : 0;
+}
+
+// bufのlenバイトを1回変異させ、新しい長さを返す
+static size_t mutate(char *buf, size_t len)
+{
+    size_t pos = random_below(len + 1), n;
+    char *other;
+
+    switch (random_below(8)) {
+    case 0: // 1ビット反転
+        if (len > 0) buf[pos % len] ^= 1 << random_below(8);
+        break;
+    case 1: // 特別なバイトに置き換える
+        if (len > 0) buf[pos % len] = interesting[random_below(sizeof interesting - 1)];
+        break;
+    case 2: // 特別なバイトを挿入する
+        if (len >= FUZZ_MAX_INPUT) break;
+        memmove(buf + pos + 1, buf + pos, len - pos);
+        buf[pos] = interesting[random_below(sizeof interesting - 1)];
+        len++;
+        break;
+    case 3: // 範囲を消す
+        n = random_below(len - pos + 1);
+        memmove(buf + pos, buf + pos + n, len - pos - n);
+        len -= n;
+        break;
+    case 4: // 範囲を繰り返して長くする(バッファの上限や巨大な数を作る)
+        n = random_below(len - pos + 1);
+        while (n > 0 && len + n <= FUZZ_MAX_INPUT && random_below(8)) {
+            memmove(buf + pos + n, buf + pos, len - pos);
+            len += n;
+        }
+        break;
+    case 5: // 途中で切る
+        len = pos;
+        break;
+    case 6: // 別の種の後半をつなぐ
+        other = seeds[random_below(NSEEDS)];
+        n = strlen(other);
+        n = n - random_below(n + 1);
+        if (pos + n > FUZZ_MAX_INPUT) n = FUZZ_MAX_INPUT - pos;
+        memcpy(buf + pos, other + strlen(other) - n, n);
+        len = pos + n;
+        break;
+    case 7: // ランダムなバイトで上書きする
+        for (n = random_below(16); n > 0 && pos < len; n--, pos++)
+            buf[pos] = next_random();
+        break;
+    }
+    return len;
+}
+
+// ループバックで1本つなぎ、クライアント側を*clientに、サーバ側を戻り値で返す
+static int connect_pair(int server, int *client)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof addr;
+    int sock;
+
+    getsockname(server, (struct sockaddr*)&addr, &addrlen);
+    *client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (*client < 0 || connect(*client, (struct sockaddr*)&addr, addrlen) < 0)
+        log_exit("connect(2) failed: %s", strerror(errno));
+    sock = accept4(server, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sock < 0) log_exit("accept(2) failed: %s", strerror(errno));
+    set_nonblocking(*client);
+    return sock;
+}
+
+// inputを少しずつ送りながら、接続が閉じるまでサーバ側を回す
+// 閉じなければ0を返す
+static int run_input(struct Connection *conn, int server, char *input, size_t len, char *docroot)
+{
+    char sink[65536];
+    size_t sent = 0;
+    int client, step, eof_sent = 0;
+
+    init_connection(conn, connect_pair(server, &client));
+    for (step = 0; step < FUZZ_MAX_STEPS; step++) {
+        if (sent < len) {
+            ssize_t n = write(client, input + sent, 1 + random_below(len - sent));
+
+            if (n > 0) sent += n;
+        } else if (!eof_sent) { // 全部送ったら相手が閉じたことにする
+            shutdown(client, SHUT_WR);
+            eof_sent = 1;
+        }
+        run_connection(conn, docroot);
+        while (read(client, sink, sizeof sink) > 0) // レスポンスは読み捨てる
+            ;
+        if (conn->state == CONN_CLOSED) break;
+    }
+    finish_connection(conn);
+    close(client);
+    return step < FUZZ_MAX_STEPS;
+}
+
+static void write_file(char *path, char *data, size_t len)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0 || write(fd, data, len) != (ssize_t)len) log_exit("%s: %s", path, strerror(errno));
+    close(fd);
+}
+
+// 種のリクエストが指すファイルをdocrootに用意する
+static void make_docroot(char *docroot)
+{
+    char path[PATH_MAX];
+    char *big = xmalloc(FUZZ_BIG_FILE_SIZE);
+
+    memset(big, 'x', FUZZ_BIG_FILE_SIZE);
+    snprintf(path, sizeof path, "%s/index.html", docroot);
+    write_file(path, "<html><body>hello</body></html>\n", 33);
+    snprintf(path, sizeof path, "%s/a b.txt", docroot);
+    write_file(path, "a b\n", 4);
+    snprintf(path, sizeof path, "%s/big.bin", docroot);
+    write_file(path, big, FUZZ_BIG_FILE_SIZE);
+    snprintf(path, sizeof path, "%s/dir", docroot);
+    mkdir(path, 0755);
+    snprintf(path, sizeof path, "%s/dir/<i>.txt", docroot);
+    write_file(path, "i\n", 2);
+    free(big);
+}
+
+static void remove_docroot(char *docroot)
+{
+    char *names[] = {"dir/<i>.txt", "dir", "big.bin", "a b.txt", "index.html", ""};
+    char path[PATH_MAX];
+    size_t i;
+
+    for (i = 0; i < sizeof names / sizeof names[0]; i++) {
+        snprintf(path, sizeof path, "%s/%s", docroot, names[i]);
+        remove(path);
+    }
+}
+
+// 使われていない一番小さいfd番号
+static int lowest_free_fd(void)
+{
+    int fd = dup(0);
+
+    close(fd);
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 20000;
+    unsigned long long seed = argc > 2 ? strtoull(argv[2], NULL, 0) : 1;
+    char docroot[] = "/tmp/fuzzconn.XXXXXX";
+    char input[FUZZ_MAX_INPUT];
+    struct Scanner *scanners[3];
+    struct Connection *conn;
+    struct sockaddr_in addr;
+    size_t len, nscanners = 0;
+    long i, stuck = 0;
+    int server, fd_base, k;
+
+    debug_mode = 1; // log_exit()をstderrに出す
+    random_state = seed ? seed : 1;
+    trap_signal(SIGPIPE, SIG_IGN);
+    scanners[nscanners++] = &scalar_scanner;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) scanners[nscanners++] = &sse42_scanner;
+    if (__builtin_cpu_supports("avx2")) scanners[nscanners++] = &avx2_scanner;
+#endif
+    if (!mkdtemp(docroot)) log_exit("mkdtemp(3) failed: %s", strerror(errno));
+    make_docroot(docroot);
+    init_static_header_fields();
+    init_mime_types(DEFAULT_MIME_TYPES, 0);
+    init_file_cache(0);
+    autoindex_enabled = 1;
+    keepalive_timeout = 1;
+
+    server = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (server < 0 || bind(server, (struct sockaddr*)&addr, sizeof addr) < 0 || listen(server, 16) < 0)
+        log_exit("failed to listen on loopback: %s", strerror(errno));
+    conn = alloc_connection();
+    fd_base = lowest_free_fd();
+
+    for (i = 0; i < iterations; i++) {
+        char *seed_req = seeds[random_below(NSEEDS)];
+
+        scanner = scanners[i % nscanners];
+        len = strlen(seed_req);
+        memcpy(input, seed_req, len);
+        for (k = random_below(4); k > 0; k--) // 0回なら種のまま(正しいリクエストも通す)
+            len = mutate(input, len);
+        if (!run_input(conn, server, input, len, docroot)) {
+            fprintf(stderr, "iteration %ld: connection did not close\n", i);
+            stuck++;
+        }
+    }
+
+    // 後片付け: 残ったものはLeakSanitizerが解放漏れとして報告する
+    while (file_cache.tail) drop_file(file_cache.tail);
+    free(conn->res.head.ptr);
+    arena_free(&conn->arena);
+    free(conn);
+    if (lowest_free_fd() != fd_base) {
+        fprintf(stderr, "file descriptors leaked (lowest free fd %d -> %d)\n", fd_base, lowest_free_fd());
+        stuck++;
+    }
+    close(server);
+    remove_docroot(docroot);
+    // どこまで届いたかの目安: 正しく処理できたものと断ったものの両方が出ていること
+    printf("%ld inputs, seed %llu: %lu requests, %lu body bytes, status",
+           iterations, seed, stats->requests, stats->request_body_bytes);
+    for (k = 0; k < STATS_NSTATUS; k++) {
+        if (stats->status[k]) printf(" %d:%lu", STATS_MIN_STATUS + k, stats->status[k]);
+    }
+    printf("\n%ld failed\n", stuck);
+    exit(stuck ? 1 : 0);
+}
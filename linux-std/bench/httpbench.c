@@ -0,0 +1,698 @@
+/*
+    httpbench.c -- httpd2を測るためのHTTP負荷生成ツール
+
+    $ gcc -O2 -pthread -o httpbench httpbench.c
+    $ ./httpbench [--host=127.0.0.1] [--port=80] [--threads=n] [--connections=n]
+                  [--duration=sec] [--close] [--json] [--label=name] [path...]
+
+    スレッドごとにepollで複数の接続を持ち、レスポンスが返るたびに次のリクエストを送る
+    (クローズドループ)。既定ではkeep-aliveで同じ接続を使い続け、--closeなら
+    リクエストごとに接続し直す(レイテンシには接続の時間も含む)。
+    pathを複数指定すると接続ごとに順番に使う。
+
+    レイテンシはマイクロ秒単位の対数線形ヒストグラム(誤差2%以内)に記録して、
+    スループットとp50/p90/p99/p999を出す。--jsonなら結果を1行のJSONで出すので、
+    --labelでビルドやエンジンの名前を付けて並べれば比較できる。
+
+    $ ../syakyou/httpd2 --debug --port=8080 --engine=epoll /tmp/www &
+    $ ./httpbench --port=8080 --connections=64 --json --label=epoll /index.html
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+
+/****** Constants ********************************************************/
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "80" // httpd2と同じ
+#define DEFAULT_THREADS 2
+#define DEFAULT_CONNECTIONS 32
+#define DEFAULT_DURATION 10
+#define MAX_THREADS 256
+#define MAX_EVENTS 256
+#define HEAD_BUF_SIZE (16 * 1024) // レスポンスのステータスライン+ヘッダを溜めるバッファ
+#define BODY_BUF_SIZE (256 * 1024) // ボディは読み捨てる
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS) // 2の冪の区間ごとのバケット数
+#define HIST_BUCKETS (HIST_SUB * 2 + HIST_SUB * 40)
+
+/****** Data Type Definitions ********************************************/
+
+// 対数線形ヒストグラム: 2*HIST_SUB未満はそのまま、それ以上は2の冪の区間をHIST_SUB等分する
+struct Histogram {
+    long count;
+    long sum;
+    long min, max;
+    long buckets[HIST_BUCKETS];
+};
+
+enum ConnState {
+    CONN_CONNECTING,
+    CONN_SENDING,
+    CONN_RECV_HEAD,
+    CONN_RECV_BODY
+};
+
+struct Worker;
+
+// 1本の接続の状態
+struct Conn {
+    int fd; // 未接続なら-1
+    enum ConnState state;
+    struct Worker *worker;
+    int path; // 次に使うpathの番号
+    size_t sent; // リクエストのうち送信済みのバイト数
+    char head[HEAD_BUF_SIZE];
+    size_t len; // headに読み込んだバイト数
+    long body_left; // ボディの残りバイト数, Content-Lengthがなければ-1(閉じるまで)
+    int status;
+    int server_close; // サーバが接続を閉じると言ったら非ゼロ
+    long started; // リクエストを始めた時刻(ナノ秒)
+};
+
+// 1スレッドぶんの負荷と結果
+struct Worker {
+    pthread_t thread;
+    int epfd;
+    struct Conn *conns;
+    int nconns;
+    long deadline; // この時刻(ナノ秒)を過ぎたら新しいリクエストを始めない
+    char body[BODY_BUF_SIZE];
+    // 結果
+    long requests; // 完了したリクエスト数
+    long bytes; // 受信したバイト数
+    long status[6]; // ステータスコードの百の位ごとの数(1xx..5xx, 0はそれ以外)
+    long connect_errors;
+    long io_errors;
+    struct Histogram latency;
+};
+
+/****** Function Prototypes **********************************************/
+
+static void* worker_main(void *arg);
+static void start_request(struct Conn *c);
+static void handle_conn(struct Conn *c);
+static int conn_send(struct Conn *c);
+static int conn_recv_head(struct Conn *c);
+static int conn_recv_body(struct Conn *c);
+static int parse_response_head(struct Conn *c, char *end);
+static void finish_request(struct Conn *c);
+static void fail_request(struct Conn *c, long *counter);
+static void close_conn(struct Conn *c);
+static long now_nsec(void);
+static void hist_record(struct Histogram *h, long v);
+static void hist_merge(struct Histogram *dst, struct Histogram *src);
+static long hist_percentile(struct Histogram *h, double p);
+static int hist_index(long v);
+static long hist_upper(int idx);
+static void build_requests(char **paths, int npaths);
+static void report_text(struct Worker *total, double elapsed);
+static void report_json(struct Worker *total, double elapsed);
+static void print_json_string(const char *s);
+static void* xmalloc(size_t sz);
+static void die(const char *fmt, ...);
+
+/****** Functions ********************************************************/
+
+static char *host = DEFAULT_HOST;
+static char *port = DEFAULT_PORT;
+static int nthreads = DEFAULT_THREADS;
+static int nconnections = DEFAULT_CONNECTIONS;
+static int duration = DEFAULT_DURATION;
+static int close_mode = 0;
+static int json_mode = 0;
+static char *label = "";
+static char **paths;
+static int npaths;
+static char **requests; // pathごとに組み立てたリクエスト
+static size_t *request_lens;
+static struct sockaddr_storage server_addr;
+static socklen_t server_addrlen;
+
+#define USAGE "Usage: %s [--host=addr] [--port=n] [--threads=n] [--connections=n]\n"\
+    "    [--duration=sec] [--close] [--json] [--label=name] [path...]\n"
+
+static struct option longopts[] = {
+    {"host",        required_argument, NULL, 'H'},
+    {"port",        required_argument, NULL, 'p'},
+    {"threads",     required_argument, NULL, 't'},
+    {"connections", required_argument, NULL, 'c'},
+    {"duration",    required_argument, NULL, 'd'},
+    {"close",       no_argument,       NULL, 'C'},
+    {"json",        no_argument,       NULL, 'j'},
+    {"label",       required_argument, NULL, 'l'},
+    {"help",        no_argument,       NULL, 'h'},
+    {0, 0, 0, 0}
+};
+
+int main(int argc, char *argv[])
+{
+    static char *default_paths[] = {"/"};
+    struct addrinfo hints, *res;
+    struct Worker *workers, total;
+    long start, end;
+    int opt, err, i, j, k;
+
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'c':
+            nconnections = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'C':
+            close_mode = 1;
+            break;
+        case 'j':
+            json_mode = 1;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        case 'h':
+            fprintf(stdout, USAGE, argv[0]);
+            exit(0);
+        case '?':
+            fprintf(stderr, USAGE, argv[0]);
+            exit(1);
+        }
+    }
+    if (nthreads < 1 || nthreads > MAX_THREADS) die("--threads must be 1..%d", MAX_THREADS);
+    if (nconnections < 1) die("--connections must be positive");
+    if (duration < 1) die("--duration must be positive");
+    if (nthreads > nconnections) nthreads = nconnections;
+    if (optind < argc) {
+        paths = argv + optind;
+        npaths = argc - optind;
+    } else {
+        paths = default_paths;
+        npaths = 1;
+    }
+    build_requests(paths, npaths);
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(host, port, &hints, &res)) != 0)
+        die("getaddrinfo(3): %s", gai_strerror(err));
+    memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
+    server_addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+    signal(SIGPIPE, SIG_IGN);
+
+    // 接続をスレッドに均等に割り振る
+    workers = xmalloc(sizeof(struct Worker) * nthreads);
+    start = now_nsec();
+    for (i = 0, k = 0; i < nthreads; i++) {
+        struct Worker *w = &workers[i];
+
+        memset(w, 0, sizeof *w);
+        w->latency.min = -1;
+        w->deadline = start + duration * 1000000000L;
+        w->nconns = nconnections / nthreads + (i < nconnections % nthreads);
+        w->conns = xmalloc(sizeof(struct Conn) * w->nconns);
+        for (j = 0; j < w->nconns; j++, k++) {
+            w->conns[j].fd = -1;
+            w->conns[j].worker = w;
+            w->conns[j].path = k % npaths;
+        }
+        if ((err = pthread_create(&w->thread, NULL, worker_main, w)) != 0)
+            die("pthread_create(3): %s", strerror(err));
+    }
+    memset(&total, 0, sizeof total);
+    total.latency.min = -1;
+    for (i = 0; i < nthreads; i++) {
+        struct Worker *w = &workers[i];
+
+        pthread_join(w->thread, NULL);
+        total.requests += w->requests;
+        total.bytes += w->bytes;
+        for (j = 0; j < 6; j++)
+            total.status[j] += w->status[j];
+        total.connect_errors += w->connect_errors;
+        total.io_errors += w->io_errors;
+        hist_merge(&total.latency, &w->latency);
+    }
+    end = now_nsec();
+    if (json_mode)
+        report_json(&total, (end - start) / 1e9);
+    else
+        report_text(&total, (end - start) / 1e9);
+    exit(0);
+}
+
+static void* worker_main(void *arg)
+{
+    struct Worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    int i, n;
+
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->epfd < 0) die("epoll_create1(2): %s", strerror(errno));
+    for (i = 0; i < w->nconns; i++)
+        start_request(&w->conns[i]);
+    for (;;) {
+        n = epoll_wait(w->epfd, events, MAX_EVENTS, 100);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            die("epoll_wait(2): %s", strerror(errno));
+        }
+        for (i = 0; i < n; i++)
+            handle_conn(events[i].data.ptr);
+        // 期限を過ぎたら、送りかけのリクエストは待たずに終える
+        if (now_nsec() >= w->deadline) break;
+        // 失敗した接続はここで張り直す(サーバが落ちていても再帰し続けないように)
+        for (i = 0; i < w->nconns; i++) {
+            if (w->conns[i].fd < 0) start_request(&w->conns[i]);
+        }
+    }
+    for (i = 0; i < w->nconns; i++)
+        close_conn(&w->conns[i]);
+    close(w->epfd);
+    return NULL;
+}
+
+// 次のリクエストを始める。接続がなければ先に接続する
+static void start_request(struct Conn *c)
+{
+    struct Worker *w = c->worker;
+    struct epoll_event ev;
+    int one = 1;
+
+    c->started = now_nsec();
+    if (c->started >= w->deadline) {
+        close_conn(c);
+        return;
+    }
+    c->sent = 0;
+    c->len = 0;
+    c->body_left = 0;
+    c->status = 0;
+    c->server_close = 0;
+    if (c->fd >= 0) {
+        c->state = CONN_SENDING;
+        handle_conn(c);
+        return;
+    }
+    c->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) die("socket(2): %s", strerror(errno));
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+        die("epoll_ctl(2): %s", strerror(errno));
+    if (connect(c->fd, (struct sockaddr *)&server_addr, server_addrlen) < 0) {
+        if (errno != EINPROGRESS) {
+            fail_request(c, &w->connect_errors);
+            return;
+        }
+        c->state = CONN_CONNECTING;
+        return;
+    }
+    c->state = CONN_SENDING;
+    handle_conn(c);
+}
+
+// 読み書きできなくなる(EAGAIN)まで接続の状態を進める
+static void handle_conn(struct Conn *c)
+{
+    struct Worker *w = c->worker;
+    socklen_t len;
+    int err;
+
+    while (c->fd >= 0) {
+        switch (c->state) {
+        case CONN_CONNECTING:
+            len = sizeof err;
+            if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+                if (err == EINPROGRESS) return;
+                fail_request(c, &w->connect_errors);
+                return;
+            }
+            c->state = CONN_SENDING;
+            break;
+        case CONN_SENDING:
+            if (!conn_send(c)) return;
+            break;
+        case CONN_RECV_HEAD:
+            if (!conn_recv_head(c)) return;
+            break;
+        case CONN_RECV_BODY:
+            if (!conn_recv_body(c)) return;
+            break;
+        }
+    }
+}
+
+// 以下のconn_*は、進めたら1、EAGAINで待つなら0を返す
+static int conn_send(struct Conn *c)
+{
+    char *req = requests[c->path];
+    size_t len = request_lens[c->path];
+    ssize_t n;
+
+    n = send(c->fd, req + c->sent, len - c->sent, MSG_NOSIGNAL);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN) return 0;
+        if (errno == EINTR) return 1;
+        fail_request(c, &c->worker->io_errors);
+        return 1;
+    }
+    c->sent += n;
+    if (c->sent == len) c->state = CONN_RECV_HEAD;
+    return 1;
+}
+
+static int conn_recv_head(struct Conn *c)
+{
+    char *end;
+    ssize_t n;
+
+    if (c->len == HEAD_BUF_SIZE) { // ヘッダが大きすぎる
+        fail_request(c, &c->worker->io_errors);
+        return 1;
+    }
+    n = read(c->fd, c->head + c->len, HEAD_BUF_SIZE - c->len);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        if (errno == EINTR) return 1;
+        fail_request(c, &c->worker->io_errors);
+        return 1;
+    }
+    if (n == 0) { // レスポンスの前に閉じられた
+        fail_request(c, &c->worker->io_errors);
+        return 1;
+    }
+    c->worker->bytes += n;
+    c->len += n;
+    end = memmem(c->head, c->len, "\r\n\r\n", 4);
+    if (!end) return 1;
+    end += 4;
+    if (!parse_response_head(c, end)) {
+        fail_request(c, &c->worker->io_errors);
+        return 1;
+    }
+    // ヘッダと一緒に届いたボディのぶんを引く
+    if (c->body_left > 0) {
+        c->body_left -= c->len - (end - c->head);
+        if (c->body_left < 0) c->body_left = 0;
+    }
+    if (c->body_left == 0)
+        finish_request(c);
+    else
+        c->state = CONN_RECV_BODY;
+    return 1;
+}
+
+static int conn_recv_body(struct Conn *c)
+{
+    struct Worker *w = c->worker;
+    ssize_t n;
+
+    n = read(c->fd, w->body, BODY_BUF_SIZE);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        if (errno == EINTR) return 1;
+        fail_request(c, &w->io_errors);
+        return 1;
+    }
+    if (n == 0) {
+        if (c->body_left < 0) { // Content-Lengthがなければ閉じたところまでがボディ
+            c->server_close = 1;
+            finish_request(c);
+        } else {
+            fail_request(c, &w->io_errors);
+        }
+        return 1;
+    }
+    w->bytes += n;
+    if (c->body_left > 0) {
+        c->body_left -= n;
+        if (c->body_left <= 0) finish_request(c);
+    }
+    return 1;
+}
+
+// ステータスコード、Content-Length、Connection: closeだけを見る
+static int parse_response_head(struct Conn *c, char *end)
+{
+    char *p, *eol;
+
+    if (end - c->head < 12 || strncmp(c->head, "HTTP/1.", 7) != 0) return 0;
+    c->status = atoi(c->head + 9);
+    c->body_left = -1;
+    c->server_close = (c->head[7] == '0'); // HTTP/1.0は既定で閉じる
+    for (p = (char *)memchr(c->head, '\n', end - c->head) + 1; p < end - 2; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        if (!eol) break;
+        if (strncasecmp(p, "Content-Length:", 15) == 0)
+            c->body_left = atol(p + 15);
+        else if (strncasecmp(p, "Connection:", 11) == 0) {
+            char *v = p + 11;
+
+            while (*v == ' ') v++;
+            if (strncasecmp(v, "close", 5) == 0) c->server_close = 1;
+            else if (strncasecmp(v, "keep-alive", 10) == 0) c->server_close = 0;
+        }
+    }
+    // 1xx/204/304はボディがない
+    if (c->status / 100 == 1 || c->status == 204 || c->status == 304) c->body_left = 0;
+    return 1;
+}
+
+static void finish_request(struct Conn *c)
+{
+    struct Worker *w = c->worker;
+    long now = now_nsec();
+    int cls = c->status / 100;
+
+    // 期限後に返ってきたものは数えない
+    if (now <= w->deadline) {
+        w->requests++;
+        w->status[cls >= 1 && cls <= 5 ? cls : 0]++;
+        hist_record(&w->latency, (now - c->started) / 1000);
+    }
+    if (close_mode || c->server_close) close_conn(c);
+    c->path = (c->path + 1) % npaths;
+    start_request(c);
+}
+
+// 失敗したら接続を閉じる。次のリクエストはworker_mainのループで始める
+static void fail_request(struct Conn *c, long *counter)
+{
+    (*counter)++;
+    close_conn(c);
+    c->path = (c->path + 1) % npaths;
+}
+
+static void close_conn(struct Conn *c)
+{
+    if (c->fd < 0) return;
+    close(c->fd); // closeすればepollの監視対象からも外れる
+    c->fd = -1;
+}
+
+static long now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/****** Histogram ********************************************************/
+
+static void hist_record(struct Histogram *h, long v)
+{
+    if (v < 0) v = 0;
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (h->min < 0 || v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+}
+
+static void hist_merge(struct Histogram *dst, struct Histogram *src)
+{
+    int i;
+
+    if (src->count == 0) return;
+    for (i = 0; i < HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (dst->min < 0 || src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+// 小さいほうからp(0..1)の割合の値が入っているバケットの上限を返す
+static long hist_percentile(struct Histogram *h, double p)
+{
+    long target, seen = 0;
+    int i;
+
+    if (h->count == 0) return 0;
+    target = (long)(p * h->count + 0.999999);
+    if (target < 1) target = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            long v = hist_upper(i);
+            return v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+static int hist_index(long v)
+{
+    int shift, idx;
+
+    if (v < 2 * HIST_SUB) return v;
+    // 最上位ビットの位置から区間を決め、その下HIST_SUB_BITSビットで区間内の位置を決める
+    shift = 63 - __builtin_clzl(v) - HIST_SUB_BITS;
+    idx = HIST_SUB * shift + (int)(v >> shift);
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+static long hist_upper(int idx)
+{
+    int shift;
+
+    if (idx < 2 * HIST_SUB) return idx;
+    shift = idx / HIST_SUB - 1;
+    return (((long)(idx - HIST_SUB * shift)) << shift) + (1L << shift) - 1;
+}
+
+/****** Output ***********************************************************/
+
+static void build_requests(char **paths, int npaths)
+{
+    int i, len;
+
+    requests = xmalloc(sizeof(char *) * npaths);
+    request_lens = xmalloc(sizeof(size_t) * npaths);
+    for (i = 0; i < npaths; i++) {
+        len = snprintf(NULL, 0, "GET %s HTTP/1.1\r\nHost: %s:%s\r\nUser-Agent: httpbench\r\n%s\r\n",
+                       paths[i], host, port, close_mode ? "Connection: close\r\n" : "");
+        requests[i] = xmalloc(len + 1);
+        snprintf(requests[i], len + 1, "GET %s HTTP/1.1\r\nHost: %s:%s\r\nUser-Agent: httpbench\r\n%s\r\n",
+                 paths[i], host, port, close_mode ? "Connection: close\r\n" : "");
+        request_lens[i] = len;
+    }
+}
+
+static void report_text(struct Worker *total, double elapsed)
+{
+    struct Histogram *h = &total->latency;
+    int i;
+
+    printf("%s%s%d threads, %d connections, %s, %.2fs\n",
+           label, *label ? ": " : "", nthreads, nconnections,
+           close_mode ? "close" : "keep-alive", elapsed);
+    printf("  paths:");
+    for (i = 0; i < npaths; i++)
+        printf(" %s", paths[i]);
+    printf("\n");
+    printf("  requests: %ld (2xx %ld, 3xx %ld, 4xx %ld, 5xx %ld, other %ld)\n",
+           total->requests, total->status[2], total->status[3], total->status[4],
+           total->status[5], total->status[0] + total->status[1]);
+    printf("  errors: connect %ld, read/write %ld\n", total->connect_errors, total->io_errors);
+    printf("  throughput: %.0f req/s, %.2f MB/s\n",
+           total->requests / elapsed, total->bytes / elapsed / 1e6);
+    printf("  latency(us): min %ld, mean %.0f, p50 %ld, p90 %ld, p99 %ld, p999 %ld, max %ld\n",
+           h->min < 0 ? 0 : h->min, h->count ? (double)h->sum / h->count : 0.0,
+           hist_percentile(h, 0.50), hist_percentile(h, 0.90),
+           hist_percentile(h, 0.99), hist_percentile(h, 0.999), h->max);
+}
+
+static void report_json(struct Worker *total, double elapsed)
+{
+    struct Histogram *h = &total->latency;
+    int i;
+
+    printf("{\"label\":");
+    print_json_string(label);
+    printf(",\"host\":");
+    print_json_string(host);
+    printf(",\"port\":");
+    print_json_string(port);
+    printf(",\"threads\":%d,\"connections\":%d,\"keepalive\":%s,\"duration\":%.3f,\"paths\":[",
+           nthreads, nconnections, close_mode ? "false" : "true", elapsed);
+    for (i = 0; i < npaths; i++) {
+        if (i > 0) printf(",");
+        print_json_string(paths[i]);
+    }
+    printf("],\"requests\":%ld,\"status\":{\"2xx\":%ld,\"3xx\":%ld,\"4xx\":%ld,\"5xx\":%ld,\"other\":%ld}",
+           total->requests, total->status[2], total->status[3], total->status[4],
+           total->status[5], total->status[0] + total->status[1]);
+    printf(",\"errors\":{\"connect\":%ld,\"io\":%ld}", total->connect_errors, total->io_errors);
+    printf(",\"rps\":%.1f,\"bytes\":%ld,\"mbps\":%.3f", total->requests / elapsed,
+           total->bytes, total->bytes / elapsed / 1e6);
+    printf(",\"latency_us\":{\"min\":%ld,\"mean\":%.1f,\"p50\":%ld,\"p90\":%ld,\"p99\":%ld,\"p999\":%ld,\"max\":%ld}}\n",
+           h->min < 0 ? 0 : h->min, h->count ? (double)h->sum / h->count : 0.0,
+           hist_percentile(h, 0.50), hist_percentile(h, 0.90),
+           hist_percentile(h, 0.99), hist_percentile(h, 0.999), h->max);
+}
+
+static void print_json_string(const char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+static void* xmalloc(size_t sz)
+{
+    void *p;
+
+    p = malloc(sz);
+    if (!p) die("failed to allocate memory");
+    return p;
+}
+
+static void die(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    fprintf(stderr, "httpbench: ");
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(1);
+}
@@ -0,0 +1,133 @@
+/*
+    parsebench.c -- httpd2のリクエストパーサのマイクロベンチマーク
+
+    $ gcc -O2 -Wno-unused-function -o parsebench parsebench.c -lz
+    $ ./parsebench [iterations]
+
+    httpd2.cをそのままincludeして、read_request()だけを繰り返し呼ぶ。
+    ヘッダが揃った状態で一度に渡す場合と、少しずつ届く(partial read)場合の両方を、
+    このCPUで使えるヘッダ走査の実装(scalar/sse4.2/avx2)ごとに測る。
+*/
+
+#define HTTPD2_NO_MAIN
+#include "../syakyou/httpd2.c"
+
+// 現実的なヘッダの組み合わせ
+static char *requests[][2] = {
+    {"curl",
+     "GET /index.html HTTP/1.1\r\n"
+     "Host: localhost:8080\r\n"
+     "User-Agent: curl/8.5.0\r\n"
+     "Accept: */*\r\n"
+     "\r\n"},
+    {"browser",
+     "GET /assets/css/main.css?v=20240117 HTTP/1.1\r\n"
+     "Host: www.example.com\r\n"
+     "Connection: keep-alive\r\n"
+     "sec-ch-ua: \"Not_A Brand\";v=\"8\", \"Chromium\";v=\"120\", \"Google Chrome\";v=\"120\"\r\n"
+     "sec-ch-ua-mobile: ?0\r\n"
+     "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+     "sec-ch-ua-platform: \"Linux\"\r\n"
+     "Accept: text/css,*/*;q=0.1\r\n"
+     "Sec-Fetch-Site: same-origin\r\n"
+     "Sec-Fetch-Mode: no-cors\r\n"
+     "Sec-Fetch-Dest: style\r\n"
+     "Referer: https://www.example.com/\r\n"
+     "Accept-Encoding: gzip, deflate, br\r\n"
+     "Accept-Language: ja,en-US;q=0.9,en;q=0.8\r\n"
+     "If-Modified-Since: Tue, 16 Jan 2024 09:12:44 GMT\r\n"
+     "\r\n"},
+    {"cookie-heavy",
+     "GET /api/v1/timeline?since=1705400000&limit=50 HTTP/1.1\r\n"
+     "Host: app.example.com\r\n"
+     "Connection: keep-alive\r\n"
+     "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.2 Safari/605.1.15\r\n"
+     "Accept: application/json, text/plain, */*\r\n"
+     "Accept-Language: ja-JP,ja;q=0.9\r\n"
+     "Accept-Encoding: gzip, deflate, br\r\n"
+     "X-Requested-With: XMLHttpRequest\r\n"
+     "X-CSRF-Token: 4f1c2a9e8b7d6c5e4f3a2b1c0d9e8f7a6b5c4d3e2f1a0b9c8d7e6f5a4b3c2d1e\r\n"
+     "Cookie: _ga=GA1.2.1234567890.1700000000; _gid=GA1.2.987654321.1705300000; "
+     "session_id=8f14e45fceea167a5a36dedd4bea2543a1b2c3d4e5f60718293a4b5c6d7e8f90; "
+     "prefs=eyJ0aGVtZSI6ImRhcmsiLCJsYW5nIjoiamEiLCJ0eiI6IkFzaWEvVG9reW8iLCJmb250IjoibWVkaXVtIn0%3D; "
+     "ab_bucket=exp42-variantB; consent=analytics%3Dtrue%26ads%3Dfalse%26functional%3Dtrue; "
+     "tracking_ids=a1b2c3d4e5f6a7b8c9d0e1f2a3b4c5d6e7f8a9b0c1d2e3f4a5b6c7d8e9f0a1b2c3d4e5f6a7b8c9d0; "
+     "last_seen=2024-01-16T09%3A12%3A44Z; cart=sku-1001x2%2Csku-2042x1%2Csku-3307x5%2Csku-4410x1; "
+     "feature_flags=new_nav%2Cdark_mode%2Cinfinite_scroll%2Cbeta_search%2Cinline_video%2Csmart_compose\r\n"
+     "Referer: https://app.example.com/home\r\n"
+     "Sec-Fetch-Site: same-origin\r\n"
+     "Sec-Fetch-Mode: cors\r\n"
+     "Sec-Fetch-Dest: empty\r\n"
+     "\r\n"},
+};
+
+#define NREQUESTS (sizeof requests / sizeof requests[0])
+#define PARTIAL_CHUNK 64
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// chunkバイトずつ届いたことにしてパースする(chunkが0なら一度に渡す)
+static void bench(char *name, char *text, long iterations, size_t chunk)
+{
+    static char buf[REQUEST_BUF_SIZE + SCAN_PADDING];
+    struct HTTPParser parser;
+    struct HTTPRequest req;
+    size_t len = strlen(text);
+    double t0, t;
+    long i;
+    int r = PARSE_AGAIN;
+
+    t0 = now_sec();
+    for (i = 0; i < iterations; i++) {
+        size_t avail;
+
+        memcpy(buf, text, len); // パーサはバッファを書き換えるので毎回戻す
+        reset_parser(&parser);
+        if (chunk == 0) {
+            r = read_request(&parser, &req, buf, len);
+        } else {
+            for (avail = chunk; ; avail += chunk) {
+                if (avail > len) avail = len;
+                r = read_request(&parser, &req, buf, avail);
+                if (r != PARSE_AGAIN || avail == len) break;
+            }
+        }
+        if (r != PARSE_DONE) {
+            fprintf(stderr, "%s: parse failed\n", name);
+            exit(1);
+        }
+    }
+    t = now_sec() - t0;
+    printf("%-7s %-13s %-8s %5zu bytes %3d fields %12.0f req/s %8.1f MB/s\n",
+           scanner->name, name, chunk ? "partial" : "whole", len, req.nheader,
+           iterations / t, len * iterations / t / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    struct Scanner *scanners[3];
+    size_t i, j, n = 0;
+
+    debug_mode = 1; // log_exit()をstderrに出す
+    scanners[n++] = &scalar_scanner;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) scanners[n++] = &sse42_scanner;
+    if (__builtin_cpu_supports("avx2")) scanners[n++] = &avx2_scanner;
+#endif
+    for (i = 0; i < NREQUESTS; i++) {
+        for (j = 0; j < n; j++) {
+            scanner = scanners[j];
+            bench(requests[i][0], requests[i][1], iterations, 0);
+            bench(requests[i][0], requests[i][1], iterations / 4, PARTIAL_CHUNK);
+        }
+    }
+    exit(0);
+}
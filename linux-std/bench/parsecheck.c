@@ -0,0 +1,144 @@
+/*
+    parsecheck.c -- httpd2のリクエストパーサに壊れた入力を流して、返すステータスを確かめる
+
+    $ gcc -O2 -Wno-unused-function -o parsecheck parsecheck.c -lz
+    $ ./parsecheck
+
+    parsebench.cと同じくhttpd2.cをそのままincludeして、read_request()を呼ぶ。
+    一度に渡す場合と少しずつ届く場合の両方を、このCPUで使えるヘッダ走査の実装ごとに試す。
+    リクエストラインやヘッダが受信バッファに収まらないときの414/431は
+    connection_read()が決めるので、ここでも同じ判定をしてから比べる。
+    試すごとに何バイトずつ渡したかと結果を1行ずつ出し、期待と違う結果があれば終了コード1で終わる。
+*/
+
+#define HTTPD2_NO_MAIN
+#include "../syakyou/httpd2.c"
+
+#define PARTIAL_CHUNK 7
+
+struct Case {
+    char *name;
+    char *text;
+    int expected;
+};
+
+static char long_uri[REQUEST_BUF_SIZE + 64];
+static char long_header[REQUEST_BUF_SIZE + 64];
+static char many_fields[(MAX_HEADER_FIELDS + 2) * 16 + 64];
+
+static struct Case cases[] = {
+    {"ok", "GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n", PARSE_DONE},
+    {"ok-escaped", "GET /a%20b.html HTTP/1.1\r\nHost: localhost\r\n\r\n", PARSE_DONE},
+    {"ok-bare-lf", "GET / HTTP/1.0\nHost: localhost\n\n", PARSE_DONE},
+    {"no-path", "GET\r\n\r\n", PARSE_BAD_REQUEST},
+    {"no-version", "GET /\r\n\r\n", PARSE_BAD_REQUEST},
+    {"bad-version", "GET / HTTP/2.0\r\n\r\n", PARSE_BAD_REQUEST},
+    {"bad-minor", "GET / HTTP/1.x\r\n\r\n", PARSE_BAD_REQUEST},
+    {"double-space", "GET  / HTTP/1.1\r\n\r\n", PARSE_BAD_REQUEST},
+    {"no-colon", "GET / HTTP/1.1\r\nHost localhost\r\n\r\n", PARSE_BAD_REQUEST},
+    {"short-escape", "GET /a%2 HTTP/1.1\r\n\r\n", PARSE_BAD_REQUEST},
+    {"bad-escape", "GET /a%zz HTTP/1.1\r\n\r\n", PARSE_BAD_REQUEST},
+    {"nul-escape", "GET /a%00.html HTTP/1.1\r\n\r\n", PARSE_BAD_REQUEST},
+    {"ok-dotfile", "GET /.well-known/a..b HTTP/1.1\r\n\r\n", PARSE_DONE},
+    {"no-leading-slash", "GET index.html HTTP/1.1\r\n\r\n", PARSE_BAD_REQUEST},
+    {"dotdot", "GET /../../etc/ HTTP/1.1\r\n\r\n", PARSE_BAD_REQUEST},
+    {"dotdot-end", "GET /a/.. HTTP/1.1\r\n\r\n", PARSE_BAD_REQUEST},
+    {"dot-segment", "GET /./index.html HTTP/1.1\r\n\r\n", PARSE_BAD_REQUEST},
+    {"escaped-dotdot", "GET /%2e%2e/%2E%2E/etc/hostname HTTP/1.1\r\n\r\n", PARSE_BAD_REQUEST},
+    {"escaped-slash", "GET /a%2f..%2fb HTTP/1.1\r\n\r\n", PARSE_BAD_REQUEST},
+    {"chunked-and-length",
+     "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 5\r\n\r\n", PARSE_BAD_REQUEST},
+    {"unknown-coding", "POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n", PARSE_BAD_REQUEST},
+    {"length-not-number", "POST / HTTP/1.1\r\nContent-Length: 12abc\r\n\r\n", PARSE_BAD_REQUEST},
+    {"length-negative", "POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n", PARSE_BAD_REQUEST},
+    {"length-too-large", "POST / HTTP/1.1\r\nContent-Length: 1073741824\r\n\r\n", PARSE_BODY_TOO_LARGE},
+    {"length-overflow",
+     "POST / HTTP/1.1\r\nContent-Length: 99999999999999999999999\r\n\r\n", PARSE_BODY_TOO_LARGE},
+    {"uri-too-long", long_uri, PARSE_URI_TOO_LONG},
+    {"header-too-long", long_header, PARSE_HEADER_TOO_LARGE},
+    {"too-many-fields", many_fields, PARSE_HEADER_TOO_LARGE},
+};
+
+#define NCASES (sizeof cases / sizeof cases[0])
+
+static char *result_name(int r)
+{
+    switch (r) {
+    case PARSE_AGAIN: return "AGAIN";
+    case PARSE_DONE: return "DONE";
+    default: return parse_error_status(r);
+    }
+}
+
+static void build_cases(void)
+{
+    char *p;
+    int i;
+
+    // リクエストラインだけで受信バッファが埋まる
+    p = long_uri + sprintf(long_uri, "GET /");
+    memset(p, 'a', sizeof long_uri - (p - long_uri) - 1);
+    // リクエストラインは収まるが、1行のヘッダで埋まる
+    p = long_header + sprintf(long_header, "GET / HTTP/1.1\r\nCookie: ");
+    memset(p, 'a', sizeof long_header - (p - long_header) - 1);
+    // 1行ずつは短いが、フィールドの数が上限を超える
+    p = many_fields + sprintf(many_fields, "GET / HTTP/1.1\r\n");
+    for (i = 0; i <= MAX_HEADER_FIELDS; i++) p += sprintf(p, "X-F%d: %d\r\n", i, i);
+    sprintf(p, "\r\n");
+}
+
+// chunkバイトずつ届いたことにしてパースする(chunkが0なら一度に渡す)
+// connection_read()と同じく、受信バッファが埋まっても終わらなければ414か431にする
+static int parse(char *text, size_t chunk)
+{
+    static char buf[REQUEST_BUF_SIZE + SCAN_PADDING];
+    struct HTTPParser parser;
+    struct HTTPRequest req;
+    size_t len = strlen(text), avail;
+    int r;
+
+    if (len > REQUEST_BUF_SIZE) len = REQUEST_BUF_SIZE;
+    memcpy(buf, text, len);
+    reset_parser(&parser);
+    for (avail = chunk ? chunk : len; ; avail += chunk) {
+        if (avail > len) avail = len;
+        r = read_request(&parser, &req, buf, avail);
+        if (r != PARSE_AGAIN || avail == len) break;
+    }
+    if (r == PARSE_AGAIN && len == REQUEST_BUF_SIZE)
+        r = parser.state == PARSER_REQUEST_LINE ? PARSE_URI_TOO_LONG : PARSE_HEADER_TOO_LARGE;
+    return r;
+}
+
+int main(int argc, char *argv[])
+{
+    struct Scanner *scanners[3];
+    size_t chunks[] = {0, PARTIAL_CHUNK, 1};
+    size_t i, j, k, n = 0;
+    int r, failed = 0;
+
+    debug_mode = 1; // log_exit()をstderrに出す
+    scanners[n++] = &scalar_scanner;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) scanners[n++] = &sse42_scanner;
+    if (__builtin_cpu_supports("avx2")) scanners[n++] = &avx2_scanner;
+#endif
+    build_cases();
+    for (i = 0; i < NCASES; i++) {
+        for (j = 0; j < n; j++) {
+            scanner = scanners[j];
+            for (k = 0; k < sizeof chunks / sizeof chunks[0]; k++) {
+                r = parse(cases[i].text, chunks[k]);
+                if (r != cases[i].expected) failed++;
+                printf("%s %-7s %-19s %5zu %s", r == cases[i].expected ? "ok  " : "FAIL",
+                       scanner->name, cases[i].name, chunks[k] ? chunks[k] : strlen(cases[i].text),
+                       result_name(r));
+                if (r != cases[i].expected) printf(" (expected %s)", result_name(cases[i].expected));
+                printf("\n");
+            }
+        }
+    }
+    printf("%d failed\n", failed);
+    exit(failed ? 1 : 0);
+}
@@ -9,14 +9,27 @@
 
 // https://github.com/aamine/stdlinux2-source/blob/master/httpd2.c
 
+#define _GNU_SOURCE // splice(2), getopt_long(3)
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -28,44 +41,477 @@
 #include <pwd.h>
 #include <grp.h>
 #include <syslog.h>
-#define _GNU_SOURCE
 #include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+/****** Constants ********************************************************/
+
+#define SERVER_NAME "LittleHTTP"
+#define SERVER_VERSION "1.0"
+#define HTTP_MINOR_VERSION 1
+#define BLOCK_BUF_SIZE 1024
+#define LINE_BUF_SIZE 4096
+#define MAX_REQUEST_BODY_LENGTH (1024 * 1024)
+#define SOMAXCONN_PATH "/proc/sys/net/core/somaxconn" // listenのbacklogの既定値はここから読む
+#define SD_LISTEN_FDS_START 3 // systemdのソケットアクティベーションで渡される最初のfd
+#define UPGRADE_ENV "HTTPD2_UPGRADE_FD" // SIGUSR2で起動した新しいサーバに、前のサーバとつながるfdを教える
+#define READY_ENV "SOCKETD_READY_FD" // ソケットを渡したスーパーバイザ(tools/socketd)に、acceptを始めたことを知らせるfd
+#define UPGRADE_TIMEOUT_MSEC 10000 // 新しいサーバが動き出すのを待つ時間
+#define DEFAULT_PORT "80"
+#define REQUEST_BUF_SIZE (2 * LINE_BUF_SIZE)
+#define SCAN_PADDING 32 // SIMDでまとめて読むためにバッファの後ろに取る余白
+#define MAX_EVENTS 256
+#define MAX_WORKERS 256
+#define MAX_THREADS 1024
+#define THREAD_QUEUE_PER_THREAD 4 // --threadsのキューの長さ(スレッドあたり)
+#define MAX_PIPELINE_BUF_SIZE (64 * 1024)
+#define MAX_HEADER_FIELDS 64
+#define DEFAULT_KEEPALIVE_TIMEOUT 5
+#define DEFAULT_MAX_KEEPALIVE_REQUESTS 100
+#define DEFAULT_FILE_CACHE_ENTRIES 256
+#define FILE_CACHE_TTL_MSEC 1000 // inotifyを使わないときにファイルの変更を確かめる間隔
+#define DEFAULT_RESPONSE_CACHE_SIZE (16 * 1024 * 1024) // ワーカーごと(--threadsならスレッドで分け合う)
+#define DEFAULT_RESPONSE_CACHE_MAX_FILE (64 * 1024)
+#define DEFAULT_BODY_BUFFER_SIZE (16 * 1024)
+#define AUTOINDEX_DENTS_BUF_SIZE (64 * 1024) // getdents64で一度に読むバッファ
+#define DEFAULT_MIME_TYPES "/etc/mime.types"
+#define DEFAULT_CONTENT_TYPE "application/octet-stream"
+#define MAX_EXTENSION_LEN 32
+#define HTTP_DATE_LEN 29 // "Sun, 06 Nov 1994 08:49:37 GMT"
+#define ETAG_LEN 64 // "mtime秒-ナノ秒-サイズ"を16進で
+#define MAX_RANGES 16 // 1つのRangeヘッダで受け付ける範囲の数
+#define MAX_MULTIRANGE_LENGTH (1024 * 1024) // multipart/byterangesのボディはメモリで組み立てるので上限を置く
+#define BYTERANGES_BOUNDARY "httpd2-byteranges-boundary"
+#define COMPRESS_MIN_SIZE 256 // --compress: これより小さいファイルは圧縮しても得にならない
+#define COMPRESS_MAX_SIZE (8 * 1024 * 1024) // --compress: 圧縮するファイルの上限
+#define COMPRESS_CACHE_MAX (64 * 1024 * 1024) // --compress: 圧縮したボディの合計の上限
+#define COMPRESS_CACHE_BUCKETS 1024
+#define COMPRESS_QUEUE_MAX 64 // --compress: 圧縮待ちのファイル数の上限
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS 4
+#define STATS_PATH "/__stats"
+#define STATS_HIST_SUB_BITS 4
+#define STATS_HIST_SUB (1 << STATS_HIST_SUB_BITS)
+#define STATS_HIST_BUCKETS (STATS_HIST_SUB * 2 + STATS_HIST_SUB * 36) // 2^41ナノ秒(約36分)まで
+#define STATS_MIN_STATUS 100
+#define STATS_NSTATUS 500 // 100..599
+#define ACCESS_LOG_RING_SIZE 4096 // ワーカーごとに溜められるレコード数(2の冪), --threadsではスレッドで分ける
+#define ACCESS_LOG_MIN_RING_SIZE 64 // 分けてもこれより小さくはしない
+#define ACCESS_LOG_METHOD_LEN 16
+#define ACCESS_LOG_PATH_LEN 256 // これより長いパスは切り詰めて記録する
+#define ACCESS_LOG_BUF_SIZE (64 * 1024) // 1回のwrite(2)にまとめる大きさ
+#define ACCESS_LOG_FLUSH_MSEC 10 // 書き出したあと、次のレコードが溜まるのを待つ間隔
+#define URING_ENTRIES 1024
+#define URING_BUF_COUNT 1024 // recv用に提供するバッファの数(2の冪)
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 0
+#define URING_SPLICE_CHUNK (64 * 1024) // ファイル→パイプに一度に流すバイト数(パイプの容量)
+#define ARENA_BLOCK_SIZE 4096 // 接続ごとのアリーナの大きさ(普通のリクエストはこれに収まる)
+#define ARENA_ALIGN 16
+#define CONN_FREELIST_MAX 64 // 閉じた後も使い回すために取っておくConnectionの数
+
+#define XSTR(x) STR(x)
+#define STR(x) #x
+#define STATUS_LINE_PREFIX "HTTP/1." XSTR(HTTP_MINOR_VERSION) " "
+#define SERVER_HEADER_FIELD "Server: " SERVER_NAME "/" SERVER_VERSION "\r\n"
 
 /****** Data Type Definitions ********************************************/
 
-// リンクリスト
+// 接続を処理する方式
+enum Engine {
+    ENGINE_FORK, // 接続ごとにfork
+    ENGINE_EPOLL, // 1プロセスのイベントループ
+    ENGINE_IO_URING // io_uringのイベントループ
+};
+
+// 受信バッファ内の部分文字列(バッファ先頭からのオフセットと長さ)
+// パースが終わると末尾は'\0'で終端されているので、REQ_STR()で文字列としても使える
+struct Slice {
+    unsigned int off;
+    unsigned int len;
+};
+
 // HTTPヘッダの例： User-Agent, Set-Cookie
 struct HTTPHeaderField {
-    char *name;
-    char *value;
-    struct HTTPHeaderField *next;
+    struct Slice name;
+    struct Slice value;
 };
 
+// リクエストの文字列はすべて受信バッファ内をそのまま指していて、パースしてもmallocしない
 struct HTTPRequest {
     int protocol_minor_version; // 例: HTTP1.1なら1
-    char *method; // 例: GET, HEAD
-    char *path; // 例: /example.html
-    struct HTTPHeaderField *header;
-    char *body; // エンティティボディ
-    long length; // ボディの長さ
+    char *buf; // スライスの基準になる受信バッファ
+    struct Slice method; // 例: GET, HEAD
+    struct Slice path; // 例: /example.html
+    struct HTTPHeaderField header[MAX_HEADER_FIELDS];
+    int nheader;
+    long length; // ボディの長さ(Content-Length)
+    int chunked; // Transfer-Encoding: chunkedなら非ゼロ(lengthは使わない)
+    // ボディを受け取る関数。届いたぶんずつ(chunkedならデコードして)渡し、最後にlen == 0で呼ぶ
+    void (*body_handler)(struct HTTPRequest *req, char *data, size_t len);
+    int keep_alive; // レスポンス後も接続を維持するなら非ゼロ
+    int requests_left; // この接続であと何回リクエストを受け付けるか
+    struct Arena *arena; // レスポンスを作る間の一時的なメモリ(接続のもの)
+};
+
+#define REQ_STR(req, s) ((req)->buf + (s).off)
+
+// リクエストの逐次パーサの状態
+// データが届くたびに、前回の続きから新しく届いたバイトだけを走査する
+enum ParserState {
+    PARSER_REQUEST_LINE,
+    PARSER_HEADER
+};
+
+struct HTTPParser {
+    enum ParserState state;
+    size_t line; // 処理中の行の先頭
+    size_t scan; // 改行を探し始める位置
+    size_t colon; // 処理中のヘッダ行で見つけた':'の位置, まだなら0
+};
+
+// ヘッダを走査する関数群
+// 起動時にCPUIDを見てAVX2/SSE4.2/スカラーのどれかを選ぶ
+struct Scanner {
+    char *name;
+    char* (*find_char2)(char *p, char *end, int c1, int c2); // c1かc2が最初に現れる位置
+    void (*fold_case)(char *p, size_t len, int upper); // 英字を大文字(upper)か小文字にそろえる
+};
+
+// read_request()の戻り値
+// PARSE_DONEより後ろは不正なリクエストで、parse_error_status()で返すステータスに対応する
+enum ParseResult {
+    PARSE_AGAIN, // ヘッダがまだ揃っていない
+    PARSE_DONE,
+    PARSE_BAD_REQUEST, // 400 書式が壊れている
+    PARSE_BODY_TOO_LARGE, // 413 Content-Lengthが上限を超えている
+    PARSE_URI_TOO_LONG, // 414 リクエストラインがバッファに収まらない
+    PARSE_HEADER_TOO_LARGE // 431 ヘッダの数か長さが上限を超えている
 };
 
 struct FileInfo {
     char *path; // ファイルシステム上のファイルの絶対パス
     long size; // ファイルのサイズ(バイト単位)
     int ok; // ファイルが存在するなら非ゼロ
+    char *content_type; // 拡張子から決めたContent-Type
+    dev_t dev; // 以下はキャッシュしたファイルが変わっていないかの確認用
+    ino_t ino;
+    struct timespec mtime;
+    char etag[ETAG_LEN]; // ETagヘッダの値(引用符つき)
+    char last_modified[HTTP_DATE_LEN + 1]; // Last-Modifiedヘッダの値
+    int encoding; // 圧縮済みの兄弟ファイル(.gzなど)ならそのContent-Encoding
+    int is_dir; // --autoindex: ディレクトリなら非ゼロ(一覧のHTMLを返す)
 };
 
-/****** Constants ********************************************************/
+// Content-Encoding 兄弟ファイルを探すときはこの順に優先する
+enum ContentEncoding {
+    ENCODING_IDENTITY,
+    ENCODING_BR,
+    ENCODING_ZSTD,
+    ENCODING_GZIP,
+    NENCODINGS
+};
 
-#define SERVER_NAME "LittleHTTP"
-#define SERVER_VERSION "1.0"
-#define HTTP_MINOR_VERSION 0
-#define BLOCK_BUF_SIZE 1024
-#define LINE_BUF_SIZE 4096
-#define MAX_REQUEST_BODY_LENGTH (1024 * 1024)
-#define MAX_BACKLOG 5
-#define DEFAULT_PORT "80"
+struct Encoding {
+    char *name; // Accept-Encoding/Content-Encodingでの名前
+    char *suffix; // 圧縮済みの兄弟ファイルの拡張子
+};
+
+// --compress: その場で圧縮したボディ
+// 送信中のレスポンスからも参照されるので、参照カウントが0になったら解放する
+struct CompressedBody {
+    char *path; // 元のファイルのファイルシステム上のパス
+    char etag[ETAG_LEN]; // 圧縮した時点の元のファイルのETag
+    char *data; // gzipで圧縮したボディ, 圧縮しても小さくならないか圧縮に失敗したらNULL
+    size_t len;
+    size_t cost; // mem_usedに数えているバイト数(dataがなくてもエントリ自体の大きさは数える)
+    int ready; // 圧縮が済んでいれば非ゼロ(dataがNULLでも、圧縮しないことが決まっている)
+    int cached; // キャッシュに入っていれば非ゼロ
+    int refcnt; // キャッシュ自身・圧縮待ちのキュー・レスポンスからの参照の数
+    struct CompressedBody *hnext; // pathのハッシュチェイン
+    struct CompressedBody *prev, *next; // 圧縮が済んだもの(dataがNULLのものも)のLRUリスト
+    struct CompressedBody *qnext; // 圧縮待ちのキュー
+};
+
+// 圧縮スレッドとイベントループ(--threadsでは複数)が共有するので、lockで守る
+struct CompressCache {
+    pthread_mutex_t lock;
+    pthread_cond_t queued; // 圧縮待ちが積まれた
+    struct CompressedBody *table[COMPRESS_CACHE_BUCKETS];
+    struct CompressedBody *head, *tail; // LRUリスト
+    struct CompressedBody *qhead, *qtail; // 圧縮待ちのキュー
+    int nqueued;
+    size_t mem_used;
+};
+
+// Rangeヘッダで指定された1つの範囲 [first, last]
+struct ByteRange {
+    long first;
+    long last;
+};
+
+// 拡張子とContent-Typeの対応
+struct MimeType {
+    char *ext; // 小文字の拡張子, 空きスロットならNULL
+    char *type;
+};
+
+struct MimeTable {
+    struct MimeType *slots; // オープンアドレス法のハッシュ表
+    size_t nslots; // 2のべき乗
+    size_t n;
+};
+
+// ファイルキャッシュのエントリ
+// 送信中のレスポンスからも参照されるので、参照カウントが0になったら解放する
+struct CachedFile {
+    char *urlpath; // キーになるURLのパス, キャッシュに入っていなければNULL
+    struct FileInfo *info; // infoとパスはエントリと一緒に確保する(エントリの直後)
+    int fd; // 開いたままにしておくファイル
+    int wd; // inotifyのwatch descriptor, 使っていなければ-1
+    int refcnt; // キャッシュ自身とレスポンスからの参照の数
+    int variants; // 圧縮済みの兄弟ファイルがあるエンコーディングのビット集合, まだ調べていなければ-1
+    long checked_at; // inotifyなし: 最後にファイルの状態を確かめた時刻(ミリ秒)
+    char *mem; // 小さいファイル: Content-Typeまでのレスポンスヘッダとボディ, なければNULL
+    size_t mem_len; // memの全体の長さ
+    size_t head_len; // memのうちヘッダ部分の長さ(この後ろがボディ)
+    size_t date_off; // mem中のDateヘッダの値の位置
+    time_t date; // mem中のDateヘッダが表している時刻
+    struct CachedFile *hnext; // urlpathのハッシュチェイン
+    struct CachedFile *wnext; // wdのハッシュチェイン
+    struct CachedFile *prev, *next; // LRUリスト(先頭が最近使ったもの)
+};
+
+struct FileCache {
+    struct CachedFile **table; // urlpathで引くハッシュ表
+    struct CachedFile **wd_table; // inotifyのイベントからエントリを引くハッシュ表
+    size_t nbuckets; // どちらの表も同じ大きさ(2のべき乗)
+    struct CachedFile *head, *tail; // LRUリスト
+    int n; // キャッシュしているエントリ数
+    int max; // 0ならキャッシュしない
+    int inotify_fd; // 使わなければ-1
+    size_t mem_used; // エントリのmemの合計バイト数
+    size_t mem_max; // memの合計の上限, 0ならレスポンスをメモリに持たない
+    size_t mem_threshold; // これ以下の大きさのファイルだけメモリに持つ
+};
+
+// 処理時間(ナノ秒)の対数線形ヒストグラム
+// 2*STATS_HIST_SUB未満はそのまま、それ以上は2の冪の区間をSTATS_HIST_SUB等分する(誤差1/16以内)
+struct StatsHistogram {
+    unsigned long count;
+    unsigned long sum;
+    unsigned long buckets[STATS_HIST_BUCKETS];
+};
+
+// ワーカーごとの統計。ワーカー間で共有するmmapの上に置く
+// 書き込むのはそのワーカー(fork版ではそのワーカーの子プロセス)だけなので、
+// ほかのワーカーとキャッシュラインを取り合わない。/__statsで全ワーカーぶんを足し合わせる
+// 足し合わせるときにunsigned longの配列として扱うので、メンバはすべてunsigned longにする
+struct WorkerStats {
+    unsigned long connections; // acceptした接続数
+    unsigned long active_connections; // acceptしてまだ閉じていない接続数(増減するのでlongとして読む)
+    unsigned long requests;
+    unsigned long bytes; // レスポンスのバイト数(ヘッダ+ボディ)
+    unsigned long file_cache_hits;
+    unsigned long file_cache_misses;
+    unsigned long response_cache_hits; // メモリ上のレスポンスをそのまま返した回数
+    unsigned long response_cache_misses; // 対象のファイルなのにメモリになかった回数
+    unsigned long access_log_records; // アクセスログに書き出したレコード数
+    unsigned long access_log_dropped; // リングが一杯で捨てたレコード数
+    unsigned long request_body_bytes; // 受け取ったリクエストのボディのバイト数(デコード後)
+    unsigned long rejected_connections; // 受け付けずに503で閉じた接続数(--max-connsかfdが尽きた)
+    unsigned long status[STATS_NSTATUS]; // ステータスコードごとのレスポンス数
+    struct StatsHistogram parse; // リクエストのパース
+    struct StatsHistogram stat; // ファイルの検索(キャッシュかstat+open)
+    struct StatsHistogram send; // レスポンスを作り終えてから送り終えるまで(パイプラインはまとめて1回)
+} __attribute__((aligned(64)));
+
+// --threads: 接続待ちのスレッドが受け付けたソケットをスレッドプールへ渡す有界キュー
+// 複数のスレッドが取り出すので、ロックと条件変数で守る
+struct SocketQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    int *socks; // 長さcapaのリング
+    int capa;
+    int head; // 次に取り出す位置
+    int n; // 入っている数
+    int running; // 動いているスレッド数(終了するときに待つ)
+    pthread_cond_t stopped;
+};
+
+// アクセスログの1レコード
+// リクエストの処理中は値を詰めるだけにして、文字列にするのは書き出す側で行う
+struct LogRecord {
+    time_t time;
+    long bytes; // レスポンスのバイト数(ヘッダ+ボディ)
+    int status;
+    int minor_version;
+    char addr[INET6_ADDRSTRLEN];
+    char method[ACCESS_LOG_METHOD_LEN];
+    char path[ACCESS_LOG_PATH_LEN];
+};
+
+// イベントループ(--threadsでは各スレッド)が書き込み、書き出しスレッドが読む単一生産者・単一消費者のリング
+// head/tailは互いに相手のものを読むだけなので、別のキャッシュラインに置く
+struct LogRing {
+    unsigned long head __attribute__((aligned(64))); // 次に読む位置(書き出しスレッドだけが進める)
+    unsigned long tail __attribute__((aligned(64))); // 次に書く位置(書き込む側だけが進める)
+    unsigned long mask __attribute__((aligned(64))); // レコード数-1(2の冪-1)
+    struct LogRecord records[];
+};
+
+// 伸長可能なバイト列
+struct Buffer {
+    char *ptr;
+    size_t len; // 書き込み済みのバイト数
+    size_t capa; // 確保済みのバイト数
+};
+
+// リクエストの処理の間だけ使うメモリ
+// 先頭から切り出していくだけで個別には解放せず、リクエストを処理し終えたらまとめて空に戻す
+// 収まらない分は個別にmallocしてbigにつなぎ、空に戻すときに解放する
+struct Arena {
+    char *base; // ARENA_BLOCK_SIZEバイト, 最初に使うまでNULL
+    size_t used;
+    struct ArenaChunk *big;
+};
+
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    max_align_t data[]; // ここから先が切り出した領域
+};
+
+// レスポンスの書き出し先
+struct Response {
+    struct Buffer head; // ステータスライン・ヘッダ・短いボディ
+    size_t sent; // headのうち送信済みのバイト数
+    int body_fd; // ボディとして送るファイル, なければ-1
+    char *body_mem; // ボディとして送るメモリ上のデータ, なければNULL
+    struct CachedFile *body_file; // body_fdかbody_memを持っているファイルキャッシュのエントリ
+    struct CompressedBody *body_compressed; // body_memを持っている圧縮したボディ
+    off_t body_offset; // 次に送るファイル上の位置
+    off_t body_length; // ボディの残りバイト数
+    int status; // 最後に出力したレスポンスのステータスコード
+};
+
+struct TimerWheel;
+
+// 階層タイマーホイールに登録するタイマー
+struct Timer {
+    long expires; // 発火する時刻(ミリ秒)
+    void (*handler)(struct TimerWheel *wheel, void *data);
+    void *data;
+    struct Timer **slot; // 登録されているスロット, 未登録ならNULL
+    struct Timer *prev, *next; // 同じスロットのタイマーのリスト
+};
+
+// 1ティック=1ミリ秒で、TIMER_WHEEL_SIZEスロットの輪をTIMER_WHEEL_LEVELS段重ねたもの
+// 段ごとに1スロットの幅がTIMER_WHEEL_SIZE倍になり、4段で約4.6時間先まで扱える
+// 上の段のタイマーは、そのスロットの時刻になったら1つ下の段へ移し替える
+struct TimerWheel {
+    long now; // 処理済みの時刻(ミリ秒)
+    int count; // 登録されているタイマーの数
+    struct Timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+};
+
+// 1つの接続の状態
+// fork版(ブロッキング)でもepoll版(ノンブロッキング)でも同じ状態遷移で処理する
+enum ConnState {
+    CONN_READING, // リクエストの受信中
+    CONN_WRITING, // レスポンスの送信中
+    CONN_CLOSED
+};
+
+// Transfer-Encoding: chunkedのデコーダの状態
+enum ChunkState {
+    CHUNK_SIZE, // チャンクの長さ(16進)
+    CHUNK_EXT, // チャンク拡張(読み捨てる)
+    CHUNK_DATA,
+    CHUNK_DATA_END, // データの後ろのCRLF
+    CHUNK_TRAILER, // トレイラーの行頭
+    CHUNK_TRAILER_LINE, // トレイラーの行(読み捨てる)
+    CHUNK_DONE
+};
+
+struct Connection {
+    int fd;
+    enum ConnState state;
+    char rbuf[REQUEST_BUF_SIZE + SCAN_PADDING]; // リクエストライン+ヘッダの受信バッファ
+    size_t rlen; // rbufに読み込み済みのバイト数
+    struct HTTPParser parser;
+    struct HTTPRequest request; // rbuf先頭のリクエスト
+    struct HTTPRequest *req; // ボディ受信中のリクエスト(&request), なければNULL
+    size_t consumed; // reqの処理が終わったらrbufから取り除くバイト数
+    char *body_buf; // ボディを受け取る窓(body_buffer_sizeバイト), ボディの受信中だけ持つ
+    long body_left; // Content-Length: ボディの残り, chunked: 今のチャンクの残り
+    long body_total; // 受け取ったボディの合計
+    enum ChunkState chunk_state;
+    int chunk_digits; // CHUNK_SIZEで読んだ桁数
+    struct Response res;
+    int pipefd[2]; // sendfileが使えないときのsplice用パイプ, 未作成なら-1
+    size_t piped; // パイプに溜まっていてまだソケットに送っていないバイト数
+    int nrequests; // この接続で受け付けたリクエスト数
+    long parse_ns; // 処理中のリクエストのパースにかかった時間の合計
+    long send_start; // 送っていないレスポンスを作り始めた時刻(ナノ秒), なければ0
+    char peer[INET6_ADDRSTRLEN]; // アクセスログ用の相手のアドレス, まだ調べていなければ""
+    int keep_alive; // 最後のレスポンスを送ったあとも接続を維持するなら非ゼロ
+    struct Timer timer; // epoll版: 一定時間動きがなければ閉じるためのタイマー
+    int inflight; // io_uring版: 完了を待っている操作の数(0になるまで解放しない)
+    int recving; // io_uring版: マルチショットのrecvが動いていれば非ゼロ
+    int rx_eof; // io_uring版: 相手が接続を閉じたら非ゼロ
+    int rx_errno; // io_uring版: recvが失敗したときのerrno
+    int rx_head, rx_tail; // io_uring版: 受信済みでまだrbufに移していないバッファ番号のリスト, 空なら-1
+    int sending; // io_uring版: 送信が完了待ちなら非ゼロ
+    int corked; // --tcp-cork: レスポンスを送り終えるまでTCP_CORKしていれば非ゼロ
+    struct msghdr msg; // io_uring版: ヘッダとメモリ上のボディをまとめて送るときのsendmsgの引数
+    struct iovec iov[2];
+    struct Arena arena; // リクエストの処理中に使う一時的なメモリ(リクエストごとに空に戻す)
+    struct Connection *next_free; // 使い回し待ちのリストの次
+};
+
+// io_uring版: recvに提供しているバッファ1つぶんの状態
+struct UringBuf {
+    int len; // 受信したバイト数
+    int off; // 取り出し済みのバイト数
+    int next; // 同じ接続の次のバッファ番号, なければ-1
+};
+
+// io_uring版: リングと提供バッファ
+struct Uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail; // 次に使うSQEの位置(io_uring_enterの前に*sq_tailへ反映する)
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring;
+    unsigned short buf_tail;
+    char *bufs; // URING_BUF_COUNT x URING_BUF_SIZE
+    struct UringBuf meta[URING_BUF_COUNT];
+};
+
+// io_uring版: user_dataの下位ビットに入れる操作の種類(上位は接続へのポインタ)
+enum UringOp {
+    URING_ACCEPT = 1,
+    URING_NOTIFY,
+    URING_RECV,
+    URING_SEND,
+    URING_SPLICE_IN, // ファイル→パイプ
+    URING_SPLICE_OUT, // パイプ→ソケット
+    URING_CANCEL // 終了前にacceptを取り消す
+};
+#define URING_OP_MASK 7
 
 /****** Function Prototypes **********************************************/
 
@@ -73,38 +519,275 @@ static void setup_environment(char *root, char *user, char *group);
 typedef void (*sighandler_t)(int);
 static void install_signal_handlers(void);
 static void trap_signal(int sig, sighandler_t handler);
-static void detach_children(void);
+static void trap_signal_interrupt(int sig, sighandler_t handler);
+static void reap_children(void);
 static void signal_exit(int sig);
 static void noop_handler(int sig);
 static void become_daemon(void);
-static int listen_socket(char *port);
+static int listen_socket(char *port, int reuseport);
+static int inherited_socket(int fd);
+static void tune_listener(int sock);
+static int default_backlog(void);
+static void check_listener(int fd);
+static int stop_accepting(int *fds, int n);
+static int upgrade_server(int *fds, int n);
+static int receive_listeners(int **fds);
+static void notify_upgraded(void);
+static void request_upgrade(int sig);
+static void request_drain(int sig);
+static void supervise_workers(int *listeners, int n, enum Engine engine, char *docroot);
+static pid_t spawn_worker(int *listeners, int n, int idx, enum Engine engine, char *docroot);
+static void terminate_workers(int sig);
+static void run_server(int server, enum Engine engine, char *docroot);
 static void server_main(int server, char *docroot);
-static void service(FILE *in, FILE *out, char *docroot);
-static struct HTTPRequest* read_request(FILE *in);
-static void read_request_line(struct HTTPRequest *req, FILE *in);
-static struct HTTPHeaderField* read_header_field(FILE *in);
-static void upcase(char *str);
-static void free_request(struct HTTPRequest *req);
+static int accept_client(int server_fd, int flags);
+static void shed_connection(int server_fd);
+static void reject_connection(int sock);
+static void epoll_server_main(int server, char *docroot);
+static void expire_connection(struct TimerWheel *wheel, void *data);
+static void tick_http_date(struct TimerWheel *wheel, void *data);
+static long now_msec(void);
+static long now_nsec(void);
+static void timer_init(struct TimerWheel *wheel, long now);
+static void timer_add(struct TimerWheel *wheel, struct Timer *timer, long expires);
+static void timer_del(struct TimerWheel *wheel, struct Timer *timer);
+static void timer_link(struct TimerWheel *wheel, struct Timer *timer, long earliest);
+static void timer_advance(struct TimerWheel *wheel, long now);
+static long timer_next(struct TimerWheel *wheel);
+static void set_nonblocking(int fd);
+static void uring_server_main(int server, char *docroot);
+static void setup_uring(void);
+static struct io_uring_sqe* uring_get_sqe(void);
+static void uring_prep(struct io_uring_sqe *sqe, int op, int fd, struct Connection *conn, enum UringOp tag);
+static int uring_enter(unsigned min_complete, long timeout_ms);
+static void uring_complete(struct io_uring_cqe *cqe, int server_fd, char *docroot, struct TimerWheel *wheel, long now);
+static void uring_arm_accept(int server_fd);
+static void uring_arm_notify(void);
+static void uring_arm_recv(struct Connection *conn);
+static void uring_recv_done(struct Connection *conn, struct io_uring_cqe *cqe);
+static ssize_t uring_recv(struct Connection *conn, char *buf, size_t len);
+static int uring_send(struct Connection *conn);
+static void uring_send_done(struct Connection *conn, enum UringOp op, int n);
+static void uring_release_bufs(struct Connection *conn);
+static void uring_recycle_buf(int bid);
+static void thread_server_main(int server, char *docroot);
+static void* service_thread(void *arg);
+static void queue_push(struct SocketQueue *q, int sock);
+static int queue_pop(struct SocketQueue *q);
+static void queue_wait_space(struct SocketQueue *q);
+static void service(int sock, char *docroot);
+static void serve_connection(struct Connection *conn, char *docroot);
+static struct Connection* new_connection(int sock);
+static struct Connection* alloc_connection(void);
+static void init_connection(struct Connection *conn, int sock);
+static void finish_connection(struct Connection *conn);
+static void free_connection(struct Connection *conn);
+static void close_connection(struct Connection *conn);
+static void run_connection(struct Connection *conn, char *docroot);
+static int connection_read(struct Connection *conn, char *docroot);
+static int connection_read_body(struct Connection *conn, char *docroot);
+static void start_body(struct Connection *conn, struct HTTPRequest *req);
+static long feed_body(struct Connection *conn, char *p, size_t len);
+static long feed_chunked(struct Connection *conn, char *p, size_t len);
+static int body_done(struct Connection *conn);
+static ssize_t connection_recv(struct Connection *conn, char *buf, size_t len);
+static int connection_parse(struct Connection *conn, char *docroot);
+static int wants_keep_alive(struct HTTPRequest *req);
+static int header_has_token(char *value, char *token);
+static int connection_write(struct Connection *conn);
+static int send_body(struct Connection *conn);
+static int splice_body(struct Connection *conn);
+static int send_mem_body(struct Connection *conn);
+static void set_cork(struct Connection *conn, int on);
+static void connection_error(struct Connection *conn, char *status);
+static void connection_timeout(struct Connection *conn);
+static void connection_respond(struct Connection *conn, char *docroot);
+static void reset_parser(struct HTTPParser *parser);
+static int read_request(struct HTTPParser *parser, struct HTTPRequest *req, char *buf, size_t len);
+static int read_request_line(struct HTTPRequest *req, size_t start, size_t end);
+static long decode_path(char *path, size_t len);
+static int safe_path(char *path, size_t len);
+static int hex_digit(int c);
+static char* parse_error_status(int result);
+static int read_header_field(struct HTTPRequest *req, size_t start, size_t colon, size_t end);
+static void init_scanner(void);
+static char* find_char2_scalar(char *p, char *end, int c1, int c2);
+static void fold_case_scalar(char *p, size_t len, int upper);
 static long content_length(struct HTTPRequest *req);
+static int read_transfer_encoding(struct HTTPRequest *req);
 static char* lookup_header_field_value(struct HTTPRequest *req, char *name);
-static void respond_to(struct HTTPRequest *req, FILE *out, char *docroot);
-static void do_file_response(struct HTTPRequest *req, FILE *out, char *docroot);
-static void method_not_allowed(struct HTTPRequest *req, FILE *out);
-static void not_implemented(struct HTTPRequest *req, FILE *out);
-static void not_found(struct HTTPRequest *req, FILE *out);
-static void output_common_header_fields(struct HTTPRequest *req, FILE *out, char *status);
-static struct FileInfo* get_fileinfo(char *docroot, char *path);
-static char* build_fspath(char *docroot, char *path);
-static void free_fileinfo(struct FileInfo *info);
+static void respond_to(struct HTTPRequest *req, struct Response *out, char *docroot);
+static void select_body_handler(struct HTTPRequest *req);
+static void discard_body(struct HTTPRequest *req, char *data, size_t len);
+static void do_file_response(struct HTTPRequest *req, struct Response *out, char *docroot);
+static void directory_response(struct HTTPRequest *req, struct Response *out, struct CachedFile *file);
+static int render_directory(struct CachedFile *file, char *urlpath);
+static int compare_names(const void *a, const void *b, void *arg);
+static void out_html(struct Response *out, const char *str);
+static void out_url(struct Response *out, const char *str);
+static int not_modified(struct HTTPRequest *req, char *etag, time_t mtime);
+static struct CachedFile* negotiate_encoding(struct HTTPRequest *req, char *docroot, struct CachedFile *file);
+static int find_variants(struct FileInfo *info);
+static int accepts_encoding(char *accept, char *name);
+static int compressed_response(struct HTTPRequest *req, struct Response *out, struct CachedFile *file);
+static int compressible_type(char *type);
+static int etag_matches(char *list, char *etag);
+static time_t parse_http_date(char *val);
+static int parse_ranges(struct HTTPRequest *req, struct CachedFile *file, struct ByteRange *ranges);
+static long parse_range_number(char **p);
+static void not_modified_response(struct HTTPRequest *req, struct Response *out, char *etag, char *last_modified);
+static void range_not_satisfiable(struct HTTPRequest *req, struct Response *out, struct CachedFile *file);
+static void single_range_response(struct HTTPRequest *req, struct Response *out, struct CachedFile *file, struct ByteRange *range);
+static int multi_range_response(struct HTTPRequest *req, struct Response *out, struct CachedFile *file, struct ByteRange *ranges, int n);
+static void method_not_allowed(struct HTTPRequest *req, struct Response *out);
+static void not_implemented(struct HTTPRequest *req, struct Response *out);
+static void not_found(struct HTTPRequest *req, struct Response *out);
+static void output_common_header_fields(struct HTTPRequest *req, struct Response *out, char *status);
+static void output_connection_header_fields(struct HTTPRequest *req, struct Response *out);
+static void output_file_header_fields(struct CachedFile *file, struct Response *out);
+static void format_http_date(time_t t, char *buf);
+static char* current_http_date(void);
+static void update_http_date(time_t t);
+static void init_static_header_fields(void);
+static void html_response(struct HTTPRequest *req, struct Response *out, char *status, const char *fmt, ...);
+static void out_printf(struct Response *out, const char *fmt, ...);
+static void out_write(struct Response *out, const char *p, size_t len);
+static void out_puts(struct Response *out, const char *str);
+static void out_long(struct Response *out, long n);
+static void reset_response(struct Response *res);
+static char* buf_reserve(struct Buffer *buf, size_t len);
+static struct FileInfo* get_fileinfo(struct Arena *arena, char *docroot, char *path, int encoding);
+static char* build_fspath(struct Arena *arena, char *docroot, char *path, char *suffix);
+static void format_etag(struct stat *st, char *buf);
+static void fill_fileinfo(struct FileInfo *info, struct stat *st);
+static void init_file_cache(int use_inotify);
+static struct CachedFile* lookup_file(struct Arena *arena, char *docroot, char *urlpath, int encoding);
+static void release_file(struct CachedFile *file);
+static void drop_file(struct CachedFile *file);
+static int file_changed(struct CachedFile *file);
+static void process_file_events(void);
+static int cache_file_response(struct CachedFile *file);
+static int make_room(size_t len, struct CachedFile *keep);
+static void output_cached_response(struct HTTPRequest *req, struct Response *out, struct CachedFile *file);
+static void free_file_response(struct CachedFile *file);
+static void request_stats(int sig);
+static void init_stats(int nslots);
+static void stats_add(unsigned long *counter, long n);
+static void stats_record(struct StatsHistogram *hist, long ns);
+static void stats_count_response(int status, size_t bytes);
+static void stats_response(struct HTTPRequest *req, struct Response *out);
+static void output_stats_metric(struct Response *out, char *name, char *type, char *help);
+static void output_stats_summary(struct Response *out, char *name, char *help, struct StatsHistogram *hist);
+static int stats_hist_index(unsigned long v);
+static unsigned long stats_hist_upper(int idx);
+static void log_file_cache_stats(void);
+static void lru_remove(struct FileCache *cache, struct CachedFile *file);
+static void lru_push(struct FileCache *cache, struct CachedFile *file);
+static unsigned long hash_string(char *str);
+static void init_mime_types(char *path, int required);
+static void parse_mime_types(char *text);
+static void add_mime_type(char *ext, char *type);
+static void grow_mime_table(void);
+static struct MimeType* find_mime_slot(char *ext);
+static char* lookup_mime_type(char *path);
 static char* guess_content_type(struct FileInfo *info);
+static void init_access_log(char *path);
+static void start_access_log_thread(int nrings);
+static void start_compressor(void);
+static void* compressor_main(void *arg);
+static struct CompressedBody* lookup_compressed(struct FileInfo *info);
+static void compress_file(struct CompressedBody *c);
+static char* gzip_compress(char *src, size_t len, size_t *out_len);
+static void insert_compressed(struct CompressedBody *c);
+static void unlink_compressed(struct CompressedBody *c);
+static void release_compressed(struct CompressedBody *c);
+static void request_log_reopen(int sig);
+static void forward_log_reopen(int sig);
+static void reopen_access_log(void);
+static void access_log(struct Connection *conn, struct HTTPRequest *req, int status, size_t bytes);
+static void fill_log_record(struct LogRecord *rec, struct Connection *conn, struct HTTPRequest *req, int status, size_t bytes);
+static void* access_log_main(void *arg);
+static int access_log_pending(void);
+static size_t format_log_record(struct LogRecord *rec, char *buf);
+static size_t copy_log_field(char *dst, char *src, size_t max);
+static void write_access_log(char *buf, size_t len);
+static void flush_access_log(void);
 static void* xmalloc(size_t sz);
+static void* arena_alloc(struct Arena *arena, size_t sz);
+static void arena_reset(struct Arena *arena);
+static void arena_free(struct Arena *arena);
+static void* xrealloc(void *ptr, size_t sz);
 static void log_exit(const char *fmt, ...);
 
 /****** Functions ********************************************************/
 
-#define USAGE "Usage: %s [--port=n] [--chroot --user=u --group=g] [--debug] <docroot>\n"
-
 static int debug_mode = 0;
+static struct Scanner *scanner;
+static struct Uring *uring = NULL; // io_uring版で動いているときだけ設定する
+static int keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+static int max_keepalive_requests = DEFAULT_MAX_KEEPALIVE_REQUESTS;
+static int nthreads = 0; // fork版で接続ごとにforkせずスレッドプールで処理するならスレッド数
+static struct SocketQueue socket_queue;
+static int file_cache_max = DEFAULT_FILE_CACHE_ENTRIES;
+static __thread struct FileCache file_cache; // --threadsではスレッドごとに持つ
+static struct WorkerStats local_stats; // init_statsを呼ぶまで(bench/などから使うとき)の置き場
+static struct WorkerStats *stats_area = &local_stats; // 全ワーカーぶんの統計
+static int stats_nslots = 1;
+static struct WorkerStats *stats = &local_stats; // このワーカーの統計
+static struct MimeTable mime_table;
+static size_t response_cache_size = DEFAULT_RESPONSE_CACHE_SIZE; // --response-cache: ワーカーごとの上限
+static size_t response_cache_max_file = DEFAULT_RESPONSE_CACHE_MAX_FILE;
+static size_t body_buffer_size = DEFAULT_BODY_BUFFER_SIZE; // 接続ごとにボディの受信に使うメモリ
+static volatile sig_atomic_t stats_requested = 0;
+static char *access_log_path = NULL;
+static int access_log_fd = -1; // アクセスログを書かないなら-1
+static struct LogRing **access_log_rings = NULL; // 書き出しスレッドが読むリング, なければ(接続ごとにforkする版)NULL
+static int naccess_log_rings = 0;
+static __thread struct LogRing *access_log_ring = NULL; // このスレッドが書き込むリング
+static int access_log_sleeping __attribute__((aligned(64))) = 0; // 書き出しスレッドがfutexで待っていれば1
+static volatile sig_atomic_t log_reopen_requested = 0;
+static volatile sig_atomic_t upgrade_requested = 0; // SIGUSR2
+static volatile sig_atomic_t drain_requested = 0; // SIGQUIT, またはアップグレードが済んだ
+static volatile int draining = 0; // 新しい接続を受け付けず、残りの接続を閉じたら終了する
+static char *exec_path; // アップグレードでexecするパス(起動したときのargv[0])
+static char **exec_argv;
+static int upgrade_fd = -1; // アップグレードで起動されたなら前のサーバ、socketdから起動されたならsocketdとつながるfd
+static int compress_enabled = 0; // --compress
+static int autoindex_enabled = 0; // --autoindex
+static struct Connection *free_connections = NULL; // 閉じて使い回しを待っているConnectionのリスト
+static int nfree_connections = 0;
+static int listen_backlog = -1; // --backlog, -1ならsomaxconnに合わせる
+static int defer_accept = 0; // --defer-accept: データが届くまでacceptを待たせる秒数
+static int fastopen_qlen = 0; // --fastopen: TCP Fast Openで受け付ける保留中の接続数
+static int tcp_nodelay = 1; // --no-tcp-nodelayで0: Nagleを止めない
+static int tcp_cork = 0; // --tcp-cork: MSG_MOREの代わりにTCP_CORKでレスポンスをまとめる
+static int max_connections = 0; // --max-conns: プロセス(ワーカー)ごとの同時接続数の上限, 0なら無制限
+static int reserve_fd = -1; // fdが尽きたときに閉じて、待っている接続を受け付けて断るための予備
+static int counted_by_parent = 0; // fork版の子プロセス: active_connectionsは親がwaitして減らす
+static pid_t upgrade_pid = 0; // アップグレードで起動した新しいサーバ(接続の子プロセスではない)
+static struct CompressCache *compress_cache = NULL; // 圧縮スレッドがなければNULL
+static struct Encoding encodings[NENCODINGS] = {
+    {"identity", ""},
+    {"br", ".br"},
+    {"zstd", ".zst"},
+    {"gzip", ".gz"},
+};
+static __thread char http_date[HTTP_DATE_LEN + 1]; // 現在時刻のDateヘッダの値
+static __thread time_t http_date_time; // http_dateが表している時刻
+static __thread int http_date_ticking = 0; // epoll版: タイマーで毎秒http_dateを更新しているなら非ゼロ
+static char keepalive_header_fields[LINE_BUF_SIZE]; // "Connection: keep-alive\r\nKeep-Alive: timeout=n, max="
+static size_t keepalive_header_fields_len;
+
+// bench/parsebench.cのように、このファイルをincludeして関数だけ使う場合はmainを外す
+#ifndef HTTPD2_NO_MAIN
+
+#define USAGE "Usage: %s [--port=n] [--chroot --user=u --group=g] [--engine=fork|epoll|io_uring] [--workers=n]\n"\
+    "    [--keepalive-timeout=sec] [--max-requests=n] [--file-cache=n]\n"\
+    "    [--response-cache=bytes] [--response-cache-max-file=bytes] [--mime-types=path]\n"\
+    "    [--access-log=path] [--threads=n] [--compress] [--body-buffer=bytes] [--autoindex]\n"\
+    "    [--listen-fd=n] [--backlog=n] [--defer-accept=sec] [--fastopen=n]\n"\
+    "    [--no-tcp-nodelay] [--tcp-cork] [--max-conns=n]\n"\
+    "    [--debug] <docroot>\n"
 
 static struct option longopts[] = {
     {"debug",  no_argument,       &debug_mode, 1},
@@ -112,19 +795,52 @@ static struct option longopts[] = {
     {"user",   required_argument, NULL, 'u'},
     {"group",  required_argument, NULL, 'g'},
     {"port",   required_argument, NULL, 'p'},
+    {"engine", required_argument, NULL, 'e'},
+    {"workers", required_argument, NULL, 'w'},
+    {"keepalive-timeout", required_argument, NULL, 't'},
+    {"max-requests", required_argument, NULL, 'm'},
+    {"file-cache", required_argument, NULL, 'f'},
+    {"response-cache", required_argument, NULL, 'r'},
+    {"response-cache-max-file", required_argument, NULL, 's'},
+    {"mime-types", required_argument, NULL, 'T'},
+    {"access-log", required_argument, NULL, 'a'},
+    {"threads", required_argument, NULL, 'n'},
+    {"compress", no_argument,     &compress_enabled, 1},
+    {"autoindex", no_argument,    &autoindex_enabled, 1},
+    {"body-buffer", required_argument, NULL, 'B'},
+    {"listen-fd", required_argument, NULL, 'L'},
+    {"backlog", required_argument, NULL, 'b'},
+    {"defer-accept", required_argument, NULL, 'D'},
+    {"fastopen", required_argument, NULL, 'F'},
+    {"no-tcp-nodelay", no_argument, &tcp_nodelay, 0},
+    {"tcp-cork", no_argument,     &tcp_cork, 1},
+    {"max-conns", required_argument, NULL, 'M'},
     {"help",   no_argument,       NULL, 'h'},
     {0, 0, 0, 0}
 };
 
 int main(int argc, char *argv[])
 {
-    int server_fd;
+    int server_fd = -1;
     char *port = NULL;
     char *docroot;
     int do_chroot = 0;
     char *user = NULL;
     char *group = NULL;
-    int opt;
+    enum Engine engine = ENGINE_FORK;
+    int nworkers = 0;
+    int *listeners = NULL;
+    char *mime_types = NULL;
+    char *access_log_file = NULL;
+    int listen_fd = -1;
+    int *inherited = NULL;
+    int ninherited;
+    int opt, i;
+
+    // SIGUSR2で同じ引数のまま新しいバイナリを起動し直す。デーモンはchdir("/")するので絶対パスにしておく
+    exec_argv = argv;
+    exec_path = strchr(argv[0], '/') ? realpath(argv[0], NULL) : argv[0];
+    if (!exec_path) exec_path = argv[0];
 
     while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
         switch (opt) {
@@ -142,6 +858,110 @@ int main(int argc, char *argv[])
         case 'p':
             port = optarg;
             break;
+        case 'e':
+            if (strcmp(optarg, "fork") == 0)
+                engine = ENGINE_FORK;
+            else if (strcmp(optarg, "epoll") == 0)
+                engine = ENGINE_EPOLL;
+            else if (strcmp(optarg, "io_uring") == 0)
+                engine = ENGINE_IO_URING;
+            else {
+                fprintf(stderr, "unknown engine: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            if (nworkers < 1 || nworkers > MAX_WORKERS) {
+                fprintf(stderr, "--workers must be 1..%d\n", MAX_WORKERS);
+                exit(1);
+            }
+            break;
+        case 't':
+            keepalive_timeout = atoi(optarg);
+            if (keepalive_timeout < 1) {
+                fprintf(stderr, "--keepalive-timeout must be positive\n");
+                exit(1);
+            }
+            break;
+        case 'm':
+            max_keepalive_requests = atoi(optarg);
+            if (max_keepalive_requests < 1) {
+                fprintf(stderr, "--max-requests must be positive\n");
+                exit(1);
+            }
+            break;
+        case 'f':
+            file_cache_max = atoi(optarg);
+            if (file_cache_max < 0) {
+                fprintf(stderr, "--file-cache must not be negative\n");
+                exit(1);
+            }
+            break;
+        case 'r':
+        case 's':
+            if (atol(optarg) < 0) {
+                fprintf(stderr, "--%s must not be negative\n",
+                        opt == 'r' ? "response-cache" : "response-cache-max-file");
+                exit(1);
+            }
+            if (opt == 'r')
+                response_cache_size = atol(optarg);
+            else
+                response_cache_max_file = atol(optarg);
+            break;
+        case 'T':
+            mime_types = optarg;
+            break;
+        case 'B':
+            if (atol(optarg) < 1) {
+                fprintf(stderr, "--body-buffer must be positive\n");
+                exit(1);
+            }
+            body_buffer_size = atol(optarg);
+            break;
+        case 'a':
+            access_log_file = optarg;
+            break;
+        case 'b':
+            listen_backlog = atoi(optarg);
+            if (listen_backlog < 1) {
+                fprintf(stderr, "--backlog must be positive\n");
+                exit(1);
+            }
+            break;
+        case 'D':
+        case 'F':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "--%s must not be negative\n", opt == 'D' ? "defer-accept" : "fastopen");
+                exit(1);
+            }
+            if (opt == 'D')
+                defer_accept = atoi(optarg);
+            else
+                fastopen_qlen = atoi(optarg);
+            break;
+        case 'M':
+            max_connections = atoi(optarg);
+            if (max_connections < 0) {
+                fprintf(stderr, "--max-conns must not be negative\n");
+                exit(1);
+            }
+            break;
+        case 'L':
+            listen_fd = atoi(optarg);
+            if (listen_fd < 0) {
+                fprintf(stderr, "--listen-fd must not be negative\n");
+                exit(1);
+            }
+            break;
+        case 'n':
+            nthreads = atoi(optarg);
+            if (nthreads < 1 || nthreads > MAX_THREADS) {
+                fprintf(stderr, "--threads must be 1..%d\n", MAX_THREADS);
+                exit(1);
+            }
+            break;
         case 'h':
             fprintf(stdout, USAGE, argv[0]);
             exit(0);
@@ -155,494 +975,4610 @@ int main(int argc, char *argv[])
         exit(1);
     }
     docroot = argv[optind];
+    if (nthreads > 0 && engine != ENGINE_FORK) {
+        fprintf(stderr, "--threads works only with --engine=fork\n");
+        exit(1);
+    }
+    if (listen_fd >= 0 && port) {
+        fprintf(stderr, "--listen-fd and --port are exclusive\n");
+        exit(1);
+    }
+    if (compress_enabled && engine == ENGINE_FORK && nthreads == 0) {
+        // 接続ごとの子プロセスでは、圧縮したボディを次の接続に残せない
+        fprintf(stderr, "--compress needs --engine=epoll|io_uring or --threads\n");
+        exit(1);
+    }
 
+    if (listen_backlog < 0) listen_backlog = default_backlog();
+    init_scanner();
+    init_static_header_fields();
+    // chrootすると/etcが見えなくなるので先に読んでおく
+    init_mime_types(mime_types ? mime_types : DEFAULT_MIME_TYPES, mime_types != NULL);
+    if (access_log_file) init_access_log(access_log_file);
     if (do_chroot) {
         setup_environment(docroot, user, group);
         docroot = "";
     }
     install_signal_handlers();
-    server_fd = listen_socket(port);
+    init_stats(nworkers > 0 ? nworkers : 1);
+    // 前のサーバ(SIGUSR2)かsystemd・inetd・スーパーバイザから接続待ちソケットを受け継ぐ
+    ninherited = receive_listeners(&inherited);
+    if (ninherited == 0 && (server_fd = inherited_socket(listen_fd)) >= 0) {
+        inherited = xmalloc(sizeof(int));
+        inherited[ninherited++] = server_fd;
+    }
+    if (ninherited > 0 && nworkers > 0) {
+        // 足りない分は同じキューからacceptする
+        listeners = xmalloc(sizeof(int) * nworkers);
+        for (i = 0; i < nworkers; i++) {
+            listeners[i] = i < ninherited ? inherited[i] : fcntl(inherited[0], F_DUPFD_CLOEXEC, 0);
+            if (listeners[i] < 0) log_exit("fcntl(2) failed: %s", strerror(errno));
+        }
+    } else if (ninherited > 0) {
+        server_fd = inherited[0];
+    } else if (nworkers > 0) {
+        // ワーカーごとにSO_REUSEPORTの接続待ちソケットを用意し、
+        // どのワーカーにacceptさせるかはカーネルに振り分けさせる
+        listeners = xmalloc(sizeof(int) * nworkers);
+        for (i = 0; i < nworkers; i++)
+            listeners[i] = listen_socket(port, 1);
+    } else {
+        server_fd = listen_socket(port, 0);
+    }
+    // 余ったソケットを閉じるとそのキューの接続は失われる
+    for (i = nworkers > 0 ? nworkers : 1; i < ninherited; i++) {
+        syslog(LOG_WARNING, "closing extra inherited socket %d", inherited[i]);
+        close(inherited[i]);
+    }
+    free(inherited);
     if (!debug_mode) {
         openlog(SERVER_NAME, LOG_PID|LOG_NDELAY, LOG_DAEMON);
         become_daemon();
     }
-    server_main(server_fd, docroot);
-    exit(0);
+    if (nworkers > 0)
+        supervise_workers(listeners, nworkers, engine, docroot);
+    else
+        run_server(server_fd, engine, docroot);
+    exit(0);
+}
+#endif
+
+static pid_t worker_pids[MAX_WORKERS];
+static int nworker_pids = 0;
+
+// ワーカーをあらかじめn個forkしておき、終了したものは同じ接続待ちソケットで起動し直す
+// 接続待ちソケットはマスターも持ち続けるので、ワーカーが落ちてもキューの接続は失われない
+static void supervise_workers(int *listeners, int n, enum Engine engine, char *docroot)
+{
+    time_t started[MAX_WORKERS];
+    int i;
+
+    nworker_pids = n;
+    trap_signal(SIGTERM, terminate_workers);
+    trap_signal(SIGINT, terminate_workers);
+    if (access_log_fd >= 0) trap_signal(SIGHUP, forward_log_reopen);
+    // wait(2)から戻ってフラグを見られるよう、SA_RESTARTなしで受ける
+    trap_signal_interrupt(SIGUSR2, request_upgrade);
+    trap_signal_interrupt(SIGQUIT, request_drain);
+    for (i = 0; i < n; i++) {
+        worker_pids[i] = spawn_worker(listeners, n, i, engine, docroot);
+        started[i] = time(NULL);
+    }
+    // ワーカーが起動すれば、キューの接続はそのワーカーがacceptする
+    notify_upgraded();
+    for (;;) {
+        int status;
+        pid_t pid;
+
+        if (!draining && stop_accepting(listeners, n)) {
+            // ワーカーに残りの接続を片付けさせ、全員終了したら終了する
+            draining = 1;
+            for (i = 0; i < n; i++) {
+                if (worker_pids[i] > 0) kill(worker_pids[i], SIGQUIT);
+            }
+        }
+        pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            if (errno == ECHILD && draining) exit(0);
+            log_exit("wait(2) failed: %s", strerror(errno));
+        }
+        for (i = 0; i < n; i++) {
+            if (worker_pids[i] == pid) break;
+        }
+        if (i == n) continue;
+        if (draining) {
+            worker_pids[i] = 0;
+            for (i = 0; i < n && worker_pids[i] == 0; i++)
+                ;
+            if (i == n) exit(0);
+            continue;
+        }
+        if (WIFSIGNALED(status))
+            syslog(LOG_WARNING, "worker %d (pid %d) killed by signal %d", i, (int)pid, WTERMSIG(status));
+        else
+            syslog(LOG_WARNING, "worker %d (pid %d) exited with status %d", i, (int)pid, WEXITSTATUS(status));
+        // 起動直後に落ち続けるワーカーをforkし続けないよう間を空ける
+        if (time(NULL) - started[i] < 1) sleep(1);
+        worker_pids[i] = spawn_worker(listeners, n, i, engine, docroot);
+        started[i] = time(NULL);
+    }
+}
+
+static pid_t spawn_worker(int *listeners, int n, int idx, enum Engine engine, char *docroot)
+{
+    pid_t pid;
+    int i;
+
+    pid = fork();
+    if (pid < 0) log_exit("fork(2) failed: %s", strerror(errno));
+    if (pid > 0) return pid;
+
+    // ワーカー: マスターが死んだら一緒に終了する
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    trap_signal(SIGTERM, SIG_DFL);
+    trap_signal(SIGINT, SIG_DFL);
+    if (getppid() == 1) _exit(0); // prctlより前にマスターが死んでいた
+    if (upgrade_fd >= 0) { // 新しいサーバの準備ができたことはマスターが知らせる
+        close(upgrade_fd);
+        upgrade_fd = -1;
+    }
+    // 統計は同じ番号のワーカーが引き継ぐ。前のワーカーの接続はもう残っていない
+    stats = &stats_area[idx];
+    stats->active_connections = 0;
+    for (i = 0; i < n; i++) {
+        if (i != idx) close(listeners[i]);
+    }
+    run_server(listeners[idx], engine, docroot);
+    exit(0);
+}
+
+// マスターが終了するときはワーカーも終了させる
+static void terminate_workers(int sig)
+{
+    int i;
+
+    for (i = 0; i < nworker_pids; i++) {
+        if (worker_pids[i] > 0) kill(worker_pids[i], SIGTERM);
+    }
+    _exit(0);
+}
+
+static void run_server(int server_fd, enum Engine engine, char *docroot)
+{
+    // ブロックしているaccept(2)などから戻ってフラグを見られるよう、SA_RESTARTなしで受ける
+    // ワーカーのアップグレードはマスターが行う
+    trap_signal_interrupt(SIGUSR2, nworker_pids > 0 ? SIG_IGN : request_upgrade);
+    trap_signal_interrupt(SIGQUIT, request_drain);
+    // "/"はchrootしていても必ず開ける
+    reserve_fd = open("/", O_RDONLY | O_CLOEXEC);
+    if (access_log_fd >= 0) {
+        trap_signal(SIGHUP, request_log_reopen);
+        // 接続ごとにforkする版は子プロセスが直接書く。--threadsではスレッドごとにリングを持つ
+        if (engine != ENGINE_FORK || nthreads > 0) start_access_log_thread(nthreads > 0 ? nthreads : 1);
+        access_log_ring = access_log_rings && nthreads == 0 ? access_log_rings[0] : NULL;
+    }
+    if (compress_enabled) start_compressor();
+    switch (engine) {
+    case ENGINE_EPOLL:
+        epoll_server_main(server_fd, docroot);
+        break;
+    case ENGINE_IO_URING:
+        uring_server_main(server_fd, docroot);
+        break;
+    case ENGINE_FORK:
+        server_main(server_fd, docroot);
+        break;
+    }
+}
+
+static void server_main(int server_fd, char *docroot)
+{
+    if (nthreads > 0) {
+        thread_server_main(server_fd, docroot);
+        return;
+    }
+    // 子プロセスがSIGPIPEやlog_exit()でどう終わっても、接続数は親がwaitして数え直す
+    // SIGCHLDでpollから戻って回収する
+    trap_signal_interrupt(SIGCHLD, noop_handler);
+    // 相手が閉じたソケットへの書き込みで子プロセスごと終了しないよう、EPIPEで受ける
+    trap_signal(SIGPIPE, SIG_IGN);
+    // 起きるたびにキューをacceptし尽くすので、接続待ちソケットはノンブロッキングにする
+    // (acceptしたソケットにO_NONBLOCKは引き継がれないので、子プロセスはブロッキングのまま)
+    set_nonblocking(server_fd);
+    notify_upgraded();
+    for (;;) {
+        struct pollfd pfd;
+
+        // 処理中の接続は子プロセスが最後まで面倒を見るので、すぐに終了してよい
+        if (stop_accepting(&server_fd, 1)) exit(0);
+        pfd.fd = server_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                reap_children();
+                continue;
+            }
+            log_exit("poll(2) failed: %s", strerror(errno));
+        }
+        reap_children();
+        if (log_reopen_requested) {
+            log_reopen_requested = 0;
+            reopen_access_log();
+        }
+        for (;;) {
+            int sock;
+            int pid;
+
+            /* この関数は、接続待ちソケット socket 宛ての保留状態の接続要求が入っているキューから
+               先頭の接続要求を取り出し、接続済みソケットを新規に生成し、 
+               そのソケットを参照する新しいファイルディスクリプターを返す。 */
+            sock = accept_client(server_fd, 0);
+            if (sock < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                continue;
+            }
+            pid = fork();
+            if (pid < 0) { // プロセスが作れないときは、この接続だけ断って動き続ける
+                syslog(LOG_WARNING, "fork(2) failed: %s", strerror(errno));
+                stats_add(&stats->active_connections, -1);
+                reject_connection(sock);
+                continue;
+            }
+            if (pid == 0) {
+                // 子プロセス
+                counted_by_parent = 1;
+                close(server_fd);
+                service(sock, docroot);
+                exit(0);
+            }
+            close(sock); // 親プロセスと結びついたままの接続済みソケットをclose 図17.2
+        }
+    }
+}
+
+// 接続を1つ受け付ける(flagsはaccept4のSOCK_NONBLOCKなど)
+// 受け付けなかったときは-1を返す。errnoがEAGAINなら接続が届くのを待ってから、それ以外はすぐに呼び直してよい
+// (fdが尽きているとキューが空でもEMFILEになるので、断った後はEAGAINにして待たせる)
+// fdが尽きても、--max-connsを超えても、終了せずに503で断って動き続ける
+static int accept_client(int server_fd, int flags)
+{
+    int sock;
+
+    sock = accept4(server_fd, NULL, NULL, flags | SOCK_CLOEXEC);
+    if (sock < 0) {
+        switch (errno) {
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            shed_connection(server_fd);
+            errno = EAGAIN;
+            return -1;
+        case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+        case EWOULDBLOCK:
+#endif
+        case EINTR:
+        case ECONNABORTED:
+        // accept(2)によれば、ネットワークのエラーはEAGAINと同じく再試行すればよい
+        case ENETDOWN: case EPROTO: case ENOPROTOOPT: case EHOSTDOWN:
+        case ENONET: case EHOSTUNREACH: case EOPNOTSUPP: case ENETUNREACH:
+            return -1;
+        default:
+            log_exit("accept(2) failed: %s", strerror(errno));
+        }
+    }
+    if (max_connections > 0 && (long)stats->active_connections >= max_connections) {
+        reject_connection(sock);
+        errno = ECONNABORTED;
+        return -1;
+    }
+    // 子プロセスやスレッドに渡る前から数えないと、一度に受け付けた分が上限をすり抜ける
+    stats_add(&stats->active_connections, 1);
+    return sock;
+}
+
+// fdが尽きてacceptできないと、接続はキューに残ったままepollなどで何度も起こされる
+// 予備のfdを閉じて1つ受け付けて断り、予備を取り直す
+static void shed_connection(int server_fd)
+{
+    static time_t last_warned;
+    struct pollfd pfd;
+    int sock;
+
+    if (time(NULL) != last_warned) {
+        syslog(LOG_WARNING, "accept(2) failed: %s; rejecting connections", strerror(errno));
+        last_warned = time(NULL);
+    }
+    if (reserve_fd < 0) return;
+    close(reserve_fd);
+    // ブロッキングの接続待ちソケットでも待たされないよう、届いているときだけacceptする
+    pfd.fd = server_fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) == 1) {
+        sock = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (sock >= 0) reject_connection(sock);
+    }
+    reserve_fd = open("/", O_RDONLY | O_CLOEXEC);
+}
+
+// 503を返して閉じる。リクエストは読まないので、送れなくても構わない
+static void reject_connection(int sock)
+{
+    char buf[LINE_BUF_SIZE];
+    int len;
+
+    len = snprintf(buf, sizeof buf, STATUS_LINE_PREFIX "503 Service Unavailable\r\nDate: %s\r\n"
+                   SERVER_HEADER_FIELD "Content-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n",
+                   current_http_date());
+    send(sock, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    // 届いているリクエストを読み捨ててから閉じる(未読のデータがあるとRSTになり、503が失われる)
+    while (recv(sock, buf, sizeof buf, MSG_DONTWAIT) > 0)
+        ;
+    close(sock);
+    stats_add(&stats->rejected_connections, 1);
+    stats_count_response(503, len);
+}
+
+// --threads: 接続待ちはこのスレッドだけが行い、受け付けたソケットをキューでスレッドプールに渡す
+// キューが一杯の間はacceptしないので、溢れた接続はカーネルのbacklogで待たせる
+static void thread_server_main(int server_fd, char *docroot)
+{
+    sigset_t all, old;
+    pthread_t thread;
+    int i, err;
+
+    // 相手が閉じたソケットへの書き込みでプロセスごと終了しないよう、EPIPEで受ける
+    trap_signal(SIGPIPE, SIG_IGN);
+    socket_queue.capa = nthreads * THREAD_QUEUE_PER_THREAD;
+    socket_queue.socks = xmalloc(sizeof(int) * socket_queue.capa);
+    socket_queue.head = socket_queue.n = 0;
+    pthread_mutex_init(&socket_queue.lock, NULL);
+    pthread_cond_init(&socket_queue.not_empty, NULL);
+    pthread_cond_init(&socket_queue.not_full, NULL);
+    pthread_cond_init(&socket_queue.stopped, NULL);
+    socket_queue.running = nthreads;
+    // シグナルは接続待ちのスレッドで受ける
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 0; i < nthreads; i++) {
+        if ((err = pthread_create(&thread, NULL, service_thread, docroot)) != 0)
+            log_exit("pthread_create(3) failed: %s", strerror(err));
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    notify_upgraded();
+
+    for (;;) {
+        int sock;
+
+        queue_wait_space(&socket_queue);
+        if (stop_accepting(&server_fd, 1)) break;
+        sock = accept_client(server_fd, 0);
+        if (sock < 0) {
+            if (errno == EAGAIN) { // fdが尽きていた。次の接続が届くまで待つ
+                struct pollfd pfd;
+
+                pfd.fd = server_fd;
+                pfd.events = POLLIN;
+                poll(&pfd, 1, -1);
+            }
+            continue;
+        }
+        queue_push(&socket_queue, sock);
+    }
+    // キューに残った接続を処理し終えたスレッドから、-1を受け取って終了する
+    draining = 1;
+    close(server_fd);
+    for (i = 0; i < nthreads; i++)
+        queue_push(&socket_queue, -1);
+    pthread_mutex_lock(&socket_queue.lock);
+    while (socket_queue.running > 0)
+        pthread_cond_wait(&socket_queue.stopped, &socket_queue.lock);
+    pthread_mutex_unlock(&socket_queue.lock);
+    flush_access_log();
+    exit(0);
+}
+
+// プールのスレッド: Connection(受信バッファとレスポンスのバッファ)とファイルキャッシュは
+// スレッドごとに持って使い回すので、リクエストの処理でスレッド間のロックを取らない
+static void* service_thread(void *arg)
+{
+    static int next_ring = 0;
+    char *docroot = arg;
+    struct Connection *conn;
+
+    init_file_cache(0);
+    if (access_log_rings) access_log_ring = access_log_rings[__atomic_fetch_add(&next_ring, 1, __ATOMIC_RELAXED)];
+    conn = alloc_connection();
+    for (;;) {
+        int sock = queue_pop(&socket_queue);
+
+        if (sock < 0) break;
+        init_connection(conn, sock);
+        serve_connection(conn, docroot);
+        finish_connection(conn);
+    }
+    pthread_mutex_lock(&socket_queue.lock);
+    if (--socket_queue.running == 0) pthread_cond_signal(&socket_queue.stopped);
+    pthread_mutex_unlock(&socket_queue.lock);
+    return NULL;
+}
+
+static void queue_push(struct SocketQueue *q, int sock)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->n == q->capa)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    q->socks[(q->head + q->n) % q->capa] = sock;
+    q->n++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static int queue_pop(struct SocketQueue *q)
+{
+    int sock;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->n == 0)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    sock = q->socks[q->head];
+    q->head = (q->head + 1) % q->capa;
+    q->n--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return sock;
+}
+
+// 空きができるまで待つ(積むのは接続待ちのスレッドだけなので、戻ったあと必ず積める)
+static void queue_wait_space(struct SocketQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->n == q->capa)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// 1プロセスですべての接続を扱うイベント駆動版
+// 接続待ちソケットも接続済みソケットもノンブロッキングにして
+// エッジトリガのepollで読み書きできるようになった接続だけを進める
+static void epoll_server_main(int server_fd, char *docroot)
+{
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct TimerWheel wheel;
+    struct Timer date_timer;
+    long timeout_ms = keepalive_timeout * 1000L;
+    int epfd;
+
+    // 切断済みのソケットへの書き込みはEPIPEで検出する(プロセスごと終了しない)
+    trap_signal(SIGPIPE, SIG_IGN);
+    // SIGUSR1でキャッシュの統計をログに出す(epoll_waitがEINTRで戻ったところで出力)
+    trap_signal(SIGUSR1, request_stats);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) log_exit("epoll_create1(2) failed: %s", strerror(errno));
+    set_nonblocking(server_fd);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // data.ptrがNULLなら接続待ちソケット
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_fd, &ev) < 0)
+        log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+    // キャッシュしたファイルの変更はinotifyで受け取る
+    init_file_cache(1);
+    if (file_cache.inotify_fd >= 0) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &file_cache;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, file_cache.inotify_fd, &ev) < 0)
+            log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+    }
+
+    // Dateヘッダの値は毎秒タイマーで作り直し、レスポンスごとには作らない
+    timer_init(&wheel, now_msec());
+    date_timer.handler = tick_http_date;
+    date_timer.data = &date_timer;
+    date_timer.slot = NULL;
+    http_date_ticking = 1;
+    tick_http_date(&wheel, &date_timer);
+    notify_upgraded();
+
+    for (;;) {
+        struct Connection *conn;
+        long now;
+        int i, n;
+
+        if (!draining && stop_accepting(&server_fd, 1)) {
+            // 以降は接続待ちソケットのイベントを無視する(シグナルでepoll_waitが戻ったらここに来る)
+            draining = 1;
+            epoll_ctl(epfd, EPOLL_CTL_DEL, server_fd, NULL);
+            close(server_fd);
+        }
+        if (draining && (long)stats->active_connections == 0) {
+            flush_access_log();
+            exit(0);
+        }
+        // 次のタイマーが発火するまで待つ
+        n = epoll_wait(epfd, events, MAX_EVENTS, (int)timer_next(&wheel));
+        if (stats_requested) {
+            stats_requested = 0;
+            log_file_cache_stats();
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_exit("epoll_wait(2) failed: %s", strerror(errno));
+        }
+        now = now_msec();
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == &file_cache) {
+                process_file_events();
+                continue;
+            }
+            conn = events[i].data.ptr;
+            if (!conn) {
+                if (draining) continue;
+                // キューに溜まっている接続要求をすべて取り出す
+                for (;;) {
+                    int sock = accept_client(server_fd, SOCK_NONBLOCK);
+
+                    if (sock < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                        continue;
+                    }
+                    conn = new_connection(sock);
+                    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                    ev.data.ptr = conn;
+                    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0)
+                        log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+                    conn->timer.handler = expire_connection;
+                    conn->timer.data = conn;
+                    run_connection(conn, docroot);
+                    if (conn->state == CONN_CLOSED)
+                        free_connection(conn);
+                    else
+                        timer_add(&wheel, &conn->timer, now + timeout_ms);
+                }
+                continue;
+            }
+            run_connection(conn, docroot);
+            if (conn->state == CONN_CLOSED) {
+                timer_del(&wheel, &conn->timer);
+                free_connection(conn); // closeすればepollの監視対象からも外れる
+                continue;
+            }
+            // 動きがあったのでタイムアウトを延ばす
+            timer_add(&wheel, &conn->timer, now + timeout_ms);
+        }
+        // 一定時間動きのない接続を閉じる
+        timer_advance(&wheel, now);
+    }
+}
+
+static void expire_connection(struct TimerWheel *wheel, void *data)
+{
+    struct Connection *conn = data;
+
+    connection_timeout(conn);
+    close_connection(conn);
+    // io_uring版では完了待ちの操作がすべて戻ってから解放する
+    if (conn->inflight == 0) free_connection(conn);
+}
+
+// http_dateを作り直し、次の秒の変わり目にまた呼ばれるようにする
+static void tick_http_date(struct TimerWheel *wheel, void *data)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    update_http_date(ts.tv_sec);
+    timer_add(wheel, data, now_msec() + 1000 - ts.tv_nsec / 1000000);
+}
+
+static long now_msec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static long now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/****** Arena ************************************************************/
+
+// szバイトを切り出す。解放はarena_reset()でまとめて行う
+static void* arena_alloc(struct Arena *arena, size_t sz)
+{
+    struct ArenaChunk *chunk;
+    void *p;
+
+    sz = (sz + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (!arena->base) arena->base = xmalloc(ARENA_BLOCK_SIZE);
+    if (arena->used + sz <= ARENA_BLOCK_SIZE) {
+        p = arena->base + arena->used;
+        arena->used += sz;
+        return p;
+    }
+    // 長いパスなど収まらないものだけ個別に確保する
+    chunk = xmalloc(sizeof(struct ArenaChunk) + sz);
+    chunk->next = arena->big;
+    arena->big = chunk;
+    return chunk->data;
+}
+
+// 切り出した領域をすべて捨てる。ブロック自体は次のリクエストで使い回す
+static void arena_reset(struct Arena *arena)
+{
+    struct ArenaChunk *chunk, *next;
+
+    for (chunk = arena->big; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    arena->big = NULL;
+    arena->used = 0;
+}
+
+static void arena_free(struct Arena *arena)
+{
+    arena_reset(arena);
+    free(arena->base);
+    arena->base = NULL;
+}
+
+/****** Timer Wheel ******************************************************/
+
+static void timer_init(struct TimerWheel *wheel, long now)
+{
+    memset(wheel, 0, sizeof(struct TimerWheel));
+    wheel->now = now;
+}
+
+// timerをexpiresに発火するように登録する(登録済みなら付け替える)
+static void timer_add(struct TimerWheel *wheel, struct Timer *timer, long expires)
+{
+    if (timer->slot) timer_del(wheel, timer);
+    timer->expires = expires;
+    // 処理済みの時刻のスロットにはもう戻らないので、早くても次のティックにする
+    timer_link(wheel, timer, wheel->now + 1);
+}
+
+static void timer_del(struct TimerWheel *wheel, struct Timer *timer)
+{
+    if (!timer->slot) return;
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        *timer->slot = timer->next;
+    if (timer->next) timer->next->prev = timer->prev;
+    timer->slot = NULL;
+    timer->prev = timer->next = NULL;
+    wheel->count--;
+}
+
+// 発火までの時間に応じた段のスロットにtimerをつなぐ
+// earliestより前に発火するはずのタイマーはearliestのスロットに入れる
+static void timer_link(struct TimerWheel *wheel, struct Timer *timer, long earliest)
+{
+    long at = timer->expires < earliest ? earliest : timer->expires;
+    long delta = at - wheel->now;
+    struct Timer **slot;
+    int level;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+        if (delta < 1L << (TIMER_WHEEL_BITS * (level + 1))) break;
+    }
+    // いちばん上の段にも収まらなければ、届く範囲の端に置いておき、そこでもう一度入れ直す
+    if (delta >= 1L << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+        at = wheel->now + (1L << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    slot = &wheel->slots[level][(at >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot) (*slot)->prev = timer;
+    *slot = timer;
+    wheel->count++;
+}
+
+// 時刻をnowまで進め、その間に発火するタイマーのハンドラを呼ぶ
+static void timer_advance(struct TimerWheel *wheel, long now)
+{
+    struct Timer *timer, *list, **slot;
+    int level;
+
+    while (wheel->now < now) {
+        if (wheel->count == 0) { // 空なら1ティックずつ進める必要はない
+            wheel->now = now;
+            break;
+        }
+        wheel->now++;
+        // 上の段のスロットの境目に来たら、そのスロットのタイマーを下の段へ移す
+        for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if (wheel->now & ((1L << (TIMER_WHEEL_BITS * level)) - 1)) break;
+            slot = &wheel->slots[level][(wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+            list = *slot;
+            *slot = NULL;
+            while ((timer = list)) {
+                list = timer->next;
+                wheel->count--;
+                timer_link(wheel, timer, wheel->now);
+            }
+        }
+        slot = &wheel->slots[0][wheel->now & TIMER_WHEEL_MASK];
+        while ((timer = *slot)) {
+            timer_del(wheel, timer);
+            if (timer->expires > wheel->now) // 遠すぎて端に置いておいたもの
+                timer_link(wheel, timer, wheel->now + 1);
+            else
+                timer->handler(wheel, timer->data);
+        }
+    }
+}
+
+// 次にタイマーが発火するまでのミリ秒数, なければ-1
+// 各段で最初に見つかったスロットの中からいちばん早いものを探す
+// (上の段でも、下の段へ移す時刻ではなく発火する時刻まで眠れるようにする)
+static long timer_next(struct TimerWheel *wheel)
+{
+    struct Timer *timer, *slot;
+    long next = -1;
+    long base;
+    int level, i;
+
+    if (wheel->count == 0) return -1;
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        base = wheel->now >> (TIMER_WHEEL_BITS * level);
+        for (i = 1; i <= TIMER_WHEEL_SIZE; i++) {
+            if ((slot = wheel->slots[level][(base + i) & TIMER_WHEEL_MASK])) break;
+        }
+        if (!slot) continue;
+        for (timer = slot; timer; timer = timer->next) {
+            if (next < 0 || timer->expires - wheel->now < next) next = timer->expires - wheel->now;
+        }
+    }
+    return next < 0 ? 0 : next;
+}
+
+static void set_nonblocking(int fd)
+{
+    int flags;
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        log_exit("fcntl(2) failed: %s", strerror(errno));
+}
+
+// reuseportが非ゼロなら同じポートに複数のソケットをbindできるようにする
+// IPv6が使えればIPV6_V6ONLYを外した1つのソケットでIPv4も受ける
+static int listen_socket(char *port, int reuseport)
+{
+    struct addrinfo hints, *res, *ai;
+    int err, pass;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC; // IPv6とIPv4
+    hints.ai_socktype = SOCK_STREAM; // TCP
+    hints.ai_flags = AI_PASSIVE; // ソケットをサーバ用として使う
+
+    // サーバ側のときはプロセスが動作しているそのホストのアドレス構造体をgetaddrinfo()で得る
+    if ((err = getaddrinfo(NULL, port, &hints, &res)) != 0)
+        log_exit(gai_strerror(err));
+
+    // hintsに当てはまるアドレス構造体のリストresの要素に対してsocket, bind, listenして、成功した最初のアドレスを使う
+    // IPv6のアドレスを先に試す(デュアルスタックにできなければIPv4だけで受ける)
+    for (pass = 0; pass < 2; pass++) {
+        for (ai = res; ai; ai = ai->ai_next) {
+            int sock, on = 1, off = 0;
+
+            if ((ai->ai_family == AF_INET6) != (pass == 0)) continue;
+            sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol); // 通信のためのエンドポイントを作成
+            if (sock < 0) continue;
+            // 再起動したときにTIME_WAITの接続が残っていてもbindできるようにする
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+            if (ai->ai_family == AF_INET6
+                && setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof off) < 0) {
+                close(sock);
+                continue;
+            }
+            if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) < 0) {
+                close(sock);
+                continue;
+            }
+            if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0) { // ソケットに名前をつける
+                close(sock);
+                continue;
+            }
+            // backlogは、保留中の接続のキューの最大長
+            if (listen(sock, listen_backlog) < 0) { // ソケット上の接続を待つ
+                close(sock);
+                continue;
+            }
+            freeaddrinfo(res);
+            tune_listener(sock);
+            return sock;
+        }
+    }
+    log_exit("failed to listen socket");
+    return -1; /* NOT REACH */
+}
+
+// 接続待ちソケットにTCPのオプションを設定する。受け継いだソケットにも同じ設定をする
+// TCP_NODELAYはacceptしたソケットに引き継がれるので、接続ごとには設定しない
+static void tune_listener(int sock)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof addr;
+
+    if (getsockname(sock, (struct sockaddr *)&addr, &len) < 0
+        || (addr.ss_family != AF_INET && addr.ss_family != AF_INET6))
+        return; // UNIXドメインソケットなど
+    if (tcp_nodelay && setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &tcp_nodelay, sizeof tcp_nodelay) < 0)
+        syslog(LOG_WARNING, "TCP_NODELAY failed: %s", strerror(errno));
+    // リクエストが届くまでacceptさせない(つないだだけの接続でイベントループを起こさない)
+    if (defer_accept && setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof defer_accept) < 0)
+        syslog(LOG_WARNING, "TCP_DEFER_ACCEPT failed: %s", strerror(errno));
+    // 再訪したクライアントはSYNでリクエストを送れるので、1往復ぶん早く応答できる
+    if (fastopen_qlen && setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &fastopen_qlen, sizeof fastopen_qlen) < 0)
+        syslog(LOG_WARNING, "TCP_FASTOPEN failed: %s", strerror(errno));
+}
+
+// カーネルの上限(net.core.somaxconn)まで接続を溜められるようにする
+// 5のような小さい値では、接続が集中するとキューから溢れたSYNが捨てられ、再送まで1秒待たされる
+static int default_backlog(void)
+{
+    char buf[32];
+    int fd, n, backlog = SOMAXCONN;
+
+    fd = open(SOMAXCONN_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        n = read(fd, buf, sizeof buf - 1);
+        if (n > 0) {
+            buf[n] = '\0';
+            if (atoi(buf) > 0) backlog = atoi(buf);
+        }
+        close(fd);
+    }
+    return backlog;
+}
+
+// 親プロセスから受け継いだ接続待ちソケットを返す。なければ-1
+// fdが0以上なら--listen-fdで指定されたもの(inetdのwaitモードなら0)を使い、
+// そうでなければsystemdのLISTEN_FDS/LISTEN_PIDを見る。
+// 接続待ちソケットを閉じずにサーバだけを入れ替えられるので、再起動中の接続もキューに残る
+static int inherited_socket(int fd)
+{
+    char *pid_env = getenv("LISTEN_PID");
+    char *fds_env = getenv("LISTEN_FDS");
+
+    if (fd < 0 && pid_env && fds_env && atol(pid_env) == (long)getpid()) {
+        if (atoi(fds_env) < 1) log_exit("LISTEN_FDS has no sockets");
+        if (atoi(fds_env) > 1) syslog(LOG_WARNING, "LISTEN_FDS=%s: using only the first socket", fds_env);
+        fd = SD_LISTEN_FDS_START;
+        // socketdは準備ができたと知らせるまで古いサーバを止めずに待つ
+        if (getenv(READY_ENV)) {
+            upgrade_fd = atoi(getenv(READY_ENV));
+            if (fcntl(upgrade_fd, F_SETFD, FD_CLOEXEC) < 0)
+                log_exit("bad %s: %s", READY_ENV, strerror(errno));
+        }
+    }
+    // CGIなどの子プロセスに渡さないよう、環境変数は消しておく
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    unsetenv(READY_ENV);
+    if (fd < 0) return -1;
+    check_listener(fd);
+    return fd;
+}
+
+// 受け継いだfdが接続待ちのTCPソケットであることを確かめ、listen_socket()と同じ状態にする
+static void check_listener(int fd)
+{
+    int type, listening, flags;
+    socklen_t len;
+
+    len = sizeof type;
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0)
+        log_exit("fd %d is not a socket: %s", fd, strerror(errno));
+    len = sizeof listening;
+    if (type != SOCK_STREAM
+        || getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 || !listening)
+        log_exit("fd %d is not a listening stream socket", fd);
+    // 前のサーバがO_NONBLOCKにしていることがある
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0
+        || (flags = fcntl(fd, F_GETFL)) < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0)
+        log_exit("fcntl(2) failed: %s", strerror(errno));
+    // listen済みのソケットにもう一度listenするとbacklogだけが変わる
+    if (listen(fd, listen_backlog) < 0)
+        syslog(LOG_WARNING, "listen(2) on fd %d failed: %s", fd, strerror(errno));
+    tune_listener(fd);
+}
+
+// シグナルで頼まれていれば、新しいサーバへの入れ替えや終了の準備をする
+// 新しい接続の受け付けをやめるべきなら非ゼロを返す(残りの接続を片付けてから終了する)
+static int stop_accepting(int *fds, int n)
+{
+    if (upgrade_requested) {
+        upgrade_requested = 0;
+        if (upgrade_server(fds, n)) drain_requested = 1;
+    }
+    return drain_requested;
+}
+
+// SIGUSR2: 同じ引数で新しいバイナリを起動し、接続待ちソケットをSCM_RIGHTSで渡す
+// ソケットは閉じないので、入れ替わる間に届いた接続もキューに残る
+// 新しいサーバがacceptを始めたら非ゼロを返す。失敗したらこのまま動き続ける
+static int upgrade_server(int *fds, int n)
+{
+    char cbuf[CMSG_SPACE(sizeof(int) * MAX_WORKERS)];
+    char env[sizeof UPGRADE_ENV + 16], c = 0;
+    char **envp;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct pollfd pfd;
+    int sv[2], r, i, n_env;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        syslog(LOG_WARNING, "upgrade: socketpair(2) failed: %s", strerror(errno));
+        return 0;
+    }
+    // ログやスレッドプールのスレッドがmallocのロックを持ったままforkすることがあるので、
+    // 子プロセスではmallocするsetenv()などを呼ばない。環境変数はここで組み立てておく
+    snprintf(env, sizeof env, UPGRADE_ENV "=%d", sv[1]);
+    for (n_env = 0; environ[n_env]; n_env++)
+        ;
+    envp = xmalloc(sizeof(char*) * (n_env + 2));
+    for (i = n_env = 0; environ[i]; i++) {
+        if (strncmp(environ[i], UPGRADE_ENV "=", sizeof UPGRADE_ENV) != 0)
+            envp[n_env++] = environ[i];
+    }
+    envp[n_env++] = env;
+    envp[n_env] = NULL;
+    pid = fork();
+    if (pid < 0) {
+        syslog(LOG_WARNING, "upgrade: fork(2) failed: %s", strerror(errno));
+        free(envp);
+        close(sv[0]);
+        close(sv[1]);
+        return 0;
+    }
+    if (pid == 0) {
+        // --chrootしているとバイナリが見えずexecに失敗する。そのときは前のサーバが動き続ける
+        // execvpe()はPATHを探すバッファもスタックに取るので、ここで呼んでよい
+        close(sv[0]);
+        if (fcntl(sv[1], F_SETFD, 0) < 0) _exit(127);
+        execvpe(exec_path, exec_argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(sv[1]);
+    upgrade_pid = pid;
+
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+    if (sendmsg(sv[0], &msg, MSG_NOSIGNAL) < 0) {
+        syslog(LOG_WARNING, "upgrade: sendmsg(2) failed: %s", strerror(errno));
+        close(sv[0]);
+        return 0;
+    }
+
+    // 準備ができたら1バイト返してくる。その前に終了すればEOFになる
+    pfd.fd = sv[0];
+    pfd.events = POLLIN;
+    do {
+        r = poll(&pfd, 1, UPGRADE_TIMEOUT_MSEC);
+    } while (r < 0 && errno == EINTR);
+    r = r > 0 && read(sv[0], &c, 1) == 1;
+    close(sv[0]); // タイムアウトした新しいサーバは、知らせようとして失敗し終了する
+    waitpid(pid, NULL, WNOHANG);
+    if (!r) {
+        syslog(LOG_WARNING, "upgrade: new server (pid %d) did not start", (int)pid);
+        return 0;
+    }
+    syslog(LOG_INFO, "upgrade: handed %d listening socket(s) to pid %d", n, (int)pid);
+    return 1;
+}
+
+// SIGUSR2で起動されたなら、前のサーバから接続待ちソケットを受け取って数を返す。そうでなければ0
+static int receive_listeners(int **fds)
+{
+    char *env = getenv(UPGRADE_ENV);
+    char cbuf[CMSG_SPACE(sizeof(int) * MAX_WORKERS)];
+    char c;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int i, n;
+
+    if (!env) return 0;
+    upgrade_fd = atoi(env);
+    unsetenv(UPGRADE_ENV);
+    if (fcntl(upgrade_fd, F_SETFD, FD_CLOEXEC) < 0)
+        log_exit("upgrade: bad %s: %s", UPGRADE_ENV, strerror(errno));
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof cbuf;
+    if (recvmsg(upgrade_fd, &msg, MSG_CMSG_CLOEXEC) <= 0)
+        log_exit("upgrade: recvmsg(2) failed: %s", strerror(errno));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        log_exit("upgrade: no sockets received");
+    n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    *fds = xmalloc(sizeof(int) * n);
+    memcpy(*fds, CMSG_DATA(cmsg), sizeof(int) * n);
+    for (i = 0; i < n; i++)
+        check_listener((*fds)[i]);
+    return n;
+}
+
+// 前のサーバ(またはsocketd)に、acceptを始めるので古いサーバは終了してよいと知らせる
+static void notify_upgraded(void)
+{
+    char c = 1;
+
+    if (upgrade_fd < 0) return;
+    if (send(upgrade_fd, &c, 1, MSG_NOSIGNAL) != 1)
+        log_exit("upgrade: the process waiting for us gave up: %s", strerror(errno));
+    close(upgrade_fd);
+    upgrade_fd = -1;
+}
+
+static void request_upgrade(int sig)
+{
+    upgrade_requested = 1;
+}
+
+static void request_drain(int sig)
+{
+    drain_requested = 1;
+}
+
+static void become_daemon(void)
+{
+    int n;
+
+    // ルートディレクトリに移動
+    if (chdir("/") < 0)
+        log_exit("chdir(2) failed: %s", strerror(errno));
+    
+    // 標準入出力を/dev/nullにつなぐ
+    // freopen: path で指定された名前のファイルを開き、ストリームと結びつける
+    freopen("/dev/null", "r", stdin);
+    freopen("/dev/null", "w", stdout);
+    freopen("/dev/null", "w", stderr);
+
+    n = fork();
+    if (n < 0) log_exit("fork(2) failed: %s", strerror(errno));
+    if (n != 0) _exit(0); /* 親プロセスは終了する */
+    if (setsid() < 0) log_exit("setsid(2) failed: %s", strerror(errno));
+}
+
+// rootに与えられたディレクトリをルートディレクトリとして設定
+static void setup_environment(char *root, char *user, char *group)
+{
+    struct passwd *pw;
+    struct group *gr;
+
+    if (!user || !group) {
+        fprintf(stderr, "use both of --user and --group\n");
+        exit(1);
+    }
+    gr = getgrnam(group);
+    if (!gr) {
+        fprintf(stderr, "no such group: %s\n", group);
+        exit(1);
+    }
+    // 自プロセスの実グループIDと実効グループIDをgr->gr_gidに変更
+    if (setgid(gr->gr_gid) < 0) {
+        perror("setgid(2)");
+        exit(1);
+    }
+    // userが所属しているグループを自プロセスに設定, gr->gr_gidに設定
+    if (initgroups(user, gr->gr_gid) < 0) {
+        perror("initgroups(2)");
+        exit(1);
+    }
+    pw = getpwnam(user);
+    if (!pw) {
+        fprintf(stderr, "no such user: %s\n", user);
+        exit(1);
+    }
+    
+    // 呼び出し元プロセスのルートディレクトリを root で指定されたディレクトリに変更
+    chroot(root);
+
+    // 自プロセスの実グループIDと実効グループIDをpw->pw_uidに変更
+    if (setuid(pw->pw_uid) < 0) {
+        perror("setuid(2)");
+        exit(1);
+    }
+}
+
+
+// 1つの接続を最後まで処理する(fork版の子プロセス用)
+// ソケットがブロッキングなので、run_connectionは接続が閉じるか
+// 読み書きがタイムアウト(EAGAIN)するまで戻らない
+static void service(int sock, char *docroot)
+{
+    struct Connection *conn;
+
+    // 子プロセスは接続ごとに作り直されるので、キャッシュが効くのは同じ接続の中だけ
+    init_file_cache(0);
+    conn = new_connection(sock);
+    serve_connection(conn, docroot);
+    free_connection(conn);
+}
+
+// ブロッキングのソケットで、接続が閉じるまでリクエストを処理する
+static void serve_connection(struct Connection *conn, char *docroot)
+{
+    struct timeval tv;
+
+    tv.tv_sec = keepalive_timeout;
+    tv.tv_usec = 0;
+    setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+    run_connection(conn, docroot);
+    // 閉じずに戻ってきたのは読み書きがSO_RCVTIMEO/SO_SNDTIMEOで時間切れになったとき
+    connection_timeout(conn);
+}
+
+// 閉じたConnectionはレスポンスのバッファやアリーナごと取っておき、次の接続に使い回す
+// new_connection()とfree_connection()はスレッドプールでは使わないので、リストにロックは要らない
+static struct Connection* new_connection(int sock)
+{
+    struct Connection *conn;
+
+    if (free_connections) {
+        conn = free_connections;
+        free_connections = conn->next_free;
+        nfree_connections--;
+    } else {
+        conn = alloc_connection();
+    }
+    init_connection(conn, sock);
+    return conn;
+}
+
+static struct Connection* alloc_connection(void)
+{
+    struct Connection *conn;
+
+    conn = xmalloc(sizeof(struct Connection));
+    conn->res.head.ptr = NULL;
+    conn->res.head.capa = 0;
+    conn->arena.base = NULL;
+    conn->arena.used = 0;
+    conn->arena.big = NULL;
+    return conn;
+}
+
+// 接続ごとの状態を初期化する。レスポンスのバッファ(res.head)は使い回すので触らない
+static void init_connection(struct Connection *conn, int sock)
+{
+    conn->fd = sock;
+    conn->state = CONN_READING;
+    conn->rlen = 0;
+    reset_parser(&conn->parser);
+    conn->req = NULL;
+    conn->consumed = 0;
+    conn->body_buf = NULL;
+    conn->nrequests = 0;
+    conn->parse_ns = 0;
+    conn->send_start = 0;
+    conn->peer[0] = '\0';
+    conn->keep_alive = 0;
+    conn->res.head.len = 0;
+    conn->res.sent = 0;
+    conn->res.body_fd = -1;
+    conn->res.body_mem = NULL;
+    conn->res.body_file = NULL;
+    conn->res.body_compressed = NULL;
+    conn->res.body_offset = 0;
+    conn->res.body_length = 0;
+    conn->pipefd[0] = conn->pipefd[1] = -1;
+    conn->piped = 0;
+    conn->timer.slot = NULL;
+    conn->timer.prev = conn->timer.next = NULL;
+    conn->inflight = 0;
+    conn->recving = 0;
+    conn->rx_eof = 0;
+    conn->rx_errno = 0;
+    conn->rx_head = conn->rx_tail = -1;
+    conn->sending = 0;
+    conn->corked = 0;
+    stats_add(&stats->connections, 1);
+}
+
+static void free_connection(struct Connection *conn)
+{
+    finish_connection(conn);
+    // パイプラインで大きくなったバッファは取っておかない
+    if (nfree_connections < CONN_FREELIST_MAX && conn->res.head.capa <= MAX_PIPELINE_BUF_SIZE) {
+        conn->next_free = free_connections;
+        free_connections = conn;
+        nfree_connections++;
+        return;
+    }
+    free(conn->res.head.ptr);
+    arena_free(&conn->arena);
+    free(conn);
+}
+
+// 接続を閉じて、Connection自体は次の接続に使えるようにしておく
+static void finish_connection(struct Connection *conn)
+{
+    close_connection(conn);
+    // io_uring版では送信中のheadやファイルを完了まで残すので、ここで手放す
+    reset_response(&conn->res);
+    if (!counted_by_parent) stats_add(&stats->active_connections, -1);
+}
+
+static void close_connection(struct Connection *conn)
+{
+    if (conn->state == CONN_CLOSED) return;
+    conn->req = NULL;
+    free(conn->body_buf);
+    conn->body_buf = NULL;
+    if (uring) {
+        // 動いているrecvや送信はfdを閉じても終わらないので、shutdownで打ち切らせる
+        // まだ渡していないSQEはfd番号しか持っていないので、閉じる前に投入しておく
+        shutdown(conn->fd, SHUT_RDWR);
+        uring_enter(0, -1);
+        uring_release_bufs(conn);
+    } else {
+        reset_response(&conn->res);
+    }
+    if (conn->pipefd[0] >= 0) {
+        close(conn->pipefd[0]);
+        close(conn->pipefd[1]);
+        conn->pipefd[0] = conn->pipefd[1] = -1;
+    }
+    close(conn->fd);
+    conn->state = CONN_CLOSED;
+}
+
+// 読み書きできなくなる(EAGAIN)か接続が閉じるまで状態を進める
+static void run_connection(struct Connection *conn, char *docroot)
+{
+    for (;;) {
+        switch (conn->state) {
+        case CONN_READING:
+            if (!connection_read(conn, docroot)) return;
+            break;
+        case CONN_WRITING:
+            if (!connection_write(conn)) return;
+            break;
+        case CONN_CLOSED:
+            return;
+        }
+    }
+}
+
+// ソケットから読み込んでリクエストを組み立てる
+// これ以上読み込めるデータがない(EAGAIN)ときは0を返す
+static int connection_read(struct Connection *conn, char *docroot)
+{
+    ssize_t n;
+
+    if (conn->req) return connection_read_body(conn, docroot);
+
+    // パイプライン化されたリクエストは受信済みのデータから先に処理する
+    if (connection_parse(conn, docroot)) return 1;
+    if (conn->res.head.len > 0) {
+        // 次のリクエストを待つ前に、溜めたレスポンスをまとめて送る
+        conn->state = CONN_WRITING;
+        return 1;
+    }
+
+    if (conn->rlen == REQUEST_BUF_SIZE) { // ヘッダが大きすぎる
+        connection_error(conn, parse_error_status(conn->parser.state == PARSER_REQUEST_LINE
+                                                  ? PARSE_URI_TOO_LONG : PARSE_HEADER_TOO_LARGE));
+        return 1;
+    }
+    n = connection_recv(conn, conn->rbuf + conn->rlen, REQUEST_BUF_SIZE - conn->rlen);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        if (errno != EINTR) close_connection(conn);
+        return 1;
+    }
+    if (n == 0) { // 相手が接続を閉じた
+        close_connection(conn);
+        return 1;
+    }
+    conn->rlen += n;
+    return 1;
+}
+
+// rbufに揃っているリクエストを1つ取り出して処理する
+// まだリクエストが揃っていなければ0を返す
+static int connection_parse(struct Connection *conn, char *docroot)
+{
+    struct HTTPRequest *req = &conn->request;
+    size_t hlen;
+    long t0 = now_nsec(), used;
+    int r;
+
+    r = read_request(&conn->parser, req, conn->rbuf, conn->rlen);
+    conn->parse_ns += now_nsec() - t0;
+    switch (r) {
+    case PARSE_AGAIN: // まだヘッダの終わりまで届いていない
+        return 0;
+    case PARSE_DONE:
+        break;
+    default: // 不正なリクエストはエラーを返してその接続だけ閉じる
+        connection_error(conn, parse_error_status(r));
+        return 1;
+    }
+    stats_record(&stats->parse, conn->parse_ns);
+    conn->parse_ns = 0;
+    // ヘッダの後ろに届いているぶんのボディはrbufの上でそのまま渡す
+    // 残りはボディが終わるまでbody_bufで受け取る(rbufのヘッダはレスポンスを作るまで残す)
+    hlen = conn->parser.line;
+    conn->req = req;
+    start_body(conn, req);
+    used = feed_body(conn, conn->rbuf + hlen, conn->rlen - hlen);
+    if (used < 0) {
+        connection_error(conn, parse_error_status(-used));
+        return 1;
+    }
+    conn->consumed = hlen + used;
+    if (body_done(conn))
+        connection_respond(conn, docroot);
+    return 1;
+}
+
+// ボディの続きをbody_bufに受け取ってハンドラに渡す
+// 接続ごとに持つのはbody_bufだけなので、ボディが大きくてもメモリは増えない
+static int connection_read_body(struct Connection *conn, char *docroot)
+{
+    size_t want = body_buffer_size;
+    ssize_t n;
+    long used;
+
+    if (conn->res.head.len > 0) { // 先行するリクエストへのレスポンスを先に送る
+        conn->state = CONN_WRITING;
+        return 1;
+    }
+    if (!conn->body_buf) conn->body_buf = xmalloc(body_buffer_size);
+    // Content-Lengthなら次のリクエストまでは読まない
+    // chunkedでは読み過ぎることがあるので、余りが空いたrbufに収まるぶんだけ読む
+    if (!conn->req->chunked && (size_t)conn->body_left < want) want = conn->body_left;
+    if (conn->req->chunked && want > REQUEST_BUF_SIZE) want = REQUEST_BUF_SIZE;
+    n = connection_recv(conn, conn->body_buf, want);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        if (errno != EINTR) close_connection(conn);
+        return 1;
+    }
+    if (n == 0) {
+        close_connection(conn);
+        return 1;
+    }
+    used = feed_body(conn, conn->body_buf, n);
+    if (used < 0) {
+        connection_error(conn, parse_error_status(-used));
+        return 1;
+    }
+    if (!body_done(conn)) return 1;
+    connection_respond(conn, docroot);
+    // ボディの後ろまで読んでいたら、次のリクエストとしてrbufに移す
+    memcpy(conn->rbuf + conn->rlen, conn->body_buf + used, n - used);
+    conn->rlen += n - used;
+    free(conn->body_buf);
+    conn->body_buf = NULL;
+    return 1;
+}
+
+static void start_body(struct Connection *conn, struct HTTPRequest *req)
+{
+    select_body_handler(req);
+    conn->body_left = req->chunked ? 0 : req->length;
+    conn->body_total = 0;
+    conn->chunk_state = CHUNK_SIZE;
+    conn->chunk_digits = 0;
+    if (!req->chunked && req->length == 0) req->body_handler(req, NULL, 0);
+}
+
+// p[0..len)をボディとしてデコードしてハンドラに渡し、使ったバイト数を返す
+// ボディが終われば残りは使わない。不正なボディなら-PARSE_*を返す
+static long feed_body(struct Connection *conn, char *p, size_t len)
+{
+    struct HTTPRequest *req = conn->req;
+
+    if (req->chunked) return feed_chunked(conn, p, len);
+    if ((size_t)conn->body_left < len) len = conn->body_left;
+    if (len == 0) return 0;
+    conn->body_left -= len;
+    conn->body_total += len;
+    req->body_handler(req, p, len);
+    if (conn->body_left == 0) req->body_handler(req, NULL, 0);
+    return len;
+}
+
+// Transfer-Encoding: chunkedのデコーダ
+// 1バイトずつ状態を進めるので、チャンクの区切りがどこで分かれて届いてもよい
+// チャンク拡張とトレイラーは読み捨てる
+static long feed_chunked(struct Connection *conn, char *p, size_t len)
+{
+    struct HTTPRequest *req = conn->req;
+    size_t i = 0, n;
+    int c, d;
+
+    while (i < len && conn->chunk_state != CHUNK_DONE) {
+        c = (unsigned char)p[i];
+        switch (conn->chunk_state) {
+        case CHUNK_SIZE:
+            d = hex_digit(c);
+            if (d >= 0) {
+                if (conn->body_left > (MAX_REQUEST_BODY_LENGTH >> 4)) return -PARSE_BODY_TOO_LARGE;
+                conn->body_left = conn->body_left * 16 + d;
+                conn->chunk_digits++;
+                i++;
+                break;
+            }
+            if (conn->chunk_digits == 0) return -PARSE_BAD_REQUEST;
+            if (c == ';' || c == ' ' || c == '\t') conn->chunk_state = CHUNK_EXT;
+            else if (c != '\r' && c != '\n') return -PARSE_BAD_REQUEST;
+            if (c != '\n') {
+                i++;
+                break;
+            }
+            /* fall through */
+        case CHUNK_EXT:
+            i++;
+            if (c != '\n') break;
+            if (conn->body_total + conn->body_left > MAX_REQUEST_BODY_LENGTH)
+                return -PARSE_BODY_TOO_LARGE;
+            conn->chunk_state = conn->body_left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+            break;
+        case CHUNK_DATA:
+            n = len - i;
+            if ((size_t)conn->body_left < n) n = conn->body_left;
+            req->body_handler(req, p + i, n);
+            conn->body_left -= n;
+            conn->body_total += n;
+            i += n;
+            if (conn->body_left == 0) conn->chunk_state = CHUNK_DATA_END;
+            break;
+        case CHUNK_DATA_END:
+            i++;
+            if (c == '\r') break;
+            if (c != '\n') return -PARSE_BAD_REQUEST;
+            conn->chunk_state = CHUNK_SIZE;
+            conn->chunk_digits = 0;
+            break;
+        case CHUNK_TRAILER:
+            i++;
+            if (c == '\r') break;
+            if (c == '\n') {
+                conn->chunk_state = CHUNK_DONE;
+                req->body_handler(req, NULL, 0);
+            } else {
+                conn->chunk_state = CHUNK_TRAILER_LINE;
+            }
+            break;
+        case CHUNK_TRAILER_LINE:
+            i++;
+            if (c == '\n') conn->chunk_state = CHUNK_TRAILER;
+            break;
+        case CHUNK_DONE:
+            break;
+        }
+    }
+    return i;
+}
+
+static int body_done(struct Connection *conn)
+{
+    return conn->req->chunked ? conn->chunk_state == CHUNK_DONE : conn->body_left == 0;
+}
+
+// io_uring版ではrecvの完了で届いているデータを、それ以外はソケットから読む
+static ssize_t connection_recv(struct Connection *conn, char *buf, size_t len)
+{
+    if (uring) return uring_recv(conn, buf, len);
+    return read(conn->fd, buf, len);
+}
+
+// レスポンスをconn->resの後ろに追記する
+// ファイルのボディを送る場合や溜めたレスポンスが多くなった場合は送信に移る
+static void connection_respond(struct Connection *conn, char *docroot)
+{
+    struct HTTPRequest *req = conn->req;
+    size_t head_len = conn->res.head.len;
+
+    if (!conn->send_start) conn->send_start = now_nsec();
+    conn->nrequests++;
+    req->keep_alive = wants_keep_alive(req) && conn->nrequests < max_keepalive_requests && !draining;
+    req->requests_left = max_keepalive_requests - conn->nrequests;
+    conn->keep_alive = req->keep_alive;
+    req->arena = &conn->arena;
+    respond_to(req, &conn->res, docroot);
+    arena_reset(&conn->arena); // レスポンスが持ち続けるものはアリーナに置かない
+    stats_count_response(conn->res.status, conn->res.head.len - head_len + conn->res.body_length);
+    access_log(conn, req, conn->res.status, conn->res.head.len - head_len + conn->res.body_length);
+    conn->req = NULL;
+
+    // 処理したぶんを詰めて、後続のリクエストをrbufの先頭に寄せる
+    memmove(conn->rbuf, conn->rbuf + conn->consumed, conn->rlen - conn->consumed);
+    conn->rlen -= conn->consumed;
+    conn->consumed = 0;
+    reset_parser(&conn->parser);
+    if (!conn->keep_alive || conn->res.body_fd >= 0 || conn->res.body_mem
+        || conn->res.head.len >= MAX_PIPELINE_BUF_SIZE)
+        conn->state = CONN_WRITING;
+}
+
+// 不正なリクエストにエラーのレスポンスを返して、送り終えたら接続を閉じる
+// リクエストは途中までしか読めていないので、reqの中身には頼らない
+static void connection_error(struct Connection *conn, char *status)
+{
+    struct Response *out = &conn->res;
+    size_t head_len = out->head.len;
+    char body[LINE_BUF_SIZE];
+    int len;
+
+    len = snprintf(body, sizeof body,
+                   "<html>\r\n"
+                   "<header><title>%s</title><header>\r\n"
+                   "<body><p>%s</p></body>\r\n"
+                   "</html>\r\n", status, status);
+    out->status = atoi(status);
+    out_puts(out, STATUS_LINE_PREFIX);
+    out_puts(out, status);
+    out_puts(out, "\r\nDate: ");
+    out_write(out, current_http_date(), HTTP_DATE_LEN);
+    out_puts(out, "\r\n" SERVER_HEADER_FIELD "Connection: close\r\n");
+    out_printf(out, "Content-Length: %d\r\n", len);
+    out_puts(out, "Content-Type: text/html\r\n\r\n");
+    out_write(out, body, len);
+    stats_count_response(out->status, out->head.len - head_len);
+    access_log(conn, conn->req, out->status, out->head.len - head_len);
+    // 残りの受信データはもう読まない
+    conn->rlen = conn->consumed = 0;
+    conn->keep_alive = 0;
+    conn->state = CONN_WRITING;
+}
+
+// リクエストの途中で相手が黙ったまま時間切れになった接続に408を返す
+// 閉じる直前なので、送れるぶんだけ送って待たない
+static void connection_timeout(struct Connection *conn)
+{
+    if (conn->state != CONN_READING || conn->res.head.len > 0) return;
+    if (conn->rlen == 0 && !conn->req) return; // リクエストの合間なら黙って閉じる
+    connection_error(conn, "408 Request Timeout");
+    send(conn->fd, conn->res.head.ptr, conn->res.head.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    conn->res.head.len = 0;
+}
+
+// クライアントが接続の維持を望んでいれば非ゼロを返す
+// HTTP/1.1は既定で維持、HTTP/1.0はConnection: keep-aliveのときだけ維持
+static int wants_keep_alive(struct HTTPRequest *req)
+{
+    char *val;
+
+    val = lookup_header_field_value(req, "Connection");
+    if (req->protocol_minor_version >= 1)
+        return !(val && header_has_token(val, "close"));
+    return val && header_has_token(val, "keep-alive");
+}
+
+// カンマ区切りのヘッダの値にtokenが(大文字小文字を区別せずに)含まれていれば非ゼロを返す
+static int header_has_token(char *value, char *token)
+{
+    size_t len = strlen(token);
+    char *p = value;
+
+    while (*p) {
+        p += strspn(p, " \t,");
+        if (strncasecmp(p, token, len) == 0 && strchr(" \t,", p[len]))
+            return 1;
+        p += strcspn(p, ",");
+    }
+    return 0;
+}
+
+// レスポンスを送信する
+// ソケットがいっぱい(EAGAIN)のときは0を返す
+static int connection_write(struct Connection *conn)
+{
+    struct Response *res = &conn->res;
+    ssize_t n;
+
+    // --tcp-cork: 送り終えるまでフルサイズに満たないセグメントを出さない
+    if (tcp_cork && !conn->corked) set_cork(conn, 1);
+    // io_uring版は送信を投入して完了を待つ(完了したらrun_connectionし直す)
+    if (uring && (res->sent < res->head.len || res->body_length > 0 || conn->piped > 0))
+        return uring_send(conn);
+    if (res->body_mem && (res->sent < res->head.len || res->body_length > 0))
+        return send_mem_body(conn);
+    if (res->sent < res->head.len) {
+        // ボディが続くならMSG_MOREでヘッダだけのパケットを出さずにボディとまとめさせる
+        n = send(conn->fd, res->head.ptr + res->sent, res->head.len - res->sent,
+                 res->body_length > 0 ? MSG_MORE : 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (errno != EINTR) close_connection(conn);
+            return 1;
+        }
+        res->sent += n;
+        return 1;
+    }
+    if (res->body_fd >= 0 && (res->body_length > 0 || conn->piped > 0))
+        return send_body(conn);
+    // 送り終えたら、接続を維持する場合は次のリクエストを待つ
+    if (conn->corked) set_cork(conn, 0); // 残りをすぐに送り出す
+    if (conn->send_start) {
+        stats_record(&stats->send, now_nsec() - conn->send_start);
+        conn->send_start = 0;
+    }
+    if (!conn->keep_alive) {
+        close_connection(conn);
+        return 1;
+    }
+    reset_response(res);
+    conn->state = CONN_READING;
+    return 1;
+}
+
+// ファイルのボディをユーザ空間にコピーせずにソケットへ送る
+// sendfileを受け付けないファイルはパイプを経由してspliceする
+static int send_body(struct Connection *conn)
+{
+    struct Response *res = &conn->res;
+    ssize_t n;
+
+    if (conn->pipefd[0] >= 0) return splice_body(conn);
+    n = sendfile(conn->fd, res->body_fd, &res->body_offset, res->body_length);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        if (errno == EINTR) return 1;
+        if (errno == EINVAL || errno == ENOSYS) {
+            if (pipe2(conn->pipefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+                conn->pipefd[0] = conn->pipefd[1] = -1;
+                close_connection(conn);
+                return 1;
+            }
+            return splice_body(conn);
+        }
+        close_connection(conn);
+        return 1;
+    }
+    if (n == 0) { // ファイルが途中で縮んだ
+        close_connection(conn);
+        return 1;
+    }
+    res->body_length -= n;
+    return 1;
+}
+
+static int splice_body(struct Connection *conn)
+{
+    struct Response *res = &conn->res;
+    ssize_t n;
+
+    if (conn->piped == 0) {
+        // ファイル -> パイプ
+        n = splice(res->body_fd, &res->body_offset, conn->pipefd[1], NULL,
+                   res->body_length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) return 1;
+            close_connection(conn);
+            return 1;
+        }
+        conn->piped = n;
+        res->body_length -= n;
+    }
+    // パイプ -> ソケット
+    n = splice(conn->pipefd[0], NULL, conn->fd, NULL, conn->piped,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (res->body_length > 0 ? SPLICE_F_MORE : 0));
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        if (errno != EINTR) close_connection(conn);
+        return 1;
+    }
+    conn->piped -= n;
+    return 1;
+}
+
+static void set_cork(struct Connection *conn, int on)
+{
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof on);
+    conn->corked = on;
+}
+
+// ヘッダとメモリ上のボディを1回のwritevで送る
+static int send_mem_body(struct Connection *conn)
+{
+    struct Response *res = &conn->res;
+    struct iovec iov[2];
+    size_t head_rest = res->head.len - res->sent;
+    ssize_t n;
+
+    iov[0].iov_base = res->head.ptr + res->sent;
+    iov[0].iov_len = head_rest;
+    iov[1].iov_base = res->body_mem + res->body_offset;
+    iov[1].iov_len = res->body_length;
+    n = writev(conn->fd, iov, 2);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        if (errno != EINTR) close_connection(conn);
+        return 1;
+    }
+    if ((size_t)n <= head_rest) {
+        res->sent += n;
+        return 1;
+    }
+    res->sent = res->head.len;
+    res->body_offset += n - head_rest;
+    res->body_length -= n - head_rest;
+    return 1;
+}
+
+static void reset_parser(struct HTTPParser *parser)
+{
+    parser->state = PARSER_REQUEST_LINE;
+    parser->line = 0;
+    parser->scan = 0;
+    parser->colon = 0;
+}
+
+// buf[0..len)に届いているぶんだけリクエストライン+ヘッダをパースしてreqに記録する
+// 空行まで揃えばPARSE_DONEを返し、parser->lineがボディの先頭を指す
+static int read_request(struct HTTPParser *parser, struct HTTPRequest *req, char *buf, size_t len)
+{
+    char *end = buf + len;
+    char *hit;
+    int r;
+
+    if (parser->scan == 0) {
+        req->buf = buf;
+        req->nheader = 0;
+        req->length = 0;
+        req->chunked = 0;
+        req->body_handler = NULL;
+        req->keep_alive = 0;
+        req->requests_left = 0;
+    }
+    for (;;) {
+        size_t start = parser->line;
+        size_t colon = parser->colon;
+        size_t eol;
+
+        // ヘッダ行は改行と':'を1回の走査で探す
+        if (parser->state == PARSER_HEADER && !colon)
+            hit = scanner->find_char2(buf + parser->scan, end, '\n', ':');
+        else
+            hit = scanner->find_char2(buf + parser->scan, end, '\n', '\n');
+        if (!hit) break;
+        if (*hit == ':') {
+            parser->colon = parser->scan = hit - buf;
+            parser->scan++;
+            continue;
+        }
+        eol = hit - buf;
+        parser->line = parser->scan = eol + 1;
+        parser->colon = 0;
+        if (eol > start && buf[eol - 1] == '\r') eol--;
+        buf[eol] = '\0'; // 行末を終端にしてスライスを文字列としても使えるようにする
+
+        if (parser->state == PARSER_REQUEST_LINE) {
+            if (eol == start) continue; // リクエストラインの前の空行は読み飛ばす
+            // リクエストラインのパース reqに書き込む
+            if ((r = read_request_line(req, start, eol)) != PARSE_DONE) return r;
+            parser->state = PARSER_HEADER;
+            continue;
+        }
+        if (eol == start) { // 空行でヘッダが終わる
+            if ((req->chunked = read_transfer_encoding(req)) < 0) return PARSE_BAD_REQUEST;
+            req->length = content_length(req);
+            if (req->length < 0) return PARSE_BAD_REQUEST;
+            // 両方あるとボディの終わりの解釈がずれる(リクエストスマグリング)ので受け付けない
+            if (req->chunked && lookup_header_field_value(req, "Content-Length"))
+                return PARSE_BAD_REQUEST;
+            if (req->length > MAX_REQUEST_BODY_LENGTH) return PARSE_BODY_TOO_LARGE;
+            return PARSE_DONE;
+        }
+        if (!colon) return PARSE_BAD_REQUEST; // name:value の : がない
+        if ((r = read_header_field(req, start, colon, eol)) != PARSE_DONE) return r;
+    }
+    parser->scan = len; // 次は新しく届いたところから改行を探す
+    return PARSE_AGAIN;
+}
+
+// buf[start..end)のリクエストラインを "メソッド パス HTTP/1.x" に分ける
+// 成功すればPARSE_DONE、不正ならそのエラーを返す
+static int read_request_line(struct HTTPRequest *req, size_t start, size_t end)
+{
+    char *buf = req->buf;
+    char *line = buf + start;
+    char *p, *path;
+
+    // 先頭から' 'を探してその先頭ポインタを返す, なければNULL
+    p = scanner->find_char2(line, buf + end, ' ', ' '); /* p (1) */
+    if (!p || p == line) return PARSE_BAD_REQUEST;
+    *p++ = '\0'; // ' 'を'\0'に置換して次のポインタへ
+    req->method.off = start;
+    req->method.len = p - 1 - line;
+    scanner->fold_case(line, req->method.len, 1); // メソッド名を大文字に変換
+
+    path = p;
+    p = scanner->find_char2(path, buf + end, ' ', ' ');  /* p (2) */
+    if (!p || p == path) return PARSE_BAD_REQUEST;
+    *p++ = '\0';
+    req->path.off = path - buf;
+    req->path.len = p - 1 - path;
+    if (memchr(path, '%', req->path.len)) {
+        long n = decode_path(path, req->path.len);
+
+        if (n < 0) return PARSE_BAD_REQUEST;
+        req->path.len = n;
+    }
+    // デコードした後で見ないと、%2e%2eが..としてドキュメントルートの外を指してしまう
+    if (!safe_path(path, req->path.len)) return PARSE_BAD_REQUEST;
+
+    // strncasecmp: アルファベットの大文字小文字の区別を無視してstr1とstr2を比較
+    if (buf + end - p < (long)strlen("HTTP/1.x")) return PARSE_BAD_REQUEST;
+    if (strncasecmp(p, "HTTP/1.", strlen("HTTP/1.")) != 0)
+        return PARSE_BAD_REQUEST;
+    p += strlen("HTTP/1."); /* p (3) */
+    if (!isdigit((int)*p)) return PARSE_BAD_REQUEST;
+    req->protocol_minor_version = atoi(p);
+    return PARSE_DONE;
+}
+
+// パスの%XXをその場でデコードし、デコード後の長さを返す(短くなるだけなので受信バッファの中で済む)
+// 壊れた%や、パスを途中で切ってしまう%00なら-1を返す
+static long decode_path(char *path, size_t len)
+{
+    char *src, *dst, *end = path + len;
+    int hi, lo;
+
+    for (src = dst = path; src < end; src++) {
+        if (*src != '%') {
+            *dst++ = *src;
+            continue;
+        }
+        if (end - src < 3) return -1;
+        hi = hex_digit(src[1]);
+        lo = hex_digit(src[2]);
+        if (hi < 0 || lo < 0 || (hi == 0 && lo == 0)) return -1;
+        *dst++ = hi * 16 + lo;
+        src += 2;
+    }
+    *dst = '\0';
+    return dst - path;
+}
+
+// '/'で始まり、.や..のセグメントを含まないパスなら1を返す
+// build_fspath()はドキュメントルートにつなげるだけなので、ここで外に出られないようにする
+static int safe_path(char *path, size_t len)
+{
+    char *p, *end = path + len;
+
+    if (len == 0 || path[0] != '/') return 0;
+    for (p = path; p < end; p++) {
+        if (*p != '/') continue;
+        if (p + 1 < end && p[1] == '.'
+            && (p + 2 == end || p[2] == '/' || (p[2] == '.' && (p + 3 == end || p[3] == '/'))))
+            return 0;
+    }
+    return 1;
+}
+
+static int hex_digit(int c)
+{
+    return (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+        : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+}
+
+// buf[start..end)のヘッダフィールドを name: value に分けて記録する
+// colonはread_request()が改行と一緒に見つけておいた':'の位置
+// 名前は小文字にそろえておき、lookup_header_field_value()ではmemcmpで比べる
+static int read_header_field(struct HTTPRequest *req, size_t start, size_t colon, size_t end)
+{
+    struct HTTPHeaderField *h;
+    char *buf = req->buf;
+    char *p, *tail;
+
+    if (req->nheader == MAX_HEADER_FIELDS) return PARSE_HEADER_TOO_LARGE;
+    if (colon == start) return PARSE_BAD_REQUEST;
+    if (buf[start] == ' ' || buf[start] == '\t') return PARSE_BAD_REQUEST; // 折り返された行は受け付けない
+    p = buf + colon;
+    *p++ = '\0';
+    h = &req->header[req->nheader++];
+    h->name.off = start;
+    h->name.len = colon - start;
+    scanner->fold_case(buf + start, h->name.len, 0);
+
+    // " \t"がpの先頭から何個あるか数えその長さを返す
+    p += strspn(p, " \t"); // タブは飛ばす
+    tail = buf + end;
+    while (tail > p && (tail[-1] == ' ' || tail[-1] == '\t')) tail--;
+    *tail = '\0';
+    h->value.off = p - buf;
+    h->value.len = tail - p;
+    return PARSE_DONE;
+}
+
+// Content-Lengthの値を返す, 数字でなければ-1を返してread_requestで弾く
+static long content_length(struct HTTPRequest *req)
+{
+    char *val, *end;
+    long len;
+
+    val = lookup_header_field_value(req, "Content-Length");
+    if (!val) return 0;
+    if (!isdigit((int)*val)) return -1;
+    errno = 0;
+    len = strtol(val, &end, 10);
+    if (*end != '\0') return -1;
+    if (errno == ERANGE) return MAX_REQUEST_BODY_LENGTH + 1; // 桁あふれは大きすぎるとして扱う
+    return len;
+}
+
+// Transfer-Encodingがなければ0、最後がchunkedなら1、それ以外は-1を返す
+// chunkedより前のエンコーディング(gzipなど)はデコードしないので受け付けない
+static int read_transfer_encoding(struct HTTPRequest *req)
+{
+    char *val;
+
+    val = lookup_header_field_value(req, "Transfer-Encoding");
+    if (!val) return 0;
+    val += strspn(val, " \t");
+    return strcasecmp(val, "chunked") == 0 ? 1 : -1;
+}
+
+static char* parse_error_status(int result)
+{
+    switch (result) {
+    case PARSE_BODY_TOO_LARGE: return "413 Content Too Large";
+    case PARSE_URI_TOO_LONG: return "414 URI Too Long";
+    case PARSE_HEADER_TOO_LARGE: return "431 Request Header Fields Too Large";
+    default: return "400 Bad Request";
+    }
+}
+
+#define MAX_LOOKUP_NAME 64
+static char* lookup_header_field_value(struct HTTPRequest *req, char *name)
+{
+    char key[MAX_LOOKUP_NAME + SCAN_PADDING];
+    size_t len = strlen(name);
+    int i;
+
+    // 受信したヘッダ名は小文字にそろえてあるので、探す名前も小文字にしてから比べる
+    if (len > MAX_LOOKUP_NAME) return NULL;
+    memcpy(key, name, len);
+    scanner->fold_case(key, len, 0);
+    for (i = 0; i < req->nheader; i++) {
+        struct HTTPHeaderField *h = &req->header[i];
+
+        if (h->name.len == len && memcmp(REQ_STR(req, h->name), key, len) == 0)
+            return REQ_STR(req, h->value);
+    }
+    return NULL;
+}
+
+// encodingがENCODING_IDENTITYでなければ、圧縮済みの兄弟ファイルの情報を返す
+// infoはarenaに置くので、リクエストの後も使うならコピーすること
+static struct FileInfo* get_fileinfo(struct Arena *arena, char *docroot, char *urlpath, int encoding)
+{
+    // ドキュメントルートとURLのパスからファイルシステム上のパスを生成
+    struct FileInfo *info;
+    struct stat st;
+
+    info = arena_alloc(arena, sizeof(struct FileInfo));
+    info->path = build_fspath(arena, docroot, urlpath, encodings[encoding].suffix);
+    info->encoding = encoding;
+    info->ok = 0;
+
+    // pathで表されるエントリの情報を取得しstに書きこむ
+    if (lstat(info->path, &st) < 0) return info;  // 失敗時,okは0のままreturn
+    info->is_dir = S_ISDIR(st.st_mode) && autoindex_enabled && encoding == ENCODING_IDENTITY;
+    if (!S_ISREG(st.st_mode) && !info->is_dir) return info; // 通常のファイルじゃない場合、okは0のままreturn
+
+    info->ok = 1;
+    // Content-Typeは兄弟ファイルでも元のファイルの拡張子で決める
+    info->path[strlen(info->path) - strlen(encodings[encoding].suffix)] = '\0';
+    info->content_type = lookup_mime_type(info->path);
+    strcat(info->path, encodings[encoding].suffix);
+    fill_fileinfo(info, &st);
+    return info;
+}
+
+static void fill_fileinfo(struct FileInfo *info, struct stat *st)
+{
+    info->size = st->st_size;
+    info->dev = st->st_dev;
+    info->ino = st->st_ino;
+    info->mtime = st->st_mtim;
+    format_etag(st, info->etag);
+    format_http_date(st->st_mtim.tv_sec, info->last_modified);
+}
+
+// ETagはmtimeとサイズから作る(ETAG_LENバイト必要)
+static void format_etag(struct stat *st, char *buf)
+{
+    snprintf(buf, ETAG_LEN, "\"%lx-%lx-%lx\"", (unsigned long)st->st_mtim.tv_sec,
+             (unsigned long)st->st_mtim.tv_nsec, (unsigned long)st->st_size);
+}
+
+// urlpathはread_request_line()のsafe_path()で..を含まないことを確かめてある
+static char* build_fspath(struct Arena *arena, char *docroot, char *urlpath, char *suffix)
+{
+    char *path;
+
+    // 2回の+1は'/'の分と末尾の'\0'の分
+    path = arena_alloc(arena, strlen(docroot) + 1 + strlen(urlpath) + strlen(suffix) + 1);
+    sprintf(path, "%s%s%s", docroot, urlpath, suffix); // docroot + urlpath + suffixをpathに書き込み
+    return path;
+}
+
+// HTTPリクエストreqに対するレスポンスをoutに書き込む
+// ヘッダを読み終えたところで、ボディを受け取る関数を選ぶ
+// 今のところボディを使うハンドラはないので、どのメソッドでも読み捨てる
+static void select_body_handler(struct HTTPRequest *req)
+{
+    req->body_handler = discard_body;
+}
+
+static void discard_body(struct HTTPRequest *req, char *data, size_t len)
+{
+    stats_add(&stats->request_body_bytes, len);
+}
+
+static void respond_to(struct HTTPRequest *req, struct Response *out, char *docroot)
+{
+    if (strcmp(REQ_STR(req, req->path), STATS_PATH) == 0
+        && (strcmp(REQ_STR(req, req->method), "GET") == 0 || strcmp(REQ_STR(req, req->method), "HEAD") == 0))
+        stats_response(req, out);
+    else if (strcmp(REQ_STR(req, req->method), "GET") == 0)
+        do_file_response(req, out, docroot);
+    else if (strcmp(REQ_STR(req, req->method), "HEAD") == 0)
+        do_file_response(req, out, docroot);
+    else if (strcmp(REQ_STR(req, req->method), "POST") == 0)
+        method_not_allowed(req, out);
+    else
+        not_implemented(req, out);
+}
+
+static void do_file_response(struct HTTPRequest *req, struct Response *out, char *docroot)
+{
+    struct CachedFile *file;
+    struct ByteRange ranges[MAX_RANGES];
+    long t0 = now_nsec();
+    int n;
+
+    file = lookup_file(req->arena, docroot, REQ_STR(req, req->path), ENCODING_IDENTITY);
+    if (file && !file->info->is_dir) file = negotiate_encoding(req, docroot, file);
+    stats_record(&stats->stat, now_nsec() - t0);
+    if (!file) {
+        not_found(req, out);
+        return;
+    }
+    if (file->info->is_dir) {
+        directory_response(req, out, file);
+        return;
+    }
+    if (compressed_response(req, out, file))
+        return;
+    if (not_modified(req, file->info->etag, file->info->mtime.tv_sec)) {
+        not_modified_response(req, out, file->info->etag, file->info->last_modified);
+        release_file(file);
+        return;
+    }
+    n = parse_ranges(req, file, ranges);
+    if (n == 0) {
+        range_not_satisfiable(req, out, file);
+        return;
+    }
+    if (n == 1) {
+        single_range_response(req, out, file, &ranges[0]);
+        return;
+    }
+    if (n > 1 && multi_range_response(req, out, file, ranges, n))
+        return;
+    if (cache_file_response(file)) {
+        output_cached_response(req, out, file);
+        return;
+    }
+
+    // レスポンスヘッダの出力
+    output_common_header_fields(req, out, "200 OK");
+    out_puts(out, "Content-Length: ");
+    out_long(out, file->info->size);
+    out_puts(out, "\r\n");
+    output_file_header_fields(file, out);
+    out_puts(out, "\r\n");
+    if (strcmp(REQ_STR(req, req->method), "HEAD") == 0) {
+        release_file(file);
+        return;
+    }
+
+    // ボディはレスポンスヘッダを送った後で、送信可能になった分ずつ送る
+    // 送り終わるまでエントリへの参照を持っておく
+    out->body_file = file;
+    out->body_fd = file->fd;
+    out->body_offset = 0;
+    out->body_length = file->info->size;
+}
+
+// --autoindex: ディレクトリの一覧を返す
+// 作ったHTMLはレスポンスごとファイルキャッシュのエントリに持たせ、
+// ディレクトリが変わってエントリが捨てられるまで作り直さない
+static void directory_response(struct HTTPRequest *req, struct Response *out, struct CachedFile *file)
+{
+    char *path = REQ_STR(req, req->path);
+    size_t len = req->path.len;
+
+    if (len == 0 || path[len - 1] != '/') { // 相対リンクが効くように/で終わるURLへ移らせる
+        output_common_header_fields(req, out, "301 Moved Permanently");
+        out_puts(out, "Location: ");
+        out_url(out, path); // 制御文字などをそのままヘッダに出さない
+        out_puts(out, "/\r\nContent-Length: 0\r\n\r\n");
+        release_file(file);
+        return;
+    }
+    if (!file->mem && !render_directory(file, path)) {
+        release_file(file);
+        not_found(req, out);
+        return;
+    }
+    output_cached_response(req, out, file);
+}
+
+// getdents64(2)でエントリの名前だけを読み、名前順に並べた一覧のレスポンスをfile->memに作る
+// エントリごとにstatしないので、10万件のディレクトリでも読み直しは速い
+static int render_directory(struct CachedFile *file, char *urlpath)
+{
+    struct FileCache *cache = &file_cache;
+    struct Buffer names = {NULL, 0, 0}; // "名前\0"の並び, ディレクトリは名前の後ろに'/'をつける
+    size_t *offs = NULL, noffs = 0, capa = 0, i;
+    struct Response body, r;
+    char *dents;
+    long n, pos;
+
+    if (lseek(file->fd, 0, SEEK_SET) < 0) return 0;
+    dents = xmalloc(AUTOINDEX_DENTS_BUF_SIZE);
+    while ((n = getdents64(file->fd, dents, AUTOINDEX_DENTS_BUF_SIZE)) > 0) {
+        for (pos = 0; pos < n; pos += ((struct dirent64 *)(dents + pos))->d_reclen) {
+            struct dirent64 *d = (struct dirent64 *)(dents + pos);
+            size_t len = strlen(d->d_name);
+            int dir = d->d_type == DT_DIR;
+            struct stat st;
+
+            if (d->d_name[0] == '.') continue; // ".", ".."と隠しファイル
+            if (d->d_type == DT_UNKNOWN) // d_typeを返さないファイルシステム
+                dir = fstatat(file->fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+            if (noffs == capa) {
+                capa = capa ? capa * 2 : 256;
+                offs = xrealloc(offs, sizeof(size_t) * capa);
+            }
+            offs[noffs++] = names.len;
+            memcpy(buf_reserve(&names, len + 2), d->d_name, len);
+            names.len += len;
+            if (dir) names.ptr[names.len++] = '/';
+            names.ptr[names.len++] = '\0';
+        }
+    }
+    free(dents);
+    if (n < 0) {
+        free(names.ptr);
+        free(offs);
+        return 0;
+    }
+    qsort_r(offs, noffs, sizeof(size_t), compare_names, names.ptr);
+
+    body.head.ptr = NULL;
+    body.head.len = body.head.capa = 0;
+    out_puts(&body, "<html>\r\n<head><title>Index of ");
+    out_html(&body, urlpath);
+    out_puts(&body, "</title></head>\r\n<body>\r\n<h1>Index of ");
+    out_html(&body, urlpath);
+    out_puts(&body, "</h1>\r\n<ul>\r\n");
+    if (strcmp(urlpath, "/") != 0)
+        out_puts(&body, "<li><a href=\"../\">../</a></li>\r\n");
+    for (i = 0; i < noffs; i++) {
+        out_puts(&body, "<li><a href=\"");
+        out_url(&body, names.ptr + offs[i]); // %, ?, #なども名前のままリンクになるように
+        out_puts(&body, "\">");
+        out_html(&body, names.ptr + offs[i]);
+        out_puts(&body, "</a></li>\r\n");
+    }
+    out_puts(&body, "</ul>\r\n</body>\r\n</html>\r\n");
+    free(names.ptr);
+    free(offs);
+
+    // cache_file_response()と同じ形(ヘッダ+ボディ)にして、output_cached_response()で返す
+    r.head.ptr = NULL;
+    r.head.len = r.head.capa = 0;
+    out_puts(&r, STATUS_LINE_PREFIX "200 OK\r\nDate: ");
+    file->date_off = r.head.len;
+    out_write(&r, current_http_date(), HTTP_DATE_LEN);
+    file->date = http_date_time;
+    out_puts(&r, "\r\n" SERVER_HEADER_FIELD "Content-Length: ");
+    out_long(&r, body.head.len);
+    out_puts(&r, "\r\nContent-Type: text/html; charset=utf-8\r\nLast-Modified: ");
+    out_puts(&r, file->info->last_modified);
+    out_puts(&r, "\r\n");
+    file->head_len = r.head.len;
+    out_write(&r, body.head.ptr, body.head.len);
+    free(body.head.ptr);
+    // 一覧は上限を超えても持っておく(作り直すほうが高くつく)。ほかのメモリは空けておく
+    if (file->urlpath) {
+        make_room(r.head.len, file);
+        cache->mem_used += r.head.len;
+    }
+    file->mem = r.head.ptr;
+    file->mem_len = r.head.len;
+    return 1;
+}
+
+static int compare_names(const void *a, const void *b, void *arg)
+{
+    char *names = arg;
+
+    return strcmp(names + *(const size_t *)a, names + *(const size_t *)b);
+}
+
+// HTMLの特殊文字をエスケープして出力する
+static void out_html(struct Response *out, const char *str)
+{
+    const char *p;
+
+    for (p = str; *p; p++) {
+        switch (*p) {
+        case '&': out_puts(out, "&amp;"); break;
+        case '<': out_puts(out, "&lt;"); break;
+        case '>': out_puts(out, "&gt;"); break;
+        case '"': out_puts(out, "&quot;"); break;
+        default: out_write(out, p, 1); break;
+        }
+    }
+}
+
+// URLのパスとして%XXでエンコードして出力する('/'と英数字・-._~はそのまま)
+// 結果にはHTMLの特殊文字も残らないので、属性値にもそのまま使える
+static void out_url(struct Response *out, const char *str)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    const unsigned char *p;
+    char esc[3];
+
+    for (p = (const unsigned char *)str; *p; p++) {
+        if (isalnum(*p) || strchr("-._~/", *p)) {
+            out_write(out, (const char *)p, 1);
+            continue;
+        }
+        esc[0] = '%';
+        esc[1] = hex[*p >> 4];
+        esc[2] = hex[*p & 15];
+        out_write(out, esc, 3);
+    }
+}
+
+// 条件付きGET: クライアントがキャッシュしている版がまだ新しければ非ゼロを返す
+// If-None-Matchがあれば、If-Modified-Sinceは見ない
+static int not_modified(struct HTTPRequest *req, char *etag, time_t mtime)
+{
+    char *val;
+    time_t t;
+
+    if ((val = lookup_header_field_value(req, "If-None-Match")))
+        return etag_matches(val, etag);
+    if ((val = lookup_header_field_value(req, "If-Modified-Since"))) {
+        t = parse_http_date(val);
+        return t >= 0 && mtime <= t;
+    }
+    return 0;
+}
+
+// Accept-Encodingに合う圧縮済みの兄弟ファイル(foo.js.brなど)があれば、fileの代わりにそれを返す
+static struct CachedFile* negotiate_encoding(struct HTTPRequest *req, char *docroot, struct CachedFile *file)
+{
+    struct CachedFile *f;
+    char *accept;
+    int e;
+
+    accept = lookup_header_field_value(req, "Accept-Encoding");
+    if (!accept) return file;
+    // 兄弟ファイルの有無はエントリごとに一度だけ調べる
+    if (file->variants < 0) file->variants = find_variants(file->info);
+    for (e = ENCODING_IDENTITY + 1; e < NENCODINGS; e++) {
+        if (!(file->variants & (1 << e)) || !accepts_encoding(accept, encodings[e].name))
+            continue;
+        f = lookup_file(req->arena, docroot, REQ_STR(req, req->path), e);
+        if (!f) continue; // 調べた後で消えた
+        release_file(file);
+        return f;
+    }
+    return file;
+}
+
+static int find_variants(struct FileInfo *info)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    int e, variants = 0;
+
+    for (e = ENCODING_IDENTITY + 1; e < NENCODINGS; e++) {
+        if (snprintf(path, sizeof path, "%s%s", info->path, encodings[e].suffix) >= (int)sizeof path)
+            continue;
+        if (lstat(path, &st) == 0 && S_ISREG(st.st_mode))
+            variants |= 1 << e;
+    }
+    return variants;
+}
+
+// Accept-Encodingの値がnameを(q=0以外で)受け付けていれば非ゼロを返す
+// 名前がなくても"*"があれば受け付ける
+static int accepts_encoding(char *accept, char *name)
+{
+    size_t len = strlen(name);
+    char *p = accept, *q;
+    int star = 0;
+
+    while (*p) {
+        int match, any, zero = 0;
+
+        p += strspn(p, " \t,");
+        if (!*p) break;
+        match = strncasecmp(p, name, len) == 0 && strchr(" \t;,", p[len]);
+        any = *p == '*' && strchr(" \t;,", p[1]);
+        p += strcspn(p, ";,");
+        // パラメータのq=0, q=0.0などは「受け付けない」
+        while (*p == ';') {
+            p++;
+            p += strspn(p, " \t");
+            if ((p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+                q = p + 2;
+                zero = *q == '0';
+                for (q++; *q == '.' || *q == '0'; q++)
+                    ;
+                if (*q >= '1' && *q <= '9') zero = 0;
+            }
+            p += strcspn(p, ";,");
+        }
+        if (match) return !zero;
+        if (any) star = !zero;
+    }
+    return star;
+}
+
+// --compress: 圧縮したボディがあればそれで応答して非ゼロを返す
+// まだなければ圧縮スレッドに頼んで、今回は呼び出し元が圧縮せずに返す
+static int compressed_response(struct HTTPRequest *req, struct Response *out, struct CachedFile *file)
+{
+    struct FileInfo *info = file->info;
+    struct CompressedBody *c;
+    char etag[ETAG_LEN + 8];
+    char *accept;
+
+    if (!compress_cache || info->encoding != ENCODING_IDENTITY) return 0;
+    if (info->size < COMPRESS_MIN_SIZE || info->size > COMPRESS_MAX_SIZE) return 0;
+    if (!compressible_type(info->content_type)) return 0;
+    accept = lookup_header_field_value(req, "Accept-Encoding");
+    if (!accept || !accepts_encoding(accept, "gzip")) return 0;
+    // 範囲の指定は元のファイルに対して応じる
+    if (lookup_header_field_value(req, "Range")) return 0;
+    if (!(c = lookup_compressed(info))) return 0;
+
+    // 圧縮した版は別の表現なので、ETagも区別する
+    snprintf(etag, sizeof etag, "%.*s-gzip\"", (int)strlen(info->etag) - 1, info->etag);
+    if (not_modified(req, etag, info->mtime.tv_sec)) {
+        not_modified_response(req, out, etag, info->last_modified);
+        release_compressed(c);
+        release_file(file);
+        return 1;
+    }
+    output_common_header_fields(req, out, "200 OK");
+    out_puts(out, "Content-Length: ");
+    out_long(out, c->len);
+    out_puts(out, "\r\nContent-Type: ");
+    out_puts(out, guess_content_type(info));
+    out_puts(out, "\r\nContent-Encoding: gzip\r\nVary: Accept-Encoding\r\nLast-Modified: ");
+    out_puts(out, info->last_modified);
+    out_puts(out, "\r\nETag: ");
+    out_puts(out, etag);
+    out_puts(out, "\r\n\r\n");
+    release_file(file);
+    if (strcmp(REQ_STR(req, req->method), "HEAD") == 0) {
+        release_compressed(c);
+        return 1;
+    }
+    out->body_compressed = c;
+    out->body_mem = c->data;
+    out->body_offset = 0;
+    out->body_length = c->len;
+    return 1;
+}
+
+// テキストのように圧縮が効くContent-Typeなら非ゼロを返す
+static int compressible_type(char *type)
+{
+    return strncmp(type, "text/", 5) == 0 || strstr(type, "javascript") || strstr(type, "json")
+        || strstr(type, "xml") || strstr(type, "svg");
+}
+
+// カンマ区切りのETagの並びにetagが含まれていれば非ゼロを返す(弱い比較なのでW/は無視する)
+static int etag_matches(char *list, char *etag)
+{
+    size_t len = strlen(etag);
+    char *p = list;
+
+    while (*p) {
+        p += strspn(p, " \t,");
+        if (*p == '*') return 1;
+        if (strncmp(p, "W/", 2) == 0) p += 2;
+        if (strncmp(p, etag, len) == 0 && strchr(" \t,", p[len]))
+            return 1;
+        p += strcspn(p, ",");
+    }
+    return 0;
+}
+
+// "Sun, 06 Nov 1994 08:49:37 GMT"の形式の日付を読む, 読めなければ-1を返す
+static time_t parse_http_date(char *val)
+{
+    struct tm tm;
+    char *end;
+
+    memset(&tm, 0, sizeof tm);
+    end = strptime(val, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end) return -1;
+    return timegm(&tm);
+}
+
+// Rangeヘッダ(bytes=...)をrangesに読み込んで範囲の数を返す
+// どの範囲もファイルにかからなければ0、Rangeがない・読めない・If-Rangeが一致しない場合は-1
+// (-1なら全体を200で返す)
+static int parse_ranges(struct HTTPRequest *req, struct CachedFile *file, struct ByteRange *ranges)
+{
+    long size = file->info->size;
+    char *val, *p;
+    int n = 0;
+
+    val = lookup_header_field_value(req, "Range");
+    if (!val || strncmp(val, "bytes=", 6) != 0) return -1;
+    if ((p = lookup_header_field_value(req, "If-Range"))) {
+        // If-Rangeは強い比較: ETagなら完全に一致、日付ならLast-Modifiedと同じ時刻
+        if (*p == '"' ? strcmp(p, file->info->etag) != 0
+                      : parse_http_date(p) != file->info->mtime.tv_sec)
+            return -1;
+    }
+    p = val + 6;
+    for (;;) {
+        long first, last;
+
+        p += strspn(p, " \t");
+        if (*p == '-') { // -N: 末尾のNバイト
+            p++;
+            if ((last = parse_range_number(&p)) < 0) return -1;
+            first = size - last;
+            if (first < 0) first = 0;
+            last = size - 1;
+            if (last < first) first = -1; // -0か空のファイル
+        } else {
+            if ((first = parse_range_number(&p)) < 0 || *p++ != '-') return -1;
+            if (*p >= '0' && *p <= '9') {
+                if ((last = parse_range_number(&p)) < first) return -1;
+                if (last >= size) last = size - 1;
+            } else {
+                last = size - 1;
+            }
+            if (first >= size) first = -1;
+        }
+        if (first >= 0) { // ファイルにかからない範囲は捨てる
+            if (n == MAX_RANGES) return -1;
+            ranges[n].first = first;
+            ranges[n].last = last;
+            n++;
+        }
+        p += strspn(p, " \t");
+        if (*p == '\0') break;
+        if (*p++ != ',') return -1;
+    }
+    return n;
+}
+
+// 10進の数字を読んでpを進める, 数字がなければ-1を返す
+static long parse_range_number(char **p)
+{
+    long n = 0;
+
+    if (**p < '0' || **p > '9') return -1;
+    for (; **p >= '0' && **p <= '9'; (*p)++) {
+        if (n > (LONG_MAX - 9) / 10) n = (LONG_MAX - 9) / 10; // あふれる値はどのみちファイルより大きい
+        n = n * 10 + (**p - '0');
+    }
+    return n;
+}
+
+static void not_modified_response(struct HTTPRequest *req, struct Response *out, char *etag, char *last_modified)
+{
+    output_common_header_fields(req, out, "304 Not Modified");
+    out_puts(out, "ETag: ");
+    out_puts(out, etag);
+    out_puts(out, "\r\nLast-Modified: ");
+    out_puts(out, last_modified);
+    out_puts(out, "\r\nVary: Accept-Encoding\r\n\r\n");
+}
+
+static void range_not_satisfiable(struct HTTPRequest *req, struct Response *out, struct CachedFile *file)
+{
+    output_common_header_fields(req, out, "416 Range Not Satisfiable");
+    out_printf(out, "Content-Range: bytes */%ld\r\n", file->info->size);
+    out_puts(out, "Content-Length: 0\r\n\r\n");
+    release_file(file);
+}
+
+// 1つの範囲なら、ボディは全体のときと同じくファイルかキャッシュしたメモリの途中から送る
+static void single_range_response(struct HTTPRequest *req, struct Response *out, struct CachedFile *file, struct ByteRange *range)
+{
+    int mem = cache_file_response(file);
+
+    output_common_header_fields(req, out, "206 Partial Content");
+    out_printf(out, "Content-Range: bytes %ld-%ld/%ld\r\n", range->first, range->last, file->info->size);
+    out_puts(out, "Content-Length: ");
+    out_long(out, range->last - range->first + 1);
+    out_puts(out, "\r\n");
+    output_file_header_fields(file, out);
+    out_puts(out, "\r\n");
+    if (strcmp(REQ_STR(req, req->method), "HEAD") == 0) {
+        release_file(file);
+        return;
+    }
+    out->body_file = file;
+    if (mem)
+        out->body_mem = file->mem + file->head_len;
+    else
+        out->body_fd = file->fd;
+    out->body_offset = range->first;
+    out->body_length = range->last - range->first + 1;
+}
+
+// 複数の範囲はmultipart/byterangesのボディをメモリで組み立ててheadに続けて送る
+// 合計が大きすぎる場合やファイルが読めない場合は0を返す(呼び出し元は全体を200で返す)
+static int multi_range_response(struct HTTPRequest *req, struct Response *out, struct CachedFile *file, struct ByteRange *ranges, int n)
+{
+    struct Response body;
+    long total = 0;
+    ssize_t r;
+    off_t off;
+    int i;
+
+    for (i = 0; i < n; i++)
+        total += ranges[i].last - ranges[i].first + 1;
+    if (total > MAX_MULTIRANGE_LENGTH) return 0;
+
+    body.head.ptr = NULL;
+    body.head.len = body.head.capa = 0;
+    for (i = 0; i < n; i++) {
+        size_t len = ranges[i].last - ranges[i].first + 1;
+
+        out_puts(&body, "\r\n--" BYTERANGES_BOUNDARY "\r\nContent-Type: ");
+        out_puts(&body, guess_content_type(file->info));
+        out_printf(&body, "\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                   ranges[i].first, ranges[i].last, file->info->size);
+        buf_reserve(&body.head, len);
+        for (off = 0; off < (off_t)len; off += r) {
+            r = pread(file->fd, body.head.ptr + body.head.len + off, len - off, ranges[i].first + off);
+            if (r <= 0) {
+                if (r < 0 && errno == EINTR) {
+                    r = 0;
+                    continue;
+                }
+                free(body.head.ptr); // 読んでいる間に縮んだ
+                return 0;
+            }
+        }
+        body.head.len += len;
+    }
+    out_puts(&body, "\r\n--" BYTERANGES_BOUNDARY "--\r\n");
+
+    output_common_header_fields(req, out, "206 Partial Content");
+    out_puts(out, "Content-Length: ");
+    out_long(out, body.head.len);
+    out_puts(out, "\r\nContent-Type: multipart/byteranges; boundary=" BYTERANGES_BOUNDARY "\r\n");
+    out_puts(out, "ETag: ");
+    out_puts(out, file->info->etag);
+    out_puts(out, "\r\nLast-Modified: ");
+    out_puts(out, file->info->last_modified);
+    out_puts(out, "\r\n\r\n");
+    if (strcmp(REQ_STR(req, req->method), "HEAD") != 0)
+        out_write(out, body.head.ptr, body.head.len);
+    free(body.head.ptr);
+    release_file(file);
+    return 1;
+}
+
+static void method_not_allowed(struct HTTPRequest *req, struct Response *out)
+{
+    html_response(req, out, "405 Method Not Allowed",
+                  "<html>\r\n"
+                  "<header>\r\n"
+                  "<title>405 Method Not Allowed</title>\r\n"
+                  "<header>\r\n"
+                  "<body>\r\n"
+                  "<p>The request method %s is not allowed</p>\r\n"
+                  "</body>\r\n"
+                  "</html>\r\n", REQ_STR(req, req->method));
+}
+
+static void not_implemented(struct HTTPRequest *req, struct Response *out)
+{
+    html_response(req, out, "501 Not Implemented",
+                  "<html>\r\n"
+                  "<header>\r\n"
+                  "<title>501 Not Implemented</title>\r\n"
+                  "<header>\r\n"
+                  "<body>\r\n"
+                  "<p>The request method %s is not implemented</p>\r\n"
+                  "</body>\r\n"
+                  "</html>\r\n", REQ_STR(req, req->method));
+}
+
+static void not_found(struct HTTPRequest *req, struct Response *out)
+{
+    html_response(req, out, "404 Not Found",
+                  "<html>\r\n"
+                  "<header><title>Not Found</title><header>\r\n"
+                  "<body><p>File not found</p></body>\r\n"
+                  "</html>\r\n");
+}
+
+// HTMLのボディを持つレスポンスを書き込む
+// 接続を維持するにはボディの長さが必要なので、先にボディを組み立ててからヘッダを出す
+static void html_response(struct HTTPRequest *req, struct Response *out, char *status, const char *fmt, ...)
+{
+    char *body;
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    body = arena_alloc(req->arena, len + 1);
+    va_start(ap, fmt);
+    vsnprintf(body, len + 1, fmt, ap);
+    va_end(ap);
+    output_common_header_fields(req, out, status);
+    out_printf(out, "Content-Length: %d\r\n", len);
+    out_printf(out, "Content-Type: text/html\r\n");
+    out_puts(out, "\r\n");
+    if (strcmp(REQ_STR(req, req->method), "HEAD") != 0)
+        out_write(out, body, len);
+}
+
+// レスポンスごとに書式化はせず、用意しておいた文字列をつなぐだけにする
+static void output_common_header_fields(struct HTTPRequest *req, struct Response *out, char *status)
+{
+    out->status = atoi(status);
+    out_puts(out, STATUS_LINE_PREFIX);
+    out_puts(out, status);
+    out_puts(out, "\r\nDate: ");
+    out_write(out, current_http_date(), HTTP_DATE_LEN);
+    out_puts(out, "\r\n" SERVER_HEADER_FIELD);
+    output_connection_header_fields(req, out);
+}
+
+// 接続の維持に関するヘッダはリクエストごとに変わる
+static void output_connection_header_fields(struct HTTPRequest *req, struct Response *out)
+{
+    if (req->keep_alive) {
+        out_write(out, keepalive_header_fields, keepalive_header_fields_len);
+        out_long(out, req->requests_left);
+        out_puts(out, "\r\n");
+    } else {
+        out_puts(out, "Connection: close\r\n");
+    }
+}
+
+static void output_file_header_fields(struct CachedFile *file, struct Response *out)
+{
+    out_puts(out, "Content-Type: ");
+    out_puts(out, guess_content_type(file->info));
+    out_puts(out, "\r\nLast-Modified: ");
+    out_puts(out, file->info->last_modified);
+    out_puts(out, "\r\nETag: ");
+    out_puts(out, file->info->etag);
+    out_puts(out, "\r\nAccept-Ranges: bytes\r\nVary: Accept-Encoding\r\n");
+    if (file->info->encoding != ENCODING_IDENTITY) {
+        out_puts(out, "Content-Encoding: ");
+        out_puts(out, encodings[file->info->encoding].name);
+        out_puts(out, "\r\n");
+    }
+}
+
+// tをHTTPの日付の形式でbufに書き込む(HTTP_DATE_LEN + 1バイト必要)
+static void format_http_date(time_t t, char *buf)
+{
+    struct tm tm;
+
+    if (!gmtime_r(&t, &tm)) log_exit("gmtime() failed: %s", strerror(errno));
+    strftime(buf, HTTP_DATE_LEN + 1, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// 現在時刻のDateヘッダの値を返す
+// epoll版はタイマーが毎秒作り直す. fork版は秒が変わったときだけ作り直す
+static char* current_http_date(void)
+{
+    if (!http_date_ticking) {
+        time_t t = time(NULL);
+
+        if (t != http_date_time) update_http_date(t);
+    }
+    return http_date;
+}
+
+static void update_http_date(time_t t)
+{
+    format_http_date(t, http_date);
+    http_date_time = t;
+}
+
+// 設定で決まり、リクエストごとには変わらないヘッダを起動時に作っておく
+static void init_static_header_fields(void)
+{
+    int n;
+
+    n = snprintf(keepalive_header_fields, sizeof keepalive_header_fields,
+                 "Connection: keep-alive\r\nKeep-Alive: timeout=%d, max=", keepalive_timeout);
+    keepalive_header_fields_len = n;
+}
+
+// fprintf()と同じ形式でレスポンスのヘッダ部分に追記する
+static void out_printf(struct Response *out, const char *fmt, ...)
+{
+    struct Buffer *buf = &out->head;
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf->ptr + buf->len, buf->capa - buf->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) log_exit("vsnprintf() failed");
+    if (buf->len + n >= buf->capa) { // 入りきらなかったので広げて書き直す
+        buf_reserve(buf, n + 1);
+        va_start(ap, fmt);
+        vsnprintf(buf->ptr + buf->len, buf->capa - buf->len, fmt, ap);
+        va_end(ap);
+    }
+    buf->len += n;
+}
+
+// lenバイトをそのままレスポンスのヘッダ部分に追記する
+static void out_write(struct Response *out, const char *p, size_t len)
+{
+    memcpy(buf_reserve(&out->head, len), p, len);
+    out->head.len += len;
+}
+
+static void out_puts(struct Response *out, const char *str)
+{
+    out_write(out, str, strlen(str));
+}
+
+// 10進数で追記する
+static void out_long(struct Response *out, long n)
+{
+    char buf[24], *p = buf + sizeof buf;
+    unsigned long u = n < 0 ? -(unsigned long)n : (unsigned long)n;
+
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (n < 0) *--p = '-';
+    out_write(out, p, buf + sizeof buf - p);
+}
+
+// 送信し終わったレスポンスを片付けて、次のレスポンスを書き込めるようにする
+static void reset_response(struct Response *res)
+{
+    if (res->body_file) release_file(res->body_file);
+    if (res->body_compressed) release_compressed(res->body_compressed);
+    res->body_file = NULL;
+    res->body_compressed = NULL;
+    res->body_fd = -1;
+    res->body_mem = NULL;
+    res->body_offset = 0;
+    res->body_length = 0;
+    res->head.len = 0;
+    res->sent = 0;
+}
+
+// bufの末尾にlenバイト書き込める領域を確保し、その先頭を返す
+static char* buf_reserve(struct Buffer *buf, size_t len)
+{
+    if (buf->len + len > buf->capa) {
+        size_t capa = buf->capa ? buf->capa : BLOCK_BUF_SIZE;
+
+        while (capa < buf->len + len) capa *= 2;
+        buf->ptr = xrealloc(buf->ptr, capa);
+        buf->capa = capa;
+    }
+    return buf->ptr + buf->len;
+}
+
+// SIGPIPEを捕捉時、signal_exit関数を呼び出す(ログ出力して終了)
+// 子プロセスの扱いはマスターとワーカーで違うので、それぞれで設定する
+static void install_signal_handlers(void)
+{
+    trap_signal(SIGPIPE, signal_exit);
+}
+
+static void trap_signal(int sig, sighandler_t handler)
+{
+    struct sigaction act;
+
+    act.sa_handler = handler;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESTART;
+    if (sigaction(sig, &act, NULL) < 0)
+        log_exit("sigaction() failed: %s", strerror(errno));
+}
+
+// ブロックしているシステムコールをEINTRで戻らせたいシグナル用
+static void trap_signal_interrupt(int sig, sighandler_t handler)
+{
+    struct sigaction act;
+
+    act.sa_handler = handler;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    if (sigaction(sig, &act, NULL) < 0)
+        log_exit("sigaction() failed: %s", strerror(errno));
+}
+
+static void signal_exit(int sig)
+{
+    log_exit("exit by signal %d", sig);
+}
+
+// fork版: 終了した接続の子プロセスを回収して、acceptで数えた接続数を減らす
+static void reap_children(void)
+{
+    pid_t pid;
+
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        if (pid == upgrade_pid) continue;
+        stats_add(&stats->active_connections, -1);
+    }
+}
+
+static void noop_handler(int sig)
+{
+    ;
+}
+
+/****** io_uring *********************************************************/
+
+// epoll版と同じ接続の状態遷移を、readiness通知ではなく完了通知で動かす
+// - 接続待ち: マルチショットのacceptを1つ投入しておく
+// - 受信: 提供バッファ(provided buffer ring)を使うマルチショットのrecvで受け取り、
+//   connection_recv()が呼ばれたらrbufへ移してバッファをリングに返す
+// - 送信: ヘッダとメモリ上のボディはsend/sendmsg、ファイルのボディは
+//   ファイル→パイプ→ソケットのspliceを1つずつ投入し、完了したら状態を進める
+// 接続を閉じても完了待ちの操作(inflight)が残っている間はConnectionを解放しない
+static void uring_server_main(int server_fd, char *docroot)
+{
+    struct TimerWheel wheel;
+    struct Timer date_timer;
+
+    trap_signal(SIGPIPE, SIG_IGN);
+    trap_signal(SIGUSR1, request_stats);
+
+    setup_uring();
+    uring_arm_accept(server_fd);
+    init_file_cache(1);
+    if (file_cache.inotify_fd >= 0) uring_arm_notify();
+
+    timer_init(&wheel, now_msec());
+    date_timer.handler = tick_http_date;
+    date_timer.data = &date_timer;
+    date_timer.slot = NULL;
+    http_date_ticking = 1;
+    tick_http_date(&wheel, &date_timer);
+    notify_upgraded();
+
+    for (;;) {
+        unsigned head, tail;
+        long now;
+
+        // 溜めたSQEを投入し、次のタイマーが発火するまで完了を待つ
+        if (uring_enter(1, timer_next(&wheel)) < 0) {
+            if (errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN)
+                log_exit("io_uring_enter(2) failed: %s", strerror(errno));
+        }
+        if (stats_requested) {
+            stats_requested = 0;
+            log_file_cache_stats();
+        }
+        if (!draining && stop_accepting(&server_fd, 1)) {
+            // マルチショットのacceptはfdを閉じても止まらないので取り消す
+            struct io_uring_sqe *sqe = uring_get_sqe();
+
+            draining = 1;
+            uring_prep(sqe, IORING_OP_ASYNC_CANCEL, -1, NULL, URING_CANCEL);
+            sqe->addr = URING_ACCEPT; // acceptのuser_data
+            close(server_fd);
+        }
+        if (draining && (long)stats->active_connections == 0) {
+            flush_access_log();
+            exit(0);
+        }
+        now = now_msec();
+        head = *uring->cq_head;
+        tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            // 処理中に投入したSQEの完了で上書きされないよう、写してからCQを進める
+            struct io_uring_cqe cqe = uring->cqes[head & uring->cq_mask];
+
+            head++;
+            __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+            uring_complete(&cqe, server_fd, docroot, &wheel, now);
+        }
+        timer_advance(&wheel, now);
+    }
+}
+
+static void setup_uring(void)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    size_t sq_size, cq_size;
+    char *ring;
+    unsigned i;
+    int fd;
+
+    uring = xmalloc(sizeof(struct Uring));
+    // 提出はこのスレッドだけなので、完了処理もio_uring_enterの中でまとめて行わせる
+    memset(&p, 0, sizeof p);
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0 && errno == EINVAL) { // 6.1より前のカーネル
+        memset(&p, 0, sizeof p);
+        fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    }
+    if (fd < 0) log_exit("io_uring_setup(2) failed: %s", strerror(errno));
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG))
+        log_exit("io_uring: kernel too old");
+    uring->fd = fd;
+
+    // SQとCQのリングは1回のmmapで両方見える
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring = mmap(NULL, sq_size > cq_size ? sq_size : cq_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) log_exit("mmap(2) failed: %s", strerror(errno));
+    uring->sq_head = (unsigned *)(ring + p.sq_off.head);
+    uring->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    uring->sq_array = (unsigned *)(ring + p.sq_off.array);
+    uring->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    uring->sq_entries = p.sq_entries;
+    uring->sq_local_tail = *uring->sq_tail;
+    uring->cq_head = (unsigned *)(ring + p.cq_off.head);
+    uring->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    uring->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    uring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) log_exit("mmap(2) failed: %s", strerror(errno));
+    // SQEは順番に使うので、インデックスの配列は恒等写像で固定しておく
+    for (i = 0; i < p.sq_entries; i++)
+        uring->sq_array[i] = i;
+
+    // recvに使わせるバッファのリングを登録する
+    uring->buf_ring = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring->buf_ring == MAP_FAILED) log_exit("mmap(2) failed: %s", strerror(errno));
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (unsigned long)uring->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        log_exit("io_uring_register(2) failed: %s", strerror(errno));
+    uring->buf_tail = 0;
+    uring->bufs = xmalloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    for (i = 0; i < URING_BUF_COUNT; i++)
+        uring_recycle_buf(i);
+}
+
+// 空いているSQEを1つ取り出す。SQが一杯なら先に投入して空ける
+static struct io_uring_sqe* uring_get_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+
+    if (uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+        if (uring_enter(0, -1) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+            log_exit("io_uring_enter(2) failed: %s", strerror(errno));
+        if (uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries)
+            log_exit("io_uring: submission queue overflow");
+    }
+    sqe = &uring->sqes[uring->sq_local_tail & uring->sq_mask];
+    uring->sq_local_tail++;
+    memset(sqe, 0, sizeof *sqe);
+    return sqe;
+}
+
+// 接続に対する操作は完了するまでinflightに数える
+static void uring_prep(struct io_uring_sqe *sqe, int op, int fd, struct Connection *conn, enum UringOp tag)
+{
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = (unsigned long)conn | tag;
+    if (conn) conn->inflight++;
+}
+
+// 溜めたSQEを投入する。min_completeが非ゼロなら、その数だけ完了するかtimeout_msが経つまで待つ
+static int uring_enter(unsigned min_complete, long timeout_ms)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = 0;
+    unsigned to_submit;
+
+    __atomic_store_n(uring->sq_tail, uring->sq_local_tail, __ATOMIC_RELEASE);
+    to_submit = uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+    if (min_complete == 0) {
+        if (to_submit == 0) return 0;
+        return syscall(__NR_io_uring_enter, uring->fd, to_submit, 0, 0, NULL, 0);
+    }
+    flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    memset(&arg, 0, sizeof arg);
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+        arg.ts = (unsigned long)&ts;
+    }
+    return syscall(__NR_io_uring_enter, uring->fd, to_submit, min_complete, flags, &arg, sizeof arg);
+}
+
+static void uring_complete(struct io_uring_cqe *cqe, int server_fd, char *docroot, struct TimerWheel *wheel, long now)
+{
+    enum UringOp op = cqe->user_data & URING_OP_MASK;
+    struct Connection *conn = (struct Connection *)(unsigned long)(cqe->user_data & ~(__u64)URING_OP_MASK);
+
+    switch (op) {
+    case URING_ACCEPT:
+        // マルチショットが止まったら投入し直す
+        if (!(cqe->flags & IORING_CQE_F_MORE) && !draining) uring_arm_accept(server_fd);
+        if (cqe->res < 0) {
+            if (cqe->res == -EINTR || cqe->res == -ECONNABORTED || cqe->res == -EAGAIN
+                || cqe->res == -ECANCELED) return;
+            if (cqe->res == -EMFILE || cqe->res == -ENFILE || cqe->res == -ENOBUFS || cqe->res == -ENOMEM) {
+                errno = -cqe->res;
+                shed_connection(server_fd);
+                return;
+            }
+            log_exit("accept(2) failed: %s", strerror(-cqe->res));
+        }
+        if (max_connections > 0 && (long)stats->active_connections >= max_connections) {
+            reject_connection(cqe->res);
+            return;
+        }
+        stats_add(&stats->active_connections, 1);
+        conn = new_connection(cqe->res);
+        conn->timer.handler = expire_connection;
+        conn->timer.data = conn;
+        break;
+    case URING_NOTIFY:
+        if (!(cqe->flags & IORING_CQE_F_MORE)) uring_arm_notify();
+        process_file_events();
+        return;
+    case URING_CANCEL:
+        return;
+    case URING_RECV:
+        uring_recv_done(conn, cqe);
+        break;
+    default:
+        uring_send_done(conn, op, cqe->res);
+        break;
+    }
+    if (conn->state != CONN_CLOSED) run_connection(conn, docroot);
+    if (conn->state == CONN_CLOSED) {
+        timer_del(wheel, &conn->timer);
+        if (conn->inflight == 0) free_connection(conn);
+        return;
+    }
+    // 動きがあったのでタイムアウトを延ばす
+    timer_add(wheel, &conn->timer, now + keepalive_timeout * 1000L);
+}
+
+static void uring_arm_accept(int server_fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    uring_prep(sqe, IORING_OP_ACCEPT, server_fd, NULL, URING_ACCEPT);
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+static void uring_arm_notify(void)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    uring_prep(sqe, IORING_OP_POLL_ADD, file_cache.inotify_fd, NULL, URING_NOTIFY);
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+static void uring_arm_recv(struct Connection *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    uring_prep(sqe, IORING_OP_RECV, conn->fd, conn, URING_RECV);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    conn->recving = 1;
+}
+
+// 受け取ったバッファを接続のリストにつなぐ
+static void uring_recv_done(struct Connection *conn, struct io_uring_cqe *cqe)
+{
+    struct UringBuf *b;
+    int bid;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->recving = 0;
+        conn->inflight--;
+    }
+    if (cqe->res > 0) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (conn->state == CONN_CLOSED) {
+            uring_recycle_buf(bid);
+            return;
+        }
+        b = &uring->meta[bid];
+        b->len = cqe->res;
+        b->off = 0;
+        b->next = -1;
+        if (conn->rx_tail >= 0)
+            uring->meta[conn->rx_tail].next = bid;
+        else
+            conn->rx_head = bid;
+        conn->rx_tail = bid;
+    }
+    else if (cqe->res == 0)
+        conn->rx_eof = 1;
+    else if (cqe->res != -ENOBUFS) // バッファが尽きたときは次に読むときに投入し直す
+        conn->rx_errno = -cqe->res;
+}
+
+// read(2)の代わりに、受信済みのバッファからbufへ移す
+// 何も届いていなければEAGAINを返し、recvが止まっていれば投入し直す
+static ssize_t uring_recv(struct Connection *conn, char *buf, size_t len)
+{
+    struct UringBuf *b;
+    size_t n = 0, k;
+    int bid;
+
+    while (n < len && conn->rx_head >= 0) {
+        bid = conn->rx_head;
+        b = &uring->meta[bid];
+        k = b->len - b->off;
+        if (k > len - n) k = len - n;
+        memcpy(buf + n, uring->bufs + (size_t)bid * URING_BUF_SIZE + b->off, k);
+        b->off += k;
+        n += k;
+        if (b->off == b->len) {
+            conn->rx_head = b->next;
+            if (conn->rx_head < 0) conn->rx_tail = -1;
+            uring_recycle_buf(bid);
+        }
+    }
+    if (n > 0) return n;
+    if (conn->rx_eof) return 0;
+    if (conn->rx_errno) {
+        errno = conn->rx_errno;
+        return -1;
+    }
+    if (!conn->recving) uring_arm_recv(conn);
+    errno = EAGAIN;
+    return -1;
+}
+
+// レスポンスの残りを送る操作を1つ投入する(1つの接続で同時に1つまで)
+static int uring_send(struct Connection *conn)
+{
+    struct Response *res = &conn->res;
+    struct io_uring_sqe *sqe;
+    size_t head_rest = res->head.len - res->sent;
+    size_t len;
+
+    if (conn->sending) return 0;
+    // io_uringにはsendfileがないので、ファイルはパイプを経由してspliceする
+    if (head_rest == 0 && !res->body_mem && conn->pipefd[0] < 0) {
+        if (pipe2(conn->pipefd, O_CLOEXEC) < 0) {
+            close_connection(conn);
+            return 1;
+        }
+    }
+    sqe = uring_get_sqe();
+    if (head_rest > 0 && res->body_mem && res->body_length > 0) {
+        conn->iov[0].iov_base = res->head.ptr + res->sent;
+        conn->iov[0].iov_len = head_rest;
+        conn->iov[1].iov_base = res->body_mem + res->body_offset;
+        conn->iov[1].iov_len = res->body_length;
+        memset(&conn->msg, 0, sizeof conn->msg);
+        conn->msg.msg_iov = conn->iov;
+        conn->msg.msg_iovlen = 2;
+        uring_prep(sqe, IORING_OP_SENDMSG, conn->fd, conn, URING_SEND);
+        sqe->addr = (unsigned long)&conn->msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    else if (head_rest > 0) {
+        uring_prep(sqe, IORING_OP_SEND, conn->fd, conn, URING_SEND);
+        sqe->addr = (unsigned long)(res->head.ptr + res->sent);
+        sqe->len = head_rest;
+        // ファイルのボディが続くならヘッダだけのパケットを出さない
+        sqe->msg_flags = MSG_NOSIGNAL | (res->body_length > 0 ? MSG_MORE : 0);
+    }
+    else if (res->body_mem) {
+        uring_prep(sqe, IORING_OP_SEND, conn->fd, conn, URING_SEND);
+        sqe->addr = (unsigned long)(res->body_mem + res->body_offset);
+        sqe->len = res->body_length;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    else if (conn->piped > 0) {
+        uring_prep(sqe, IORING_OP_SPLICE, conn->fd, conn, URING_SPLICE_OUT);
+        sqe->splice_fd_in = conn->pipefd[0];
+        sqe->splice_off_in = (__u64)-1;
+        sqe->off = (__u64)-1;
+        sqe->len = conn->piped;
+    }
+    else {
+        len = res->body_length < URING_SPLICE_CHUNK ? res->body_length : URING_SPLICE_CHUNK;
+        uring_prep(sqe, IORING_OP_SPLICE, conn->pipefd[1], conn, URING_SPLICE_IN);
+        sqe->splice_fd_in = res->body_fd;
+        sqe->splice_off_in = res->body_offset;
+        sqe->off = (__u64)-1;
+        sqe->len = len;
+    }
+    conn->sending = 1;
+    return 0;
+}
+
+// 送信の完了ぶんだけレスポンスを進める(run_connectionは呼び出し側で行う)
+static void uring_send_done(struct Connection *conn, enum UringOp op, int n)
+{
+    struct Response *res = &conn->res;
+    size_t k;
+
+    conn->sending = 0;
+    conn->inflight--;
+    if (conn->state == CONN_CLOSED) return;
+    if (n == -EINTR || n == -EAGAIN) return; // 次のrun_connectionで投入し直す
+    if (n <= 0) { // 0はファイルが途中で縮んだか、相手が閉じた
+        close_connection(conn);
+        return;
+    }
+    switch (op) {
+    case URING_SEND:
+        k = res->head.len - res->sent;
+        if (k > (size_t)n) k = n;
+        res->sent += k;
+        res->body_offset += n - k;
+        res->body_length -= n - k;
+        break;
+    case URING_SPLICE_IN:
+        conn->piped += n;
+        res->body_offset += n;
+        res->body_length -= n;
+        break;
+    case URING_SPLICE_OUT:
+        conn->piped -= n;
+        break;
+    default:
+        break;
+    }
+}
+
+// 接続を閉じるときに、まだ取り出していないバッファをリングに返す
+static void uring_release_bufs(struct Connection *conn)
+{
+    int bid, next;
+
+    for (bid = conn->rx_head; bid >= 0; bid = next) {
+        next = uring->meta[bid].next;
+        uring_recycle_buf(bid);
+    }
+    conn->rx_head = conn->rx_tail = -1;
+}
+
+static void uring_recycle_buf(int bid)
+{
+    struct io_uring_buf *buf;
+
+    buf = &uring->buf_ring->bufs[uring->buf_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (unsigned long)(uring->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    uring->buf_tail++;
+    __atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/****** Stats ************************************************************/
+
+// ワーカーが書き込み、/__statsを返すワーカーが読むので、fork前に共有メモリに取る
+static void init_stats(int nslots)
+{
+    void *p;
+
+    p = mmap(NULL, sizeof(struct WorkerStats) * nslots, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) log_exit("mmap(2) failed: %s", strerror(errno));
+    stats_area = p;
+    stats_nslots = nslots;
+    stats = &stats_area[0];
+}
+
+// fork版では同じワーカーの子プロセスどうしが同じ領域に書くので、ロックなしのアトミック加算にする
+static void stats_add(unsigned long *counter, long n)
+{
+    __atomic_fetch_add(counter, (unsigned long)n, __ATOMIC_RELAXED);
+}
+
+static void stats_record(struct StatsHistogram *hist, long ns)
+{
+    if (ns < 0) ns = 0;
+    stats_add(&hist->buckets[stats_hist_index(ns)], 1);
+    stats_add(&hist->count, 1);
+    stats_add(&hist->sum, ns);
+}
+
+static void stats_count_response(int status, size_t bytes)
+{
+    stats_add(&stats->requests, 1);
+    stats_add(&stats->bytes, bytes);
+    if (status >= STATS_MIN_STATUS && status < STATS_MIN_STATUS + STATS_NSTATUS)
+        stats_add(&stats->status[status - STATS_MIN_STATUS], 1);
+}
+
+// 全ワーカーの統計を足し合わせてPrometheusのテキスト形式で返す
+static void stats_response(struct HTTPRequest *req, struct Response *out)
+{
+    struct WorkerStats *total = xmalloc(sizeof(struct WorkerStats)); // スタックに置くには大きい
+    unsigned long *dst = (unsigned long *)total;
+    struct Response body;
+    size_t i, n = sizeof(struct WorkerStats) / sizeof(unsigned long);
+    int w;
+
+    memset(total, 0, sizeof *total);
+    for (w = 0; w < stats_nslots; w++) {
+        unsigned long *src = (unsigned long *)&stats_area[w];
+
+        for (i = 0; i < n; i++)
+            dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+
+    body.head.ptr = NULL;
+    body.head.len = body.head.capa = 0;
+    output_stats_metric(&body, "httpd2_workers", "gauge", "Number of worker processes.");
+    out_printf(&body, "httpd2_workers %d\n", stats_nslots);
+    output_stats_metric(&body, "httpd2_connections_total", "counter", "Accepted connections.");
+    out_printf(&body, "httpd2_connections_total %lu\n", total->connections);
+    output_stats_metric(&body, "httpd2_active_connections", "gauge", "Connections currently open.");
+    out_printf(&body, "httpd2_active_connections %ld\n", (long)total->active_connections);
+    output_stats_metric(&body, "httpd2_requests_total", "counter", "Requests answered.");
+    out_printf(&body, "httpd2_requests_total %lu\n", total->requests);
+    output_stats_metric(&body, "httpd2_response_bytes_total", "counter", "Response bytes (header and body).");
+    out_printf(&body, "httpd2_response_bytes_total %lu\n", total->bytes);
+    output_stats_metric(&body, "httpd2_responses_total", "counter", "Responses by status code.");
+    for (i = 0; i < STATS_NSTATUS; i++) {
+        if (total->status[i])
+            out_printf(&body, "httpd2_responses_total{code=\"%d\"} %lu\n", (int)i + STATS_MIN_STATUS, total->status[i]);
+    }
+    output_stats_metric(&body, "httpd2_file_cache_hits_total", "counter", "File lookups served from the file cache.");
+    out_printf(&body, "httpd2_file_cache_hits_total %lu\n", total->file_cache_hits);
+    output_stats_metric(&body, "httpd2_file_cache_misses_total", "counter", "File lookups that had to stat and open.");
+    out_printf(&body, "httpd2_file_cache_misses_total %lu\n", total->file_cache_misses);
+    output_stats_metric(&body, "httpd2_response_cache_hits_total", "counter", "Responses sent from the in-memory response cache.");
+    out_printf(&body, "httpd2_response_cache_hits_total %lu\n", total->response_cache_hits);
+    output_stats_metric(&body, "httpd2_response_cache_misses_total", "counter", "Cacheable responses that were not in memory.");
+    out_printf(&body, "httpd2_response_cache_misses_total %lu\n", total->response_cache_misses);
+    output_stats_metric(&body, "httpd2_access_log_records_total", "counter", "Access log records written.");
+    out_printf(&body, "httpd2_access_log_records_total %lu\n", total->access_log_records);
+    output_stats_metric(&body, "httpd2_access_log_dropped_total", "counter", "Access log records dropped because the ring was full.");
+    out_printf(&body, "httpd2_access_log_dropped_total %lu\n", total->access_log_dropped);
+    output_stats_metric(&body, "httpd2_request_body_bytes_total", "counter", "Request body bytes received, after chunked decoding.");
+    out_printf(&body, "httpd2_request_body_bytes_total %lu\n", total->request_body_bytes);
+    output_stats_metric(&body, "httpd2_rejected_connections_total", "counter", "Connections closed with 503 because of --max-conns or fd exhaustion.");
+    out_printf(&body, "httpd2_rejected_connections_total %lu\n", total->rejected_connections);
+    output_stats_summary(&body, "httpd2_parse_duration_seconds", "Time spent parsing request headers.", &total->parse);
+    output_stats_summary(&body, "httpd2_stat_duration_seconds", "Time spent looking up the requested file.", &total->stat);
+    output_stats_summary(&body, "httpd2_send_duration_seconds", "Time from building a response to sending its last byte.", &total->send);
+
+    output_common_header_fields(req, out, "200 OK");
+    out_puts(out, "Content-Length: ");
+    out_long(out, body.head.len);
+    out_puts(out, "\r\nContent-Type: text/plain; version=0.0.4\r\nCache-Control: no-store\r\n\r\n");
+    if (strcmp(REQ_STR(req, req->method), "HEAD") != 0)
+        out_write(out, body.head.ptr, body.head.len);
+    free(body.head.ptr);
+    free(total);
+}
+
+static void output_stats_metric(struct Response *out, char *name, char *type, char *help)
+{
+    out_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// ヒストグラムからパーセンタイルを出してsummaryとして出力する
+static void output_stats_summary(struct Response *out, char *name, char *help, struct StatsHistogram *hist)
+{
+    static double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    unsigned long target, seen;
+    size_t q;
+    int i;
+
+    output_stats_metric(out, name, "summary", help);
+    for (q = 0; q < sizeof quantiles / sizeof quantiles[0]; q++) {
+        unsigned long v = 0;
+
+        if (hist->count > 0) {
+            target = (unsigned long)(quantiles[q] * hist->count);
+            if (target < 1) target = 1;
+            for (i = 0, seen = 0; i < STATS_HIST_BUCKETS; i++) {
+                seen += hist->buckets[i];
+                if (seen >= target) break;
+            }
+            v = stats_hist_upper(i < STATS_HIST_BUCKETS ? i : STATS_HIST_BUCKETS - 1);
+        }
+        out_printf(out, "%s{quantile=\"%g\"} %.9f\n", name, quantiles[q], v / 1e9);
+    }
+    out_printf(out, "%s_sum %.9f\n", name, hist->sum / 1e9);
+    out_printf(out, "%s_count %lu\n", name, hist->count);
+}
+
+static int stats_hist_index(unsigned long v)
+{
+    int shift, idx;
+
+    if (v < 2 * STATS_HIST_SUB) return v;
+    // 最上位ビットで区間を決め、その下STATS_HIST_SUB_BITSビットで区間内の位置を決める
+    shift = 63 - __builtin_clzl(v) - STATS_HIST_SUB_BITS;
+    idx = STATS_HIST_SUB * shift + (int)(v >> shift);
+    return idx < STATS_HIST_BUCKETS ? idx : STATS_HIST_BUCKETS - 1;
+}
+
+// バケットに入る値の上限
+static unsigned long stats_hist_upper(int idx)
+{
+    int shift;
+
+    if (idx < 2 * STATS_HIST_SUB) return idx;
+    shift = idx / STATS_HIST_SUB - 1;
+    return ((unsigned long)(idx - STATS_HIST_SUB * shift) << shift) + (1UL << shift) - 1;
+}
+
+/****** Access Log *******************************************************/
+
+// chroot前に開いておく。SIGHUPで開き直すときも同じパスを使う(chrootしたらその中のパス)
+static void init_access_log(char *path)
+{
+    access_log_path = path;
+    access_log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (access_log_fd < 0) log_exit("failed to open access log %s: %s", path, strerror(errno));
+}
+
+// epoll版・io_uring版: ワーカーごとにリングと書き出しスレッドを用意する
+// --threads: リングはプールのスレッドごとに作り(ACCESS_LOG_RING_SIZEを分ける)、1つの書き出しスレッドが読む
+// イベントループはリングに詰めるだけで、ログのためにシステムコールを呼ばない
+static void start_access_log_thread(int nrings)
+{
+    sigset_t all, old;
+    pthread_t thread;
+    size_t size = ACCESS_LOG_RING_SIZE;
+    int i, err;
+
+    while (size > ACCESS_LOG_MIN_RING_SIZE && size * nrings > ACCESS_LOG_RING_SIZE) size /= 2;
+    access_log_rings = xmalloc(sizeof(struct LogRing*) * nrings);
+    for (i = 0; i < nrings; i++) {
+        access_log_rings[i] = xmalloc(sizeof(struct LogRing) + sizeof(struct LogRecord) * size);
+        access_log_rings[i]->head = access_log_rings[i]->tail = 0;
+        access_log_rings[i]->mask = size - 1;
+    }
+    naccess_log_rings = nrings;
+    // シグナルはイベントループのスレッドで受ける(epoll_waitなどをEINTRで起こすため)
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&thread, NULL, access_log_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) log_exit("pthread_create(3) failed: %s", strerror(err));
+    pthread_detach(thread);
+}
+
+static void request_log_reopen(int sig)
+{
+    log_reopen_requested = 1;
+}
+
+// マスターはSIGHUPをワーカーに配る
+static void forward_log_reopen(int sig)
+{
+    int i;
+
+    for (i = 0; i < nworker_pids; i++) {
+        if (worker_pids[i] > 0) kill(worker_pids[i], SIGHUP);
+    }
+}
+
+// ローテーションで移されたファイルを手放し、同じパスに作り直す
+// fd番号は変えないので、書き込み中の相手がいても古いか新しいかどちらかのファイルに書かれる
+static void reopen_access_log(void)
+{
+    int fd;
+
+    fd = open(access_log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        syslog(LOG_WARNING, "failed to reopen access log %s: %s", access_log_path, strerror(errno));
+        return;
+    }
+    dup3(fd, access_log_fd, O_CLOEXEC);
+    close(fd);
+}
+
+// レスポンスを作るたびに呼ばれる。リングが一杯なら待たずに捨てて数える
+static void access_log(struct Connection *conn, struct HTTPRequest *req, int status, size_t bytes)
+{
+    struct LogRing *ring = access_log_ring;
+    struct LogRecord rec;
+    unsigned long tail;
+    char buf[LINE_BUF_SIZE];
+
+    if (access_log_fd < 0) return;
+    if (!ring) { // 接続ごとにforkする版: O_APPENDの1回のwriteで1行ずつ書く
+        fill_log_record(&rec, conn, req, status, bytes);
+        write_access_log(buf, format_log_record(&rec, buf));
+        stats_add(&stats->access_log_records, 1);
+        return;
+    }
+    tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask) {
+        stats_add(&stats->access_log_dropped, 1);
+        return;
+    }
+    fill_log_record(&ring->records[tail & ring->mask], conn, req, status, bytes);
+    // tailを進めてからsleepingを見る。書き出しスレッドは逆の順で見るので、どちらかが必ず気づく
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&access_log_sleeping, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&access_log_sleeping, 0, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &access_log_sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+static void fill_log_record(struct LogRecord *rec, struct Connection *conn, struct HTTPRequest *req, int status, size_t bytes)
+{
+    // 相手のアドレスは接続ごとに一度だけ調べる
+    if (!conn->peer[0]) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof addr;
+
+        if (getpeername(conn->fd, (struct sockaddr *)&addr, &addrlen) < 0
+            || getnameinfo((struct sockaddr *)&addr, addrlen, conn->peer, sizeof conn->peer,
+                           NULL, 0, NI_NUMERICHOST) != 0)
+            strcpy(conn->peer, "-");
+        // デュアルスタックのソケットではIPv4の相手が::ffff:a.b.c.dになるので、元の形に戻す
+        if (strncmp(conn->peer, "::ffff:", 7) == 0 && strchr(conn->peer, '.'))
+            memmove(conn->peer, conn->peer + 7, strlen(conn->peer + 7) + 1);
+    }
+    current_http_date();
+    rec->time = http_date_time;
+    rec->bytes = bytes;
+    rec->status = status;
+    memcpy(rec->addr, conn->peer, sizeof rec->addr);
+    if (!req) { // パースできなかったリクエスト
+        rec->minor_version = 0;
+        rec->method[0] = rec->path[0] = '\0';
+        return;
+    }
+    rec->minor_version = req->protocol_minor_version;
+    copy_log_field(rec->method, REQ_STR(req, req->method), sizeof rec->method);
+    copy_log_field(rec->path, REQ_STR(req, req->path), sizeof rec->path);
+}
+
+// 書き出しスレッド: リングに溜まったレコードを整形し、大きなwrite(2)にまとめて書く
+// --threadsではすべてのスレッドのリングを順に読み、同じバッファにまとめる
+static void* access_log_main(void *arg)
+{
+    struct timespec wait = {1, 0}; // SIGHUPに気づくために空でもときどき起きる
+    struct timespec interval = {0, ACCESS_LOG_FLUSH_MSEC * 1000000L};
+    char *buf = xmalloc(ACCESS_LOG_BUF_SIZE);
+    unsigned long *heads = xmalloc(sizeof(unsigned long) * naccess_log_rings);
+    unsigned long tail, n;
+    size_t len;
+    int i, j;
+
+    for (;;) {
+        if (log_reopen_requested) {
+            log_reopen_requested = 0;
+            reopen_access_log();
+        }
+        if (!access_log_pending()) {
+            __atomic_store_n(&access_log_sleeping, 1, __ATOMIC_SEQ_CST);
+            if (!access_log_pending())
+                syscall(SYS_futex, &access_log_sleeping, FUTEX_WAIT_PRIVATE, 1, &wait, NULL, 0);
+            __atomic_store_n(&access_log_sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        len = 0;
+        n = 0;
+        // headは書き出してから進める(flush_access_log()はheadが追いつくのを待つ)
+        for (i = 0; i < naccess_log_rings; i++) {
+            struct LogRing *ring = access_log_rings[i];
+
+            tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+            for (heads[i] = ring->head; heads[i] != tail; heads[i]++, n++) {
+                len += format_log_record(&ring->records[heads[i] & ring->mask], buf + len);
+                if (len > ACCESS_LOG_BUF_SIZE - LINE_BUF_SIZE) {
+                    write_access_log(buf, len);
+                    len = 0;
+                    for (j = 0; j < i; j++)
+                        __atomic_store_n(&access_log_rings[j]->head, heads[j], __ATOMIC_RELEASE);
+                    __atomic_store_n(&ring->head, heads[i] + 1, __ATOMIC_RELEASE);
+                }
+            }
+        }
+        if (len > 0) write_access_log(buf, len);
+        for (i = 0; i < naccess_log_rings; i++)
+            __atomic_store_n(&access_log_rings[i]->head, heads[i], __ATOMIC_RELEASE);
+        stats_add(&stats->access_log_records, n);
+        // 続けて届くレコードを少し溜めてから書く
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+// どれかのリングに書き出していないレコードがあれば1を返す
+static int access_log_pending(void)
+{
+    int i;
+
+    for (i = 0; i < naccess_log_rings; i++) {
+        if (__atomic_load_n(&access_log_rings[i]->tail, __ATOMIC_SEQ_CST) != access_log_rings[i]->head)
+            return 1;
+    }
+    return 0;
+}
+
+// 終了する前に、リングに残ったレコードを書き出しスレッドが書き終えるのを待つ
+static void flush_access_log(void)
+{
+    struct timespec interval = {0, ACCESS_LOG_FLUSH_MSEC * 1000000L};
+
+    while (access_log_pending())
+        nanosleep(&interval, NULL);
+}
+
+// Common Log Formatの1行にする。bufにはLINE_BUF_SIZEの空きがあること
+static size_t format_log_record(struct LogRecord *rec, char *buf)
+{
+    static __thread time_t cached_time = -1;
+    static __thread char cached_date[32]; // "16/Oct/2026:08:21:46 +0000"
+    struct tm tm;
+
+    if (rec->time != cached_time) {
+        gmtime_r(&rec->time, &tm);
+        strftime(cached_date, sizeof cached_date, "%d/%b/%Y:%H:%M:%S +0000", &tm);
+        cached_time = rec->time;
+    }
+    if (!rec->method[0]) // リクエストラインが読めなかったときは"-"にする
+        return snprintf(buf, LINE_BUF_SIZE, "%s - - [%s] \"-\" %d %ld\n",
+                        rec->addr, cached_date, rec->status, rec->bytes);
+    return snprintf(buf, LINE_BUF_SIZE, "%s - - [%s] \"%s %s HTTP/1.%d\" %d %ld\n",
+                    rec->addr, cached_date, rec->method, rec->path, rec->minor_version,
+                    rec->status, rec->bytes);
 }
 
-static void server_main(int server_fd, char *docroot)
+// ログの行を壊さないよう、制御文字と'"'は'?'に置き換えて、maxバイトに収まるだけ写す
+static size_t copy_log_field(char *dst, char *src, size_t max)
 {
-    for (;;) {
-        struct sockaddr_storage addr;
-        socklen_t addrlen = sizeof addr;
-        int sock;
-        int pid;
-
-        /* この関数は、接続待ちソケット socket 宛ての保留状態の接続要求が入っているキューから
-           先頭の接続要求を取り出し、接続済みソケットを新規に生成し、 
-           そのソケットを参照する新しいファイルディスクリプターを返す。 */
-        sock = accept(server_fd, (struct sockaddr*)&addr, &addrlen); // 
-        if (sock < 0) log_exit("accept(2) failed: %s", strerror(errno));
-        
-        pid = fork();
-        if (pid < 0) exit(3); // fork失敗時
-        if (pid == 0) {
-            // 子プロセス
-            FILE *inf = fdopen(sock, "r");
-            FILE *outf = fdopen(sock, "w");
-
-            service(inf, outf, docroot);
-            exit(0);
+    size_t i;
+
+    for (i = 0; i + 1 < max && src[i]; i++)
+        dst[i] = ((unsigned char)src[i] < 0x20 || src[i] == '"' || src[i] == 0x7f) ? '?' : src[i];
+    dst[i] = '\0';
+    return i;
+}
+
+static void write_access_log(char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(access_log_fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return; // ディスクが一杯などで書けないぶんは捨てる
         }
-        close(sock); // 親プロセスと結びついたままの接続済みソケットをclose 図17.2
+        buf += n;
+        len -= n;
     }
 }
 
-static int listen_socket(char *port)
+/****** Compression ******************************************************/
+
+// --compress: テキストのファイルをgzipで圧縮して、圧縮したボディをキャッシュする
+// 大きなファイルの圧縮で他の接続を待たせないよう、圧縮は専用のスレッドで行う
+static void start_compressor(void)
 {
-    struct addrinfo hints, *res, *ai;
+    sigset_t all, old;
+    pthread_t thread;
     int err;
 
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET; // IPv4
-    hints.ai_socktype = SOCK_STREAM; // TCP
-    hints.ai_flags = AI_PASSIVE; // ソケットをサーバ用として使う
+    compress_cache = xmalloc(sizeof(struct CompressCache));
+    memset(compress_cache, 0, sizeof(struct CompressCache));
+    pthread_mutex_init(&compress_cache->lock, NULL);
+    pthread_cond_init(&compress_cache->queued, NULL);
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&thread, NULL, compressor_main, compress_cache);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) log_exit("pthread_create(3) failed: %s", strerror(err));
+    pthread_detach(thread);
+}
 
-    // サーバ側のときはプロセスが動作しているそのホストのアドレス構造体をgetaddrinfo()で得る
-    if ((err = getaddrinfo(NULL, port, &hints, &res)) != 0)
-        log_exit(gai_strerror(err));
+static void* compressor_main(void *arg)
+{
+    struct CompressCache *cache = arg;
+    struct CompressedBody *c;
 
-    // hintsに当てはまるアドレス構造体のリストresの要素に対してsocket, bind, listenして、成功した最初のアドレスを使う
-    for (ai = res; ai; ai = ai->ai_next) {
-        int sock;
+    for (;;) {
+        pthread_mutex_lock(&cache->lock);
+        while (!cache->qhead)
+            pthread_cond_wait(&cache->queued, &cache->lock);
+        c = cache->qhead;
+        cache->qhead = c->qnext;
+        if (!cache->qhead) cache->qtail = NULL;
+        cache->nqueued--;
+        pthread_mutex_unlock(&cache->lock);
+        compress_file(c);
+    }
+    return NULL;
+}
 
-        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol); // 通信のためのエンドポイントを作成
-        if (sock < 0) continue;
-        if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0) { // ソケットに名前をつける
-            close(sock);
-            continue;
-        }
-        // BACKLOGは、保留中の接続のキューの最大長
-        if (listen(sock, MAX_BACKLOG) < 0) { // ソケット上の接続を待つ
-            close(sock);
-            continue;
+// infoのファイルを圧縮したボディがあれば参照を増やして返す
+// なければ圧縮を頼んでNULLを返す(圧縮しても小さくならないファイルもNULL)
+static struct CompressedBody* lookup_compressed(struct FileInfo *info)
+{
+    struct CompressCache *cache = compress_cache;
+    struct CompressedBody *c;
+    size_t h = hash_string(info->path) & (COMPRESS_CACHE_BUCKETS - 1);
+
+    pthread_mutex_lock(&cache->lock);
+    for (c = cache->table[h]; c; c = c->hnext) {
+        if (strcmp(c->path, info->path) != 0) continue;
+        if (strcmp(c->etag, info->etag) == 0) {
+            if (c->ready && c != cache->head) { // LRUの先頭へ
+                c->prev->next = c->next;
+                if (c->next) c->next->prev = c->prev;
+                else cache->tail = c->prev;
+                c->prev = NULL;
+                c->next = cache->head;
+                cache->head->prev = c;
+                cache->head = c;
+            }
+            if (!c->ready || !c->data) c = NULL; // 圧縮中, または圧縮しない
+            else c->refcnt++;
+            pthread_mutex_unlock(&cache->lock);
+            return c;
         }
-        freeaddrinfo(res);
-        return sock;
+        // ファイルが変わったので古い版は捨てて圧縮し直す
+        unlink_compressed(c);
+        break;
     }
-    log_exit("failed to listen socket");
-    return -1; /* NOT REACH */
+    if (cache->nqueued < COMPRESS_QUEUE_MAX) {
+        c = xmalloc(sizeof(struct CompressedBody));
+        c->path = xmalloc(strlen(info->path) + 1);
+        strcpy(c->path, info->path);
+        strcpy(c->etag, info->etag);
+        c->data = NULL;
+        c->len = 0;
+        c->cost = 0;
+        c->ready = 0;
+        c->cached = 1;
+        c->refcnt = 2; // キャッシュとキューからの参照
+        c->prev = c->next = c->qnext = NULL;
+        c->hnext = cache->table[h];
+        cache->table[h] = c;
+        if (cache->qtail) cache->qtail->qnext = c;
+        else cache->qhead = c;
+        cache->qtail = c;
+        cache->nqueued++;
+        pthread_cond_signal(&cache->queued);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
 }
 
-static void become_daemon(void)
+// 圧縮スレッド: ファイルを読んで圧縮し、キャッシュに入れる
+static void compress_file(struct CompressedBody *c)
 {
-    int n;
+    struct CompressCache *cache = compress_cache;
+    struct stat st;
+    char etag[ETAG_LEN];
+    char *src = NULL, *data = NULL;
+    size_t len = 0;
+    ssize_t n;
+    off_t off;
+    int fd;
 
-    // ルートディレクトリに移動
-    if (chdir("/") < 0)
-        log_exit("chdir(2) failed: %s", strerror(errno));
-    
-    // 標準入出力を/dev/nullにつなぐ
-    // freopen: path で指定された名前のファイルを開き、ストリームと結びつける
-    freopen("/dev/null", "r", stdin);
-    freopen("/dev/null", "w", stdout);
-    freopen("/dev/null", "w", stderr);
+    // 失敗しても圧縮しないエントリとして残し、同じファイルを毎回キューに積み直さない
+    // ファイルが変わればETagが合わなくなり、lookup_compressed()で捨てて頼み直す
+    fd = open(c->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size > COMPRESS_MAX_SIZE) goto done;
+    format_etag(&st, etag);
+    if (strcmp(etag, c->etag) != 0) goto done; // 頼まれた後で変わった
+    src = xmalloc(st.st_size + 1);
+    for (off = 0; off < st.st_size; off += n) {
+        n = pread(fd, src + off, st.st_size - off, off);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+        if (n <= 0) goto done;
+    }
+    close(fd);
+    fd = -1;
+    data = gzip_compress(src, st.st_size, &len);
+    free(src);
+    src = NULL;
+    if (data && len >= (size_t)st.st_size) { // 小さくならないなら元のまま送る
+        free(data);
+        data = NULL;
+        len = 0;
+    }
 
-    n = fork();
-    if (n < 0) log_exit("fork(2) failed: %s", strerror(errno));
-    if (n != 0) _exit(0); /* 親プロセスは終了する */
-    if (setsid() < 0) log_exit("setsid(2) failed: %s", strerror(errno));
+done:
+    if (fd >= 0) close(fd);
+    free(src);
+    pthread_mutex_lock(&cache->lock);
+    c->data = data;
+    c->len = len;
+    c->ready = 1;
+    if (c->cached) insert_compressed(c);
+    pthread_mutex_unlock(&cache->lock);
+    release_compressed(c); // キューからの参照
 }
 
-// rootに与えられたディレクトリをルートディレクトリとして設定
-static void setup_environment(char *root, char *user, char *group)
+// 圧縮が済んだcをLRUの先頭に入れる(lockを取った状態で呼ぶ)
+// 上限を超えるなら、送信中でないものから古い順に捨てる
+static void insert_compressed(struct CompressedBody *c)
 {
-    struct passwd *pw;
-    struct group *gr;
+    struct CompressCache *cache = compress_cache;
+    struct CompressedBody *f, *prev;
 
-    if (!user || !group) {
-        fprintf(stderr, "use both of --user and --group\n");
-        exit(1);
+    c->cost = sizeof(struct CompressedBody) + strlen(c->path) + 1 + c->len;
+    for (f = cache->tail; f && cache->mem_used + c->cost > COMPRESS_CACHE_MAX; f = prev) {
+        prev = f->prev;
+        if (f->refcnt == 1) unlink_compressed(f);
     }
-    gr = getgrnam(group);
-    if (!gr) {
-        fprintf(stderr, "no such group: %s\n", group);
-        exit(1);
+    c->prev = NULL;
+    c->next = cache->head;
+    if (cache->head) cache->head->prev = c;
+    else cache->tail = c;
+    cache->head = c;
+    cache->mem_used += c->cost;
+    if (cache->mem_used > COMPRESS_CACHE_MAX) unlink_compressed(c);
+}
+
+// lenバイトをgzip形式で圧縮して返す, 失敗したらNULL
+static char* gzip_compress(char *src, size_t len, size_t *out_len)
+{
+    z_stream z;
+    char *dst;
+    size_t capa;
+
+    memset(&z, 0, sizeof z);
+    // windowBitsに16を足すとzlibではなくgzipのヘッダになる
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+    capa = deflateBound(&z, len);
+    dst = xmalloc(capa);
+    z.next_in = (Bytef *)src;
+    z.avail_in = len;
+    z.next_out = (Bytef *)dst;
+    z.avail_out = capa;
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&z);
+        free(dst);
+        return NULL;
     }
-    // 自プロセスの実グループIDと実効グループIDをgr->gr_gidに変更
-    if (setgid(gr->gr_gid) < 0) {
-        perror("setgid(2)");
-        exit(1);
+    *out_len = z.total_out;
+    deflateEnd(&z);
+    return dst;
+}
+
+// キャッシュから外す(lockを取った状態で呼ぶ)
+// 送信中のレスポンスが使っているかもしれないので、解放は参照がなくなってから
+static void unlink_compressed(struct CompressedBody *c)
+{
+    struct CompressCache *cache = compress_cache;
+    struct CompressedBody **pp;
+
+    if (!c->cached) return;
+    c->cached = 0;
+    for (pp = &cache->table[hash_string(c->path) & (COMPRESS_CACHE_BUCKETS - 1)]; *pp; pp = &(*pp)->hnext) {
+        if (*pp == c) {
+            *pp = c->hnext;
+            break;
+        }
     }
-    // userが所属しているグループを自プロセスに設定, gr->gr_gidに設定
-    if (initgroups(user, gr->gr_gid) < 0) {
-        perror("initgroups(2)");
-        exit(1);
+    if (c->ready) { // LRUリストに入っている
+        if (c->prev) c->prev->next = c->next;
+        else cache->head = c->next;
+        if (c->next) c->next->prev = c->prev;
+        else cache->tail = c->prev;
+        cache->mem_used -= c->cost;
     }
-    pw = getpwnam(user);
-    if (!pw) {
-        fprintf(stderr, "no such user: %s\n", user);
-        exit(1);
+    if (--c->refcnt == 0) {
+        free(c->data);
+        free(c->path);
+        free(c);
     }
-    
-    // 呼び出し元プロセスのルートディレクトリを root で指定されたディレクトリに変更
-    chroot(root);
+}
 
-    // 自プロセスの実グループIDと実効グループIDをpw->pw_uidに変更
-    if (setuid(pw->pw_uid) < 0) {
-        perror("setuid(2)");
-        exit(1);
+static void release_compressed(struct CompressedBody *c)
+{
+    pthread_mutex_lock(&compress_cache->lock);
+    if (--c->refcnt == 0) {
+        free(c->data);
+        free(c->path);
+        free(c);
     }
+    pthread_mutex_unlock(&compress_cache->lock);
 }
 
-static void service(FILE *in, FILE *out, char *docroot)
+/****** File Cache *******************************************************/
+
+// URLのパスごとに、ファイルシステム上のパス・stat情報・開いたままのfdを覚えておく
+// ヒットすればパスの組み立てもlstat(2)もopen(2)もせずにレスポンスを返せる
+// ファイルの変更はinotify(epoll版)か、FILE_CACHE_TTL_MSECごとのlstat(2)で検出する
+// エントリ数がfile_cache_maxを超えたら最も長く使われていないものから捨てる
+// --threadsではスレッドごとにキャッシュを持つ。エントリ数の上限はスレッドごとだが、
+// メモリに持つレスポンスの上限(--response-cache)はスレッド数で割り、ワーカー全体で超えないようにする
+
+static void init_file_cache(int use_inotify)
 {
-    struct HTTPRequest *req;
+    struct FileCache *cache = &file_cache;
 
-    req = read_request(in);
-    respond_to(req, out, docroot);
-    free_request(req);
+    if (cache->table) return;
+    cache->max = file_cache_max;
+    cache->nbuckets = 1;
+    while (cache->nbuckets < (size_t)cache->max * 2) cache->nbuckets <<= 1;
+    cache->table = xmalloc(sizeof(struct CachedFile*) * cache->nbuckets);
+    cache->wd_table = xmalloc(sizeof(struct CachedFile*) * cache->nbuckets);
+    memset(cache->table, 0, sizeof(struct CachedFile*) * cache->nbuckets);
+    memset(cache->wd_table, 0, sizeof(struct CachedFile*) * cache->nbuckets);
+    cache->head = cache->tail = NULL;
+    cache->n = 0;
+    cache->mem_used = 0;
+    cache->mem_max = cache->max > 0 ? response_cache_size / (nthreads > 0 ? nthreads : 1) : 0;
+    cache->mem_threshold = response_cache_max_file;
+    // inotifyが使えなければ一定時間ごとの確認だけで済ませる
+    cache->inotify_fd = -1;
+    if (use_inotify && cache->max > 0)
+        cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 }
 
-static struct HTTPRequest* read_request(FILE *in)
+// urlpathのファイルを参照カウントを1つ増やして返す, なければNULL
+// 使い終わったらrelease_file()を呼ぶ
+// encodingがENCODING_IDENTITYでなければ圧縮済みの兄弟ファイルを探す
+// 兄弟ファイルのエントリも元のURLのパスで引き、encodingで区別する
+static struct CachedFile* lookup_file(struct Arena *arena, char *docroot, char *urlpath, int encoding)
 {
-    struct HTTPRequest *req;
-    struct HTTPHeaderField *h;
+    struct FileCache *cache = &file_cache;
+    struct CachedFile *file;
+    struct FileInfo *info;
+    struct stat st;
+    size_t h = 0, pathlen, urllen;
+    int fd;
 
-    req = xmalloc(sizeof(struct HTTPRequest));
-    // リクエストラインのパース reqに書き込む
-    read_request_line(req, in);
-    
-    req->header = NULL;
-    while (h = read_header_field(in)) {
-        h->next = req->header;
-        req->header = h;
+    if (cache->max > 0) {
+        h = hash_string(urlpath) & (cache->nbuckets - 1);
+        for (file = cache->table[h]; file; file = file->hnext) {
+            if (strcmp(file->urlpath, urlpath) != 0 || file->info->encoding != encoding) continue;
+            if (file->wd < 0 && file_changed(file)) {
+                drop_file(file);
+                break;
+            }
+            lru_remove(cache, file);
+            lru_push(cache, file);
+            file->refcnt++;
+            stats_add(&stats->file_cache_hits, 1);
+            return file;
+        }
+        stats_add(&stats->file_cache_misses, 1);
     }
-    
-    req->length = content_length(req);
-    if (req->length != 0) {
-        if (req->length > MAX_REQUEST_BODY_LENGTH)
-            log_exit("request body too long");
-        req->body = xmalloc(req->length);
-        if (fread(req->body, req->length, 1, in) < 1)
-            log_exit("failed to read request body");
-    } else {
-        req->body = NULL;
+
+    // 見つからなかったときはアリーナを使っただけで済む
+    info = get_fileinfo(arena, docroot, urlpath, encoding);
+    if (!info->ok) return NULL;
+    // エントリ・FileInfo・2つのパスは1回のmallocにまとめる
+    pathlen = strlen(info->path) + 1;
+    urllen = strlen(urlpath) + 1;
+    file = xmalloc(sizeof(struct CachedFile) + sizeof(struct FileInfo) + pathlen + urllen);
+    file->urlpath = NULL;
+    file->info = (struct FileInfo*)(file + 1);
+    *file->info = *info;
+    file->info->path = (char*)(file->info + 1);
+    memcpy(file->info->path, info->path, pathlen);
+    info = file->info;
+    file->wd = -1;
+    file->refcnt = 1; // 呼び出し元の参照
+    file->variants = encoding == ENCODING_IDENTITY ? -1 : 0;
+    file->checked_at = now_msec();
+    file->mem = NULL;
+    file->mem_len = 0;
+    file->hnext = file->wnext = file->prev = file->next = NULL;
+    // 開く前に監視を始めておけば、その後の変更を取りこぼさない
+    // ディレクトリ(--autoindex)の一覧は名前しか出さないので、エントリの作成・削除・移動だけを見る
+    // (IN_MODIFY/IN_ATTRIBだと中のファイルに書くたびに届き、一覧を作り直してしまう)
+    if (cache->max > 0 && cache->inotify_fd >= 0)
+        file->wd = inotify_add_watch(cache->inotify_fd, info->path, IN_MOVE_SELF | IN_DELETE_SELF
+                                     | (info->is_dir ? IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                                        : IN_MODIFY | IN_ATTRIB));
+    fd = open(info->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        if (file->wd >= 0) inotify_rm_watch(cache->inotify_fd, file->wd);
+        free(file);
+        return NULL;
     }
-    return req;
+    fill_fileinfo(info, &st);
+    file->fd = fd;
+    if (cache->max == 0) return file;
+
+    // キャッシュに入れる
+    if (cache->n >= cache->max) drop_file(cache->tail);
+    file->urlpath = info->path + pathlen;
+    memcpy(file->urlpath, urlpath, urllen);
+    file->hnext = cache->table[h];
+    cache->table[h] = file;
+    if (file->wd >= 0) {
+        size_t w = (size_t)file->wd & (cache->nbuckets - 1);
+
+        file->wnext = cache->wd_table[w];
+        cache->wd_table[w] = file;
+    }
+    lru_push(cache, file);
+    cache->n++;
+    file->refcnt++; // キャッシュからの参照
+    return file;
 }
 
-static void read_request_line(struct HTTPRequest *req, FILE *in)
+static void release_file(struct CachedFile *file)
 {
-    char buf[LINE_BUF_SIZE];
-    char *path, *p;
+    if (--file->refcnt > 0) return;
+    close(file->fd);
+    free(file->mem);
+    free(file); // infoとパスも同じ領域にある
+}
 
-    // 1行読み込み 最大サイズはLINE_BUF_SIZE
-    if (!fgets(buf, LINE_BUF_SIZE, in))
-        log_exit("no request line");
-    
-    // 先頭から' 'を探してその先頭ポインタを返す, なければNULL
-    p = strchr(buf, ' '); /* p (1) */
-    if (!p) log_exit("parse error on request line (1): %s", buf);
-    *p++ = '\0'; // ' 'を'\0'に置換して次のポインタへ
-    req->method = xmalloc(p - buf); // メソッドの文字数分の領域を確保
-    strcpy(req->method, buf);
-    upcase(req->method); // メソッド名を大文字に変換
+// fileをキャッシュから外す
+// 送信中のレスポンスが参照していれば、送り終わるまでfdは閉じない
+static void drop_file(struct CachedFile *file)
+{
+    struct FileCache *cache = &file_cache;
+    struct CachedFile **pp;
+    size_t h = hash_string(file->urlpath) & (cache->nbuckets - 1);
 
-    path = p;
-    p = strchr(path, ' ');  /* p (2) */
-    if (!p) log_exit("parse error on request line(2): %s", buf);
-    *p++ = '\0';
-    req->path = xmalloc(p - path);
-    strcpy(req->path, path);
+    for (pp = &cache->table[h]; *pp != file; pp = &(*pp)->hnext)
+        ;
+    *pp = file->hnext;
+    if (file->wd >= 0) {
+        int shared = 0;
 
-    // strncasecmp: アルファベットの大文字小文字の区別を無視してstr1とstr2を比較
-    if (strncasecmp(p, "HTTP/1.", strlen("HTTP/1.") != 0))
-        log_exit("parse error request line (3): %s", buf);
-    p += strlen("HTTP/1."); /* p (3) */
-    req->protocol_minor_version = atoi(p);
+        // 別のURLのパスが同じファイルを指していればwatchは共有されている
+        for (pp = &cache->wd_table[(size_t)file->wd & (cache->nbuckets - 1)]; *pp; ) {
+            if (*pp == file) {
+                *pp = file->wnext;
+                continue;
+            }
+            if ((*pp)->wd == file->wd) shared = 1;
+            pp = &(*pp)->wnext;
+        }
+        if (!shared) inotify_rm_watch(cache->inotify_fd, file->wd);
+    }
+    lru_remove(cache, file);
+    cache->n--;
+    // memは送信中のレスポンスが使っているかもしれないので、解放はrelease_file()に任せる
+    cache->mem_used -= file->mem_len;
+    file->mem_len = 0;
+    release_file(file);
 }
 
-static struct HTTPHeaderField* read_header_field(FILE *in)
+// inotifyを使っていないエントリについて、前回の確認から時間が経っていればlstat(2)で確かめる
+static int file_changed(struct CachedFile *file)
 {
-    struct HTTPHeaderField *h;
-    char buf[LINE_BUF_SIZE];
-    char *p;
+    struct FileInfo *info = file->info;
+    struct stat st;
+    long now = now_msec();
 
-    // 1行読み込み 最大サイズはLINE_BUF_SIZE
-    if (!fgets(buf, LINE_BUF_SIZE, in))
-        log_exit("failed to read request header field: %s", strerror(errno));
-    if ((buf[0] == '\n') || (strcmp(buf, "\r\n") == 0))
-        return NULL; // 空行だった場合
+    if (now - file->checked_at < FILE_CACHE_TTL_MSEC) return 0;
+    if (lstat(info->path, &st) < 0 || !(info->is_dir ? S_ISDIR(st.st_mode) : S_ISREG(st.st_mode))) return 1;
+    if (st.st_dev != info->dev || st.st_ino != info->ino || st.st_size != info->size
+        || st.st_mtim.tv_sec != info->mtime.tv_sec || st.st_mtim.tv_nsec != info->mtime.tv_nsec)
+        return 1;
+    file->checked_at = now;
+    return 0;
+}
 
-    p = strchr(buf, ':'); // name:value の :
-    if (!p) log_exit("parse error on request header field: %s", buf);
-    *p++ = '\0';
-    h = xmalloc(sizeof(struct HTTPHeaderField));
-    h->name = xmalloc(p - buf);
-    strcpy(h->name, buf); // name のセット
+// inotifyのイベントを読み出して、変更されたファイルのエントリを捨てる
+static void process_file_events(void)
+{
+    struct FileCache *cache = &file_cache;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    char *p;
 
-    // " \t"がpの先頭から何個あるか数えその長さを返す
-    p += strspn(p, " \t"); // タブは飛ばす
-    h->value = xmalloc(strlen(p) + 1); // strlen(p)はpを先頭ポインタとする文字列の長さ
-    strcpy(h->value, p); // value のセット
+    while ((n = read(cache->inotify_fd, buf, sizeof buf)) > 0) {
+        for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            struct inotify_event *ev = (struct inotify_event*)p;
+            struct CachedFile *file, *next;
 
-    return h;
+            if (ev->mask & IN_Q_OVERFLOW) { // 取りこぼしたので全部捨てる
+                while (cache->tail) drop_file(cache->tail);
+                continue;
+            }
+            for (file = cache->wd_table[(size_t)ev->wd & (cache->nbuckets - 1)]; file; file = next) {
+                next = file->wnext;
+                if (file->wd == ev->wd) drop_file(file);
+            }
+        }
+    }
 }
 
-static long content_length(struct HTTPRequest *req)
+// 小さいファイルなら、レスポンスヘッダとボディをまとめてメモリに用意する
+// 用意できていれば非ゼロを返す
+static int cache_file_response(struct CachedFile *file)
 {
-    char *val;
-    long len;
+    struct FileCache *cache = &file_cache;
+    struct Response r;
+    size_t size = file->info->size;
+    size_t date_off;
+    off_t off;
+    ssize_t n;
 
-    val = lookup_header_field_value(req, "Content-Length");
-    if (!val) return 0;
-    len = atol(val);
-    if (len < 0) log_exit("negative Content-Length value");
-    return len;
+    if (!file->urlpath || size > cache->mem_threshold || size > cache->mem_max) return 0;
+    if (file->mem) {
+        stats_add(&stats->response_cache_hits, 1);
+        return 1;
+    }
+    stats_add(&stats->response_cache_misses, 1);
+
+    r.head.ptr = NULL;
+    r.head.len = r.head.capa = 0;
+    out_puts(&r, STATUS_LINE_PREFIX "200 OK\r\nDate: ");
+    date_off = r.head.len;
+    out_write(&r, current_http_date(), HTTP_DATE_LEN);
+    file->date = http_date_time;
+    out_puts(&r, "\r\n" SERVER_HEADER_FIELD "Content-Length: ");
+    out_long(&r, size);
+    out_puts(&r, "\r\n");
+    output_file_header_fields(file, &r);
+    file->head_len = r.head.len;
+    buf_reserve(&r.head, size);
+    for (off = 0; off < (off_t)size; off += n) {
+        n = pread(file->fd, r.head.ptr + r.head.len + off, size - off, off);
+        if (n <= 0) { // 読んでいる間に縮んだ
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            free(r.head.ptr);
+            return 0;
+        }
+    }
+    r.head.len += size;
+
+    if (!make_room(r.head.len, file)) {
+        free(r.head.ptr);
+        return 0;
+    }
+    file->mem = r.head.ptr;
+    file->mem_len = r.head.len;
+    file->date_off = date_off;
+    cache->mem_used += file->mem_len;
+    return 1;
 }
 
-static char* lookup_header_field_value(struct HTTPRequest *req, char *name)
+// メモリ上のレスポンスを返す
+// Dateだけはその場で書き換え、Connection関係のヘッダはリクエストごとに付け足す
+static void output_cached_response(struct HTTPRequest *req, struct Response *out, struct CachedFile *file)
 {
-    struct HTTPHeaderField *h;
+    char *date = current_http_date();
 
-    for (h = req->header; h; h = h->next) {
-        if (strcasecmp(h->name, name) == 0)
-            return h->value;
+    if (file->date != http_date_time) {
+        memcpy(file->mem + file->date_off, date, HTTP_DATE_LEN);
+        file->date = http_date_time;
     }
-    return NULL;
+    out->status = 200;
+    out_write(out, file->mem, file->head_len);
+    output_connection_header_fields(req, out);
+    out_puts(out, "\r\n");
+    if (strcmp(REQ_STR(req, req->method), "HEAD") == 0) {
+        release_file(file);
+        return;
+    }
+    out->body_file = file;
+    out->body_mem = file->mem + file->head_len;
+    out->body_offset = 0;
+    out->body_length = file->mem_len - file->head_len;
 }
 
-static struct FileInfo* get_fileinfo(char *docroot, char *urlpath)
+// lenバイトを足しても上限に収まるよう、使われていないものから順にメモリを手放す
+// keepのメモリは手放さない。収まれば非ゼロを返す
+static int make_room(size_t len, struct CachedFile *keep)
 {
-    // ドキュメントルートとURLのパスからファイルシステム上のパスを生成
-    struct FileInfo *info;
-    struct stat st;
+    struct FileCache *cache = &file_cache;
+    struct CachedFile *f, *prev;
 
-    info = xmalloc(sizeof(struct FileInfo));
-    info->path = build_fspath(docroot, urlpath);
-    info->ok = 0;
+    for (f = cache->tail; f && cache->mem_used + len > cache->mem_max; f = prev) {
+        prev = f->prev;
+        if (f != keep && f->mem && f->refcnt == 1) free_file_response(f);
+    }
+    return cache->mem_used + len <= cache->mem_max;
+}
 
-    // pathで表されるエントリの情報を取得しstに書きこむ
-    if (lstat(info->path, &st) < 0) return info;  // 失敗時,okは0のままreturn
-    if (!S_ISREG(st.st_mode)) return info; // 通常のファイルじゃない場合、okは0のままreturn
+static void free_file_response(struct CachedFile *file)
+{
+    file_cache.mem_used -= file->mem_len;
+    free(file->mem);
+    file->mem = NULL;
+    file->mem_len = 0;
+}
 
-    info->ok = 1;
-    info->size = st.st_size;
-    return info;
+static void request_stats(int sig)
+{
+    stats_requested = 1;
 }
 
-// このままだと ../../のようなパスが渡されるとドキュメントルート外のファイルが見える
-static char* build_fspath(char *docroot, char *urlpath)
+static void log_file_cache_stats(void)
 {
-    char *path;
+    struct FileCache *cache = &file_cache;
+    const char *fmt = "file cache: %d files, response cache: %zu bytes, %lu hits, %lu misses";
 
-    // 2回の+1は'/'の分と末尾の'\0'の分
-    path = xmalloc(strlen(docroot) + 1 + strlen(urlpath) + 1);
-    sprintf(path, "%s%s", docroot, urlpath); // docroot + urlpathをpathに書き込み
-    return path;
+    if (debug_mode) {
+        fprintf(stderr, fmt, cache->n, cache->mem_used, stats->response_cache_hits, stats->response_cache_misses);
+        fputc('\n', stderr);
+    } else {
+        syslog(LOG_INFO, fmt, cache->n, cache->mem_used, stats->response_cache_hits, stats->response_cache_misses);
+    }
 }
 
-static void free_fileinfo(struct FileInfo *info)
+static void lru_remove(struct FileCache *cache, struct CachedFile *file)
 {
-    free(info->path);
-    free(info);
+    if (file->prev)
+        file->prev->next = file->next;
+    else
+        cache->head = file->next;
+    if (file->next)
+        file->next->prev = file->prev;
+    else
+        cache->tail = file->prev;
+    file->prev = file->next = NULL;
 }
 
-// HTTPリクエストreqに対するレスポンスをoutに書き込む
-static void respond_to(struct HTTPRequest *req, FILE *out, char *docroot)
+static void lru_push(struct FileCache *cache, struct CachedFile *file)
 {
-    if (strcmp(req->method, "GET") == 0)
-        do_file_response(req, out, docroot);
-    else if (strcmp(req->method, "HEAD") == 0)
-        do_file_response(req, out, docroot);
-    else if (strcmp(req->method, "POST") == 0)
-        method_not_allowed(req, out);
+    file->prev = NULL;
+    file->next = cache->head;
+    if (cache->head)
+        cache->head->prev = file;
     else
-        not_implemented(req, out);
+        cache->tail = file;
+    cache->head = file;
 }
 
-static void do_file_response(struct HTTPRequest *req, FILE *out, char *docroot)
+// FNV-1a
+static unsigned long hash_string(char *str)
 {
-    struct FileInfo *info;
+    unsigned long h = 2166136261UL;
 
-    info = get_fileinfo(docroot, req->path);
-    if (!info->ok) {
-        free_fileinfo(info);
-        not_found(req, out);
-        return;
+    for (; *str; str++) {
+        h ^= (unsigned char)*str;
+        h *= 16777619UL;
     }
+    return h;
+}
 
-    // レスポンスヘッダの出力
-    output_common_header_fields(req, out, "200 OK");
-    fprintf(out, "Content-Length: %ld\r\n", info->size);
-    fprintf(out, "Content-Type: %s\r\n", guess_content_type(info));
-    fprintf(out, "\r\n");
-
-    if (strcmp(req->method, "HEAD") != 0) {
-        // レスポンスバディの出力
-
-        int fd;
-        char buf[BLOCK_BUF_SIZE];
-        ssize_t n;
-        
-        fd = open(info->path, O_RDONLY);
-        if (fd < 0)
-            log_exit("failed to open %s: %s", info->path, strerror(errno));
-        for (;;) {
-            // リクエストされたファイルの読み込み
-            n = read(fd, buf, BLOCK_BUF_SIZE);
-            if (n < 0)
-                log_exit("failed to read %s: %s", info->path, strerror(errno));
-            if (n == 0)
-                break;
-            // out にファイルの内容を書き込む
-            if (fwrite(buf, 1, n, out) < n)
-                log_exit("failed to write to socket");
-        }
-        close(fd);
+/****** Header Scanning **************************************************/
+
+// どの実装も p から SCAN_PADDING バイト先までは読み書きできる前提で動く
+// (受信バッファの末尾に余白を取ってあるので、端数を1バイトずつ処理しなくてよい)
+// 書き換えるのは [p, p+len) だけで、余白の中身は元の値のまま書き戻す
+
+static struct Scanner scalar_scanner = { "scalar", find_char2_scalar, fold_case_scalar };
+
+static char* find_char2_scalar(char *p, char *end, int c1, int c2)
+{
+    if (c1 == c2) return memchr(p, c1, end - p);
+    for (; p < end; p++) {
+        if (*p == c1 || *p == c2) return p;
     }
-    fflush(out);
-    free_fileinfo(info);
+    return NULL;
 }
 
-static void method_not_allowed(struct HTTPRequest *req, FILE *out)
+// p[0..len)の英字を大文字(upper)または小文字に変換
+// ヘッダはASCIIなので、ロケールを見るtoupper()/tolower()は使わずに0x20を反転させる
+static void fold_case_scalar(char *p, size_t len, int upper)
 {
-    output_common_header_fields(req, out, "405 Method Not Allowed");
-    fprintf(out, "Content-Type: text/html\r\n");
-    fprintf(out, "\r\n");
-    fprintf(out, "<html>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<title>405 Method Not Allowed</title>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<body>\r\n");
-    fprintf(out, "<p>The request method %s is not allowed</p>\r\n", req->method);
-    fprintf(out, "</body>\r\n");
-    fprintf(out, "</html>\r\n");
-    fflush(out);
+    unsigned char first = upper ? 'a' : 'A';
+    char *end = p + len;
+
+    for (; p < end; p++) {
+        if ((unsigned char)(*p - first) < 26) *p ^= 0x20;
+    }
 }
 
-static void not_implemented(struct HTTPRequest *req, FILE *out)
+#ifdef HAVE_X86_SIMD
+// 16バイトずつ: pcmpestriで{c1, c2}のどちらかが最初に現れる位置を求める
+__attribute__((target("sse4.2")))
+static char* find_char2_sse42(char *p, char *end, int c1, int c2)
 {
-    output_common_header_fields(req, out, "501 Not Implemented");
-    fprintf(out, "Content-Type: text/html\r\n");
-    fprintf(out, "\r\n");
-    fprintf(out, "<html>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<title>501 Not Implemented</title>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<body>\r\n");
-    fprintf(out, "<p>The request method %s is not implemented</p>\r\n", req->method);
-    fprintf(out, "</body>\r\n");
-    fprintf(out, "</html>\r\n");
-    fflush(out);
+    __m128i set = _mm_setr_epi8(c1, c2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+    for (; p < end; p += 16) {
+        __m128i x = _mm_loadu_si128((__m128i*)p);
+        int i = _mm_cmpestri(set, 2, x, 16,
+                             _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+
+        if (i < 16) return p + i < end ? p + i : NULL;
+    }
+    return NULL;
 }
 
-static void not_found(struct HTTPRequest *req, FILE *out)
+// 'a'..'z'(または'A'..'Z')の範囲にあり、かつlenより手前のバイトだけ0x20を反転させる
+__attribute__((target("sse4.2")))
+static void fold_case_sse42(char *p, size_t len, int upper)
 {
-    output_common_header_fields(req, out, "404 Not Found");
-    fprintf(out, "Content-Type: text/html\r\n");
-    fprintf(out, "\r\n");
-    if (strcmp(req->method, "HEAD") != 0) {
-        fprintf(out, "<html>\r\n");
-        fprintf(out, "<header><title>Not Found</title><header>\r\n");
-        fprintf(out, "<body><p>File not found</p></body>\r\n");
-        fprintf(out, "</html>\r\n");
+    char first = upper ? 'a' : 'A';
+    __m128i lo = _mm_set1_epi8(first - 1);
+    __m128i hi = _mm_set1_epi8(first + 26);
+    __m128i bit = _mm_set1_epi8(0x20);
+    __m128i iota = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    size_t i;
+
+    for (i = 0; i < len; i += 16) {
+        __m128i x = _mm_loadu_si128((__m128i*)(p + i));
+        __m128i rest = _mm_set1_epi8((char)(len - i < 16 ? len - i : 16));
+        __m128i m = _mm_and_si128(_mm_cmpgt_epi8(x, lo), _mm_cmpgt_epi8(hi, x));
+
+        m = _mm_and_si128(m, _mm_cmpgt_epi8(rest, iota));
+        _mm_storeu_si128((__m128i*)(p + i), _mm_xor_si128(x, _mm_and_si128(m, bit)));
     }
-    fflush(out);
 }
 
-#define TIME_BUF_SIZE 64
-static void output_common_header_fields(struct HTTPRequest *req, FILE *out, char *status)
+// 32バイトずつ: c1, c2それぞれと比較したマスクの最下位ビットが最初の出現位置
+__attribute__((target("avx2")))
+static char* find_char2_avx2(char *p, char *end, int c1, int c2)
 {
-    time_t t;
-    struct tm *tm;
-    char buf[TIME_BUF_SIZE];
+    __m256i v1 = _mm256_set1_epi8(c1);
+    __m256i v2 = _mm256_set1_epi8(c2);
 
-    t = time(NULL);
-    tm = gmtime(&t);
-    if (!tm) log_exit("gmtime() failed: %s", strerror(errno));
-    strftime(buf, TIME_BUF_SIZE, "%a, %d %b %Y %H:%M:%S GMT", tm);
-    fprintf(out, "HTTP/1.%d %s\r\n", HTTP_MINOR_VERSION, status);
-    fprintf(out, "Date: %s\r\n", buf);
-    fprintf(out, "Server: %s/%s\r\n", SERVER_NAME, SERVER_VERSION);
-    fprintf(out, "Connection: close\r\n");
+    for (; p < end; p += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i*)p);
+        unsigned int m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(x, v1),
+                                                              _mm256_cmpeq_epi8(x, v2)));
+
+        if (m) return p + __builtin_ctz(m) < end ? p + __builtin_ctz(m) : NULL;
+    }
+    return NULL;
 }
 
-static void free_request(struct HTTPRequest *req)
+__attribute__((target("avx2")))
+static void fold_case_avx2(char *p, size_t len, int upper)
 {
-    struct HTTPHeaderField *h, *head; // hは作業用変数
+    char first = upper ? 'a' : 'A';
+    __m256i lo = _mm256_set1_epi8(first - 1);
+    __m256i hi = _mm256_set1_epi8(first + 26);
+    __m256i bit = _mm256_set1_epi8(0x20);
+    __m256i iota = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                    16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+    size_t i;
 
-    head = req->header;
+    for (i = 0; i < len; i += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i*)(p + i));
+        __m256i rest = _mm256_set1_epi8((char)(len - i < 32 ? len - i : 32));
+        __m256i m = _mm256_and_si256(_mm256_cmpgt_epi8(x, lo), _mm256_cmpgt_epi8(hi, x));
 
-    // HTTPヘッダ領域のメモリ解放
-    while (head) {
-        h = head;
-        head = head->next;
-        free(h->name);
-        free(h->value);
-        free(h);
+        m = _mm256_and_si256(m, _mm256_cmpgt_epi8(rest, iota));
+        _mm256_storeu_si256((__m256i*)(p + i), _mm256_xor_si256(x, _mm256_and_si256(m, bit)));
     }
+}
 
-    free(req->method);
-    free(req->path);
-    free(req->body);
-    free(req);
+static struct Scanner sse42_scanner = { "sse4.2", find_char2_sse42, fold_case_sse42 };
+static struct Scanner avx2_scanner = { "avx2", find_char2_avx2, fold_case_avx2 };
+#endif
+
+static void init_scanner(void)
+{
+    scanner = &scalar_scanner;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scanner = &avx2_scanner;
+    else if (__builtin_cpu_supports("sse4.2"))
+        scanner = &sse42_scanner;
+#endif
 }
 
-// SIGPIPEを捕捉時、signal_exit関数を呼び出す(ログ出力して終了)
-static void install_signal_handlers(void)
+/****** MIME Types *******************************************************/
+
+// /etc/mime.types と同じ形式の組み込みの対応表
+// mime.typesが読めない環境(chrootの中など)ではこれを使う
+static const char default_mime_types[] =
+    "text/html html htm\n"
+    "text/css css\n"
+    "text/javascript js mjs\n"
+    "text/plain txt text log\n"
+    "text/markdown md\n"
+    "text/csv csv\n"
+    "text/xml xml\n"
+    "application/json json map\n"
+    "application/manifest+json webmanifest\n"
+    "application/wasm wasm\n"
+    "application/pdf pdf\n"
+    "application/zip zip\n"
+    "application/gzip gz\n"
+    "application/x-tar tar\n"
+    "image/png png\n"
+    "image/jpeg jpg jpeg\n"
+    "image/gif gif\n"
+    "image/webp webp\n"
+    "image/avif avif\n"
+    "image/svg+xml svg svgz\n"
+    "image/x-icon ico\n"
+    "font/woff woff\n"
+    "font/woff2 woff2\n"
+    "font/ttf ttf\n"
+    "font/otf otf\n"
+    "audio/mpeg mp3\n"
+    "audio/ogg ogg oga\n"
+    "audio/wav wav\n"
+    "video/mp4 mp4\n"
+    "video/webm webm\n";
+
+// mime.typesの形式のファイルを読み込んで拡張子の表を作る
+// 起動時(chrootより前)に1回だけ呼ぶ. 既定のファイルが読めなければ組み込みの表を使う
+static void init_mime_types(char *path, int required)
 {
-    trap_signal(SIGPIPE, signal_exit);
-    detach_children();
+    FILE *f;
+    char *text = NULL;
+    size_t len = 0, capa = 0, n;
+
+    f = fopen(path, "r");
+    if (!f && required) log_exit("failed to open %s: %s", path, strerror(errno));
+    if (f) {
+        do {
+            if (len + BLOCK_BUF_SIZE + 1 > capa) {
+                capa = capa ? capa * 2 : LINE_BUF_SIZE;
+                text = xrealloc(text, capa);
+            }
+            n = fread(text + len, 1, capa - len - 1, f);
+            len += n;
+        } while (n > 0);
+        fclose(f);
+    }
+    if (len == 0) {
+        free(text);
+        len = sizeof default_mime_types - 1;
+        text = xmalloc(len + 1);
+        memcpy(text, default_mime_types, len);
+    }
+    text[len] = '\0';
+    // 表の文字列はtextの中を指しているので、textは解放しない
+    parse_mime_types(text);
 }
 
-static void trap_signal(int sig, sighandler_t handler)
+// "type ext1 ext2 ..." の行を区切って、拡張子ごとに表に登録する
+static void parse_mime_types(char *text)
 {
-    struct sigaction act;
+    char *line, *next, *type, *ext, *save;
 
-    act.sa_handler = handler;
-    sigemptyset(&act.sa_mask);
-    act.sa_flags = SA_RESTART;
-    if (sigaction(sig, &act, NULL) < 0)
-        log_exit("sigaction() failed: %s", strerror(errno));
+    for (line = text; line; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        if (line[strspn(line, " \t")] == '#') continue;
+        type = strtok_r(line, " \t\r", &save);
+        if (!type) continue;
+        while ((ext = strtok_r(NULL, " \t\r", &save)))
+            add_mime_type(ext, type);
+    }
 }
 
-static void signal_exit(int sig)
+// 拡張子は小文字にそろえて登録する. 同じ拡張子は先に書かれたものを優先する
+static void add_mime_type(char *ext, char *type)
 {
-    log_exit("exit by signal %d", sig);
+    struct MimeType *m;
+
+    if ((mime_table.n + 1) * 2 > mime_table.nslots) grow_mime_table();
+    fold_case_scalar(ext, strlen(ext), 0);
+    m = find_mime_slot(ext);
+    if (m->ext) return;
+    m->ext = ext;
+    m->type = type;
+    mime_table.n++;
 }
 
-static void detach_children(void)
+// 使用率が半分を超えないように表を倍に広げる
+static void grow_mime_table(void)
 {
-    struct sigaction act;
+    struct MimeType *old = mime_table.slots;
+    size_t i, nold = mime_table.nslots;
 
-    act.sa_handler = noop_handler;
-    sigemptyset(&act.sa_mask);
-    act.sa_flags = SA_RESTART | SA_NOCLDWAIT;
-    if (sigaction(SIGCHLD, &act, NULL) < 0) {
-        log_exit("sigaction() failed: %s", strerror(errno));
+    mime_table.nslots = nold ? nold * 2 : 64;
+    mime_table.slots = xmalloc(sizeof(struct MimeType) * mime_table.nslots);
+    memset(mime_table.slots, 0, sizeof(struct MimeType) * mime_table.nslots);
+    for (i = 0; i < nold; i++) {
+        if (old[i].ext) *find_mime_slot(old[i].ext) = old[i];
     }
+    free(old);
 }
 
-static void noop_handler(int sig)
+// extのスロット, なければextを入れるべき空きスロットを返す(線形探査)
+static struct MimeType* find_mime_slot(char *ext)
 {
-    ;
+    size_t mask = mime_table.nslots - 1;
+    size_t i = hash_string(ext) & mask;
+
+    while (mime_table.slots[i].ext && strcmp(mime_table.slots[i].ext, ext) != 0)
+        i = (i + 1) & mask;
+    return &mime_table.slots[i];
 }
 
-// strの文字列を大文字に変換
-static void upcase(char *str)
+// パスの拡張子からContent-Typeを決める
+static char* lookup_mime_type(char *path)
 {
-    char *p;
+    char ext[MAX_EXTENSION_LEN + 1];
+    char *base, *dot;
+    struct MimeType *m;
+    size_t len;
 
-    for (p = str; *p; p++) {
-        *p = (char)toupper((int)*p);
-    }
+    base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    dot = strrchr(base, '.');
+    // ".htaccess" のような先頭のドットは拡張子ではない
+    if (!dot || dot == base || !mime_table.slots) return DEFAULT_CONTENT_TYPE;
+    len = strlen(dot + 1);
+    if (len == 0 || len > MAX_EXTENSION_LEN) return DEFAULT_CONTENT_TYPE;
+    memcpy(ext, dot + 1, len + 1);
+    fold_case_scalar(ext, len, 0);
+    m = find_mime_slot(ext);
+    return m->ext ? m->type : DEFAULT_CONTENT_TYPE;
 }
 
+// Content-Typeはget_fileinfo()でファイルごとに1回だけ決めておく
 static char* guess_content_type(struct FileInfo *info)
 {
-    return "text/plain";   /* FIXME */
+    return info->content_type;
 }
 
 static void* xmalloc(size_t sz)
@@ -654,6 +5590,15 @@ static void* xmalloc(size_t sz)
     return p;
 }
 
+static void* xrealloc(void *ptr, size_t sz)
+{
+    void *p;
+
+    p = realloc(ptr, sz);
+    if (!p) log_exit("failed to allocate memory");
+    return p;
+}
+
 // printf()と同じ形式の引数を受け付け、それをフォーマットしたものを標準エラー出力に出力し、exit()
 static void log_exit(const char *fmt, ...)
 {
@@ -668,4 +5613,4 @@ static void log_exit(const char *fmt, ...)
     }
     va_end(ap);
     exit(1);
-}
\ No newline at end of file
+}
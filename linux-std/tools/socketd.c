@@ -0,0 +1,281 @@
+/*
+    socketd.c -- httpd2をソケットアクティベーションで動かすための小さなスーパーバイザ
+
+    $ gcc -O2 -o socketd socketd.c
+    $ ./socketd [--port=80] [--backlog=n] command [arg...]
+
+    接続待ちソケットを自分で作って持ち続け、systemdと同じLISTEN_FDS/LISTEN_PIDの
+    約束事でfd 3として子プロセスに渡す。子プロセスが終了したら起動し直す。
+    SIGHUPを受けると新しい子プロセスを起動し、acceptを始めたと知らせてくるのを待ってから
+    古い子プロセスにSIGQUITを送る。古いhttpd2は処理中の接続を終えてから終了するので、
+    サーバの再起動やバイナリの入れ替えの間も接続はキューに溜まり、失われない。
+    知らせはSOCKETD_READY_FDで渡したソケットに1バイト書いてもらう。READY_TIMEOUT秒のうちに
+    届かなければ、新しい子プロセスを終了させて古い子プロセスを動かし続ける。
+    SIGTERM/SIGINTで子プロセスを終了させてから自分も終了する。
+
+    子プロセスは前面で動かすこと(httpd2なら--debug)。デーモンになって親が終了すると
+    終了したとみなして起動し直してしまう。
+
+    $ ./socketd --port=8080 ../syakyou/httpd2 --debug --engine=epoll /tmp/www &
+    $ kill -HUP %1    # httpd2を再起動する
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <getopt.h>
+
+/****** Constants ********************************************************/
+
+#define DEFAULT_PORT "80" // httpd2と同じ
+#define SD_LISTEN_FDS_START 3
+#define RESTART_INTERVAL 1 // 起動直後に落ち続ける子プロセスを起動し直す間隔(秒)
+#define READY_ENV "SOCKETD_READY_FD" // 子プロセスに、acceptを始めたと知らせるfdを教える
+#define READY_TIMEOUT 10 // SIGHUPで起動した子プロセスがacceptを始めるのを待つ時間(秒)
+
+/****** Function Prototypes **********************************************/
+
+static int listen_socket(char *port, int backlog);
+static pid_t spawn_child(int sock, char **argv, int *ready);
+static int wait_ready(int ready);
+static void handle_signal(int sig);
+static void trap_signal(int sig, void (*handler)(int));
+
+/****** Main *************************************************************/
+
+#define USAGE "Usage: %s [--port=n] [--backlog=n] command [arg...]\n"
+
+static struct option longopts[] = {
+    {"port",    required_argument, NULL, 'p'},
+    {"backlog", required_argument, NULL, 'b'},
+    {"help",    no_argument,       NULL, 'h'},
+    {0, 0, 0, 0}
+};
+
+static volatile sig_atomic_t restart_requested = 0;
+static volatile sig_atomic_t terminate_requested = 0;
+
+int main(int argc, char *argv[])
+{
+    char *port = DEFAULT_PORT;
+    int backlog = SOMAXCONN;
+    int sock, opt;
+    pid_t child;
+    time_t started;
+
+    // "+"でcommandの引数をオプションとして解釈しない
+    while ((opt = getopt_long(argc, argv, "+", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'p':
+            port = optarg;
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            if (backlog < 1) {
+                fprintf(stderr, "--backlog must be positive\n");
+                exit(1);
+            }
+            break;
+        case 'h':
+            fprintf(stdout, USAGE, argv[0]);
+            exit(0);
+        case '?':
+            fprintf(stderr, USAGE, argv[0]);
+            exit(1);
+        }
+    }
+    if (optind == argc) {
+        fprintf(stderr, USAGE, argv[0]);
+        exit(1);
+    }
+
+    sock = listen_socket(port, backlog);
+    trap_signal(SIGHUP, handle_signal);
+    trap_signal(SIGTERM, handle_signal);
+    trap_signal(SIGINT, handle_signal);
+    child = spawn_child(sock, argv + optind, NULL);
+    started = time(NULL);
+    for (;;) {
+        int status;
+        pid_t pid;
+
+        if (terminate_requested) {
+            kill(child, SIGTERM);
+            waitpid(child, NULL, 0);
+            exit(0);
+        }
+        if (restart_requested) {
+            pid_t new;
+            int ready;
+
+            // 新しい子プロセスがacceptを始めてから、古い方に残りの接続を片付けて終了させる
+            restart_requested = 0;
+            new = spawn_child(sock, argv + optind, &ready);
+            fprintf(stderr, "socketd: restarting: pid %d -> %d\n", (int)child, (int)new);
+            if (wait_ready(ready)) {
+                kill(child, SIGQUIT);
+                child = new;
+                started = time(NULL);
+            } else {
+                fprintf(stderr, "socketd: pid %d did not become ready, keeping pid %d\n",
+                        (int)new, (int)child);
+                kill(new, SIGTERM);
+            }
+        }
+        pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            perror("wait");
+            exit(1);
+        }
+        if (pid != child) continue; // SIGHUPで入れ替えた古い子プロセス
+        if (WIFSIGNALED(status))
+            fprintf(stderr, "socketd: pid %d killed by signal %d\n", (int)pid, WTERMSIG(status));
+        else
+            fprintf(stderr, "socketd: pid %d exited with status %d\n", (int)pid, WEXITSTATUS(status));
+        if (terminate_requested) exit(0);
+        if (time(NULL) - started < RESTART_INTERVAL) sleep(RESTART_INTERVAL);
+        child = spawn_child(sock, argv + optind, NULL);
+        started = time(NULL);
+    }
+}
+
+/****** Socket ***********************************************************/
+
+static int listen_socket(char *port, int backlog)
+{
+    struct addrinfo hints, *res, *ai;
+    int err;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if ((err = getaddrinfo(NULL, port, &hints, &res)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+        exit(1);
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        int sock, on = 1;
+
+        sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (sock < 0) continue;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+        if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0 || listen(sock, backlog) < 0) {
+            close(sock);
+            continue;
+        }
+        freeaddrinfo(res);
+        return sock;
+    }
+    fprintf(stderr, "failed to listen on port %s\n", port);
+    exit(1);
+}
+
+/****** Child process ****************************************************/
+
+// sockをfd 3にしてcommandを実行する
+// readyがNULLでなければ、子プロセスが準備できたと知らせてくるソケットを*readyに返す
+static pid_t spawn_child(int sock, char **argv, int *ready)
+{
+    char buf[32];
+    int sv[2];
+    pid_t pid;
+
+    if (ready && socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid > 0) {
+        if (ready) {
+            close(sv[1]);
+            *ready = sv[0];
+        }
+        return pid;
+    }
+
+    trap_signal(SIGHUP, SIG_DFL);
+    trap_signal(SIGTERM, SIG_DFL);
+    trap_signal(SIGINT, SIG_DFL);
+    // dup2()したfdはFD_CLOEXECが外れる。同じ番号ならフラグだけ外す
+    if (sock == SD_LISTEN_FDS_START) {
+        if (fcntl(sock, F_SETFD, 0) < 0) _exit(99);
+    } else if (dup2(sock, SD_LISTEN_FDS_START) < 0) {
+        _exit(99);
+    }
+    if (ready) {
+        // fd 3とぶつからないよう、その後ろの番号に置く(FD_CLOEXECも外れる)
+        int fd = fcntl(sv[1], F_DUPFD, SD_LISTEN_FDS_START + 1);
+
+        if (fd < 0) _exit(99);
+        snprintf(buf, sizeof buf, "%d", fd);
+        setenv(READY_ENV, buf, 1);
+    }
+    snprintf(buf, sizeof buf, "%d", (int)getpid());
+    setenv("LISTEN_PID", buf, 1);
+    setenv("LISTEN_FDS", "1", 1);
+    execvp(argv[0], argv);
+    perror(argv[0]);
+    _exit(99);
+}
+
+// 子プロセスがreadyに1バイト書くのを待つ。書かずに終了したり時間切れになったりすれば0を返す
+static int wait_ready(int ready)
+{
+    struct pollfd pfd;
+    time_t deadline = time(NULL) + READY_TIMEOUT;
+    char c;
+    int ok = 0;
+
+    pfd.fd = ready;
+    pfd.events = POLLIN;
+    while (!terminate_requested && time(NULL) < deadline) {
+        int n = poll(&pfd, 1, (deadline - time(NULL)) * 1000);
+
+        if (n < 0 && errno == EINTR) continue; // SIGHUPは入れ替えが済んでからもう一度処理する
+        if (n > 0) ok = read(ready, &c, 1) == 1;
+        break;
+    }
+    close(ready);
+    return ok;
+}
+
+/****** Signal ***********************************************************/
+
+static void handle_signal(int sig)
+{
+    if (sig == SIGHUP)
+        restart_requested = 1;
+    else
+        terminate_requested = 1;
+}
+
+// SA_RESTARTを付けないので、シグナルを受けるとwait(2)がEINTRで戻る
+static void trap_signal(int sig, void (*handler)(int))
+{
+    struct sigaction act;
+
+    act.sa_handler = handler;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    if (sigaction(sig, &act, NULL) < 0) {
+        perror("sigaction");
+        exit(1);
+    }
+}